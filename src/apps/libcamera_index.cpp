@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * libcamera_index.cpp - look up times in a recording index.
+ */
+
+#include <time.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "output/recording_index.hpp"
+
+// Usage:
+//     libcamera-index <index file>
+// summarises the index, and
+//     libcamera-index <index file> <time>...
+// prints, for each time, the segment file and byte offset of the last keyframe
+// at or before it. Times are either seconds since the epoch ("1700000000.5") or
+// local time ("2023-11-14 22:13:20", with an optional fraction of a second).
+
+static bool parseTime(char const *str, int64_t &time_us)
+{
+    char *end;
+    double seconds = strtod(str, &end);
+    if (end != str && *end == 0)
+    {
+        time_us = seconds * 1000000;
+        return true;
+    }
+
+    struct tm tm = {};
+    end = strptime(str, "%Y-%m-%d %H:%M:%S", &tm);
+    if (!end)
+        end = strptime(str, "%Y-%m-%dT%H:%M:%S", &tm);
+    if (!end)
+        return false;
+    double fraction = 0;
+    if (*end == '.')
+        fraction = strtod(end, &end);
+    if (*end)
+        return false;
+    tm.tm_isdst = -1;
+    time_us = (int64_t)mktime(&tm) * 1000000 + fraction * 1000000;
+    return true;
+}
+
+static std::string formatTime(int64_t time_us)
+{
+    time_t t = time_us / 1000000;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    char buf[64];
+    size_t n = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(buf + n, sizeof(buf) - n, ".%03d", (int)(time_us % 1000000 / 1000));
+    return buf;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <index file> [time...]" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        RecordingIndex index(argv[1]);
+        uint64_t size = index.Size();
+
+        if (argc == 2)
+        {
+            std::cout << size << " keyframes";
+            if (size)
+                std::cout << " in segments " << index[0].segment << " to " << index[size - 1].segment << ", from "
+                          << formatTime(index[0].wallclock_us) << " to " << formatTime(index[size - 1].wallclock_us);
+            std::cout << std::endl;
+            return 0;
+        }
+
+        int ret = 0;
+        for (int i = 2; i < argc; i++)
+        {
+            int64_t time_us;
+            RecordingIndex::Record record;
+            if (!parseTime(argv[i], time_us))
+            {
+                std::cerr << "Bad time " << argv[i] << std::endl;
+                ret = 1;
+            }
+            else if (!index.Find(time_us, record))
+            {
+                std::cerr << "No recording at " << argv[i] << std::endl;
+                ret = 1;
+            }
+            else
+                std::cout << index.Filename(record.segment) << " " << record.offset << " "
+                          << formatTime(record.wallclock_us) << std::endl;
+        }
+        return ret;
+    }
+    catch (std::exception const &e)
+    {
+        std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+        return -1;
+    }
+}
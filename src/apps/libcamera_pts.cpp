@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * libcamera_pts.cpp - convert a binary --save-pts file to text.
+ */
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "output/pts_writer.hpp"
+
+// Usage:
+//     libcamera-pts <pts file> [output file]
+// writes the timestamps in mkvmerge's "timecode format v2", and
+//     libcamera-pts --frames <pts file> [output file]
+// lists every frame's timestamp, offset, size, keyframe flag and wall clock
+// time (microseconds since the epoch, 0 if unknown). Files from before wall
+// clock times were recorded can still be read, and show 0.
+
+// The earlier file format, identical but for the wall clock time.
+static constexpr char MAGIC_V1[8] = { 'L', 'C', 'A', 'P', 'T', 'S', '0', '1' };
+struct RecordV1
+{
+    int64_t timestamp_us;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t flags;
+};
+
+int main(int argc, char *argv[])
+{
+    bool frames = argc > 1 && strcmp(argv[1], "--frames") == 0;
+    int arg = frames ? 2 : 1;
+    if (argc < arg + 1 || argc > arg + 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " [--frames] <pts file> [output file]" << std::endl;
+        return 1;
+    }
+
+    FILE *in = fopen(argv[arg], "rb");
+    if (!in)
+    {
+        std::cerr << "ERROR: *** failed to open " << argv[arg] << " ***" << std::endl;
+        return -1;
+    }
+    PtsWriter::Header header;
+    bool ok = fread(&header, sizeof(header), 1, in) == 1;
+    bool v1 = ok && !memcmp(header.magic, MAGIC_V1, sizeof(header.magic));
+    if (!ok || (!v1 && memcmp(header.magic, PtsWriter::MAGIC, sizeof(header.magic))))
+    {
+        std::cerr << "ERROR: *** " << argv[arg] << " is not a timestamp file ***" << std::endl;
+        return -1;
+    }
+    FILE *out = argc > arg + 1 ? fopen(argv[arg + 1], "w") : stdout;
+    if (!out)
+    {
+        std::cerr << "ERROR: *** failed to open " << argv[arg + 1] << " ***" << std::endl;
+        return -1;
+    }
+
+    if (!frames)
+        fprintf(out, "# timecode format v2\n");
+    PtsWriter::Record record;
+    while (true)
+    {
+        if (v1)
+        {
+            RecordV1 old;
+            if (fread(&old, sizeof(old), 1, in) != 1)
+                break;
+            record = { old.timestamp_us, 0, old.offset, old.size, old.flags };
+        }
+        else if (fread(&record, sizeof(record), 1, in) != 1)
+            break;
+
+        if (frames)
+            fprintf(out, "%" PRId64 " %" PRIu64 " %" PRIu32 " %d %" PRId64 "\n", record.timestamp_us, record.offset,
+                    record.size, record.flags & 1, record.wallclock_us);
+        else
+            fprintf(out, "%" PRId64 ".%03" PRId64 "\n", record.timestamp_us / 1000, record.timestamp_us % 1000);
+    }
+
+    fclose(in);
+    if (fclose(out))
+    {
+        std::cerr << "ERROR: *** failed to write output ***" << std::endl;
+        return -1;
+    }
+    return 0;
+}
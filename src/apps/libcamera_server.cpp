@@ -5,7 +5,9 @@
  * libcamera_vid.cpp - libcamera video record app.
  */
 
+#include <algorithm>
 #include <chrono>
+#include <fstream>
 #include <poll.h>
 #include <signal.h>
 #include <fcntl.h>
@@ -17,8 +19,18 @@
 
 #include "core/libcamera_encoder.hpp"
 #include "core/libcamera_app.hpp"
+#include "core/control_socket.hpp"
+#include "core/frame_sync.hpp"
+#include "core/metrics.hpp"
+#include "core/metrics_server.hpp"
+#include "core/trace.hpp"
 #include "output/output.hpp"
 #include "output/net_output.hpp"
+#include "output/circular_output.hpp"
+#include "output/file_output.hpp"
+#include "output/tee_output.hpp"
+#include "output/frame_publisher.hpp"
+#include "output/bitrate_controller.hpp"
 #include "image/image.hpp"
 
 using namespace std::placeholders;
@@ -27,10 +39,16 @@ using namespace std::placeholders;
 const int START_VIDEO_SERVER_SIG = SIGRTMIN + 1;
 const int STOP_VIDEO_SERVER_SIG = SIGRTMIN + 2;
 const int SAVE_IMAGE_SIG = SIGRTMIN + 3;
+const int TRIGGER_EVENT_SIG = SIGRTMIN + 4;
 
+// Command numbers, as sent on the --control socket. The signals above map onto the first four.
 #define START_VIDEO_SERVER_CMD 1
 #define STOP_VIDEO_SERVER_CMD 2
 #define SAVE_IMAGE_CMD 3
+#define TRIGGER_EVENT_CMD 4
+#define SET_PARAMS_CMD 5
+#define STATS_CMD 6
+#define TRACE_CMD 7
 #define NO_CMD 0
 
 #define VIDEO_SERVER_CONNECTED 1
@@ -39,6 +57,11 @@ const int SAVE_IMAGE_SIG = SIGRTMIN + 3;
 
 #define SERVER_WAITING_TIMEOUT 600 // 10 minutes
 
+// How many frames each camera may have waiting for a match with --sync, and how
+// long a snapshot of all of them waits for a matched set before giving up.
+#define SYNC_MAX_QUEUED 2
+#define SYNC_SNAPSHOT_TIMEOUT std::chrono::seconds(2)
+
 
 static int g_signal_received;
 static void control_signal_handler(int signal_number)
@@ -48,7 +71,7 @@ static void control_signal_handler(int signal_number)
 
 
 void save_image(LibcameraEncoder &app, CompletedRequestPtr &payload, libcamera::Stream *stream,
-                       std::string const &filename)
+                       std::string const &filename, int quality)
 {
     StreamInfo info = app.GetStreamInfo(stream);
 
@@ -56,7 +79,7 @@ void save_image(LibcameraEncoder &app, CompletedRequestPtr &payload, libcamera::
 
     if ("jpg")
     {
-        jpeg_save(mem, info, payload->metadata, filename, app.CameraId());
+        jpeg_save(mem, info, payload->metadata, filename, app.CameraId(), quality);
     }
     else if ("png")
     {
@@ -65,6 +88,43 @@ void save_image(LibcameraEncoder &app, CompletedRequestPtr &payload, libcamera::
 }
 
 
+// The publisher is created with the first frame, once we know how big the buffers are.
+static void publish_frame(LibcameraEncoder &app, std::unique_ptr<FramePublisher> &publisher,
+                          CompletedRequestPtr &completed_request, libcamera::Stream *stream)
+{
+    VideoOptions const *options = app.GetOptions();
+    if (options->publish.empty())
+        return;
+    libcamera::FrameBuffer *buffer = completed_request->buffers[stream];
+    libcamera::Span<uint8_t> span = app.Mmap(buffer)[0];
+    if (!publisher)
+    {
+        StreamInfo info = app.GetStreamInfo(stream);
+        publisher = std::make_unique<FramePublisher>(options->publish, info.width, info.height, info.stride,
+                                                     info.pixel_format.fourcc(), span.size(), options->verbose);
+    }
+    int64_t timestamp_ns = completed_request->metadata.contains(libcamera::controls::SensorTimestamp.id())
+                               ? *completed_request->metadata.get(libcamera::controls::SensorTimestamp)
+                               : buffer->metadata().timestamp;
+    // The camera's own sequence number, which shows gaps where frames were lost.
+    publisher->Publish(span.data(), span.size(), buffer->metadata().sequence, timestamp_ns / 1000);
+}
+
+
+static LibcameraEncoder::Msg pop_message(std::queue<LibcameraEncoder::Msg> *queue)
+{
+    LibcameraEncoder::Msg msg = std::move(queue->front());
+    queue->pop();
+    if (Trace::Enabled() && msg.type == LibcameraEncoder::MsgType::RequestComplete)
+    {
+        CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+        auto timestamp_ns = completed_request->metadata.get(libcamera::controls::SensorTimestamp);
+        Trace::Instant("dequeue", timestamp_ns ? *timestamp_ns / 1000 : 0);
+    }
+    return msg;
+}
+
+
 int sig2cmd()
 {
     int cmd = NO_CMD;
@@ -80,26 +140,216 @@ int sig2cmd()
     {
         cmd =  SAVE_IMAGE_CMD;
     }
+    else if (g_signal_received == TRIGGER_EVENT_SIG)
+    {
+        cmd = TRIGGER_EVENT_CMD;
+    }
 
     return cmd;
 }
 
 
-// The main even loop for the application.
+// A snapshot is saved from the next frame of each camera it was asked of, so
+// that snapshots of several cameras are taken as close together as possible.
+// With --sync, a snapshot of all the cameras waits for the next matched set of
+// frames instead. The reply goes once they have all been saved.
+struct Snapshot
+{
+    ControlSocket::Request request;
+    unsigned int remaining;
+    std::string error;
+};
+
+struct PendingSnapshot
+{
+    std::shared_ptr<Snapshot> snapshot;
+    std::string filename;
+    int quality;
+};
+
+
+// Everything belonging to one camera. Each has its own encoder and outputs, and
+// its video server is started and stopped on its own; only the event loop, the
+// control socket and the metrics are shared.
+struct Session
+{
+    Session(std::unique_ptr<VideoOptions> options) : app(std::move(options)) {}
+
+    std::unique_ptr<Output> output; // the tee, or just the NetOutput
+    LibcameraEncoder app; // destroyed before the output, so the encoder can't call it
+    NetOutput *net_output = nullptr;
+    CircularOutput *circular_output = nullptr;
+    bool always_encode = false;
+    std::unique_ptr<FramePublisher> publisher;
+    libcamera::Stream *publish_stream = nullptr;
+    std::unique_ptr<BitrateController> bitrate_controller;
+    int state = IDLE;
+    time_t start_waiting_timestamp = 0;
+    int socket_fd = -1; // while listening for tcp clients
+    unsigned int frames = 0;
+    std::vector<PendingSnapshot> snapshots;
+    std::vector<PendingSnapshot> synced_snapshots; // saved from the next FrameSync set
+};
+
+
+// With several cameras, each needs its own files and sockets. %c in a name
+// becomes the camera number, and names without it get the number added before
+// the extension.
+static std::string per_camera(std::string const &name, unsigned int camera, bool several)
+{
+    size_t pos = name.find("%c");
+    if (pos != std::string::npos)
+        return name.substr(0, pos) + std::to_string(camera) + name.substr(pos + 2);
+    if (!several || name.empty())
+        return name;
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos || dot < name.rfind('/') + 1)
+        dot = name.size();
+    return name.substr(0, dot) + "-" + std::to_string(camera) + name.substr(dot);
+}
 
 
-static void event_loop(LibcameraEncoder &app)
+static std::unique_ptr<VideoOptions> session_options(VideoOptions const &options, unsigned int index)
 {
+    std::unique_ptr<VideoOptions> session_options = std::make_unique<VideoOptions>(options);
+    unsigned int camera = options.camera_list[index];
+    bool several = options.camera_list.size() > 1;
+    session_options->camera = camera;
+    for (std::string *name : { &session_options->output, &session_options->record, &session_options->index,
+                               &session_options->save_pts, &session_options->circular_file,
+                               &session_options->event_output, &session_options->publish })
+        *name = per_camera(*name, camera, several);
+    size_t colon = options.server.rfind(':');
+    if (index && colon != std::string::npos)
+        session_options->server = options.server.substr(0, colon + 1) +
+                                  std::to_string(std::stoi(options.server.substr(colon + 1)) + index);
+    return session_options;
+}
+
+
+static void start_session(Session &session)
+{
+    LibcameraEncoder &app = session.app;
     VideoOptions const *options = app.GetOptions();
 
     app.OpenCamera();
-    app.ConfigureVideo(LibcameraEncoder::FLAG_VIDEO_NONE);
+    app.ConfigureVideo(LibcameraEncoder::FLAG_VIDEO_BUFFER_TUNING);
     app.StartCamera();
 
-    NetOutput *net_output = new NetOutput(options);
+    // When we're also recording, everything goes through a tee and the encoder
+    // runs all the time. Otherwise we only encode while serving the stream.
+    session.always_encode = !options->record.empty() || options->circular;
+    if (session.always_encode)
+    {
+        TeeOutput *tee = new TeeOutput(options);
+        session.output.reset(tee);
+        session.net_output = new NetOutput(tee->ChildOptions());
+        tee->AddOutput(session.net_output);
+        if (!options->record.empty())
+        {
+            VideoOptions *record_options = tee->ChildOptions();
+            record_options->output = options->record;
+            tee->AddOutput(new FileOutput(record_options));
+        }
+        if (options->circular)
+        {
+            // --output is the snapshot filename here, not somewhere to dump the buffer.
+            VideoOptions *circular_options = tee->ChildOptions();
+            circular_options->output.clear();
+            session.circular_output = new CircularOutput(circular_options);
+            tee->AddOutput(session.circular_output);
+        }
+        app.SetEncodeOutputReadyCallback(std::bind(&TeeOutput::OutputReady, tee, _1, _2, _3, _4, _5));
+        app.StartEncoder();
+    }
+    else
+    {
+        session.net_output = new NetOutput(options);
+        session.output.reset(session.net_output);
+    }
+
+    // Analytics get the lores stream if there is one, otherwise the full size frames.
+    session.publish_stream = app.LoresStream() ? app.LoresStream() : app.VideoStream();
+
+    // Adaptive bitrate only has tcp clients to go on.
+    if (options->abr_min_bitrate && !session.net_output->datagram())
+        session.bitrate_controller = std::make_unique<BitrateController>(
+            options->abr_min_bitrate, options->abr_max_bitrate, options->bitrate, options->verbose,
+            "camera=\"" + std::to_string(options->camera) + "\"");
+}
+
+
+static void start_video_server(Session &session)
+{
+    if (session.state != IDLE)
+        return;
+    int socket_fd = session.net_output->startServer();
+    if (!session.always_encode)
+    {
+        session.app.SetEncodeOutputReadyCallback(
+            std::bind(&NetOutput::OutputReady, session.net_output, _1, _2, _3, _4, _5));
+        session.app.StartEncoder();
+    }
+    if (session.net_output->datagram())
+    {
+        // Nobody to wait for, we can start streaming straight away.
+        session.state = VIDEO_SERVER_CONNECTED;
+    }
+    else
+    {
+        session.socket_fd = socket_fd;
+        session.start_waiting_timestamp = time(NULL);
+        session.state = VIDEO_SERVER_WAITING;
+    }
+}
+
+
+static void stop_video_server(Session &session)
+{
+    session.socket_fd = -1;
+    session.net_output->stopServer();
+    if (!session.always_encode)
+        session.app.StopEncoder();
+    session.state = IDLE;
+}
+
+
+// With --buffers auto the camera is reconfigured whenever the buffer count
+// changes. The encoder mustn't be left holding any of the old buffers, so it is
+// restarted too (and so starts again with a keyframe).
+static void reconfigure_camera(Session &session)
+{
+    LibcameraEncoder &app = session.app;
+    bool encoding = session.always_encode || session.state != IDLE;
+    app.StopCamera();
+    if (encoding)
+        app.StopEncoder();
+    app.Teardown();
+    app.ConfigureVideo(LibcameraEncoder::FLAG_VIDEO_BUFFER_TUNING);
+    app.StartCamera();
+    if (encoding)
+        app.StartEncoder();
+    session.publish_stream = app.LoresStream() ? app.LoresStream() : app.VideoStream();
+}
+
+
+static ControlSocket::Request internal_command(int cmd, int camera = -1)
+{
+    ControlSocket::Request request = { -1, 0, (uint16_t)cmd, {}, std::chrono::steady_clock::now() };
+    if (camera >= 0)
+        request.args["camera"] = std::to_string(camera);
+    return request;
+}
+
+
+// The main even loop for the application.
+
+
+static void event_loop(std::vector<std::unique_ptr<Session>> &sessions, VideoOptions const *options)
+{
+    for (auto &session : sessions)
+        start_session(*session);
 
-    int nfds = 0;
-    fd_set rfds;
     sigset_t sigmask;
     struct timespec ts;
 
@@ -108,104 +358,355 @@ static void event_loop(LibcameraEncoder &app)
     signal(SIGRTMIN+1, control_signal_handler);
     signal(SIGRTMIN+2, control_signal_handler);
     signal(SIGRTMIN+3, control_signal_handler);
+    signal(SIGRTMIN+4, control_signal_handler);
 
-    FD_ZERO(&rfds);
     sigemptyset(&sigmask);
 
     ts.tv_sec = 0;
     ts.tv_nsec = 1000000000 / 8;
 
-    int socket_fd = 0;
+    // Commands can come from the control socket as well as from signals.
+    std::unique_ptr<ControlSocket> control;
+    if (!options->control.empty())
+        control = std::make_unique<ControlSocket>(options->control, options->verbose);
+    std::unique_ptr<MetricsServer> metrics;
+    if (!options->metrics.empty())
+        metrics = std::make_unique<MetricsServer>(options->metrics, options->verbose);
+    // Matching frames across cameras only makes sense with more than one.
+    std::unique_ptr<FrameSync> frame_sync;
+    if (options->sync && sessions.size() > 1)
+        frame_sync = std::make_unique<FrameSync>(options->camera_list, (int64_t)options->sync * 1000, SYNC_MAX_QUEUED);
+    Histogram &snapshot_latency = Metrics::GetHistogram("libcamera_snapshot_latency_seconds",
+                                                        "Time from a snapshot being requested to it being saved");
+
+    std::vector<ControlSocket::Request> commands;
+
+    // Commands from signals are answered on stdout.
+    auto reply = [&control](ControlSocket::Request const &request, uint16_t status, std::string const &text) {
+        if (request.client >= 0)
+            control->Reply(request, status, text);
+        else
+            std::cout << (text.empty() ? "DONE" : text) << std::endl;
+    };
+    // With no frame, the snapshot has failed (with the error already set).
+    auto save_snapshots = [&](Session &session, std::vector<PendingSnapshot> &snapshots,
+                              CompletedRequestPtr *completed_request) {
+        for (PendingSnapshot &pending : snapshots)
+        {
+            Snapshot &snapshot = *pending.snapshot;
+            try
+            {
+                if (completed_request)
+                    save_image(session.app, *completed_request, session.app.VideoStream(), pending.filename,
+                               pending.quality);
+            }
+            catch (std::exception const &e)
+            {
+                snapshot.error = e.what();
+            }
+            if (--snapshot.remaining)
+                continue;
+            if (snapshot.error.empty())
+            {
+                std::chrono::duration<double> latency = std::chrono::steady_clock::now() - snapshot.request.received;
+                snapshot_latency.Observe(latency.count());
+                reply(snapshot.request, ControlSocket::STATUS_OK, "");
+            }
+            else if (snapshot.request.client >= 0)
+                reply(snapshot.request, ControlSocket::STATUS_ERROR, snapshot.error);
+            else
+                throw std::runtime_error(snapshot.error);
+        }
+        snapshots.clear();
+    };
+
+    for (;;) {
+        // Wait for frames, signals and sockets.
+        fd_set fds;
+        FD_ZERO(&fds);
+        int max_fd = 0;
+        for (auto &session : sessions)
+        {
+            FD_SET(session->app.EventFd(), &fds);
+            max_fd = std::max(max_fd, session->app.EventFd() + 1);
+            if (session->socket_fd >= 0)
+            {
+                FD_SET(session->socket_fd, &fds);
+                max_fd = std::max(max_fd, session->socket_fd + 1);
+            }
+        }
+        max_fd = control ? control->AddFds(&fds, max_fd) : max_fd;
+        max_fd = metrics ? metrics->AddFds(&fds, max_fd) : max_fd;
+        int retval = pselect(max_fd, &fds, NULL, NULL, &ts, &sigmask);
 
-    time_t start_waiting_timestamp = 0;
-    int state = 0;
-    std::vector<int> commands;
-
-    for (unsigned int count = 0; ; count++) {
-        // Waiting camera frames
-        std::queue<LibcameraEncoder::Msg> *queue = app.Wait();
-        LibcameraEncoder::Msg msg = std::move(queue->front());
-        queue->pop();
-        CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+        if (retval == -1 && errno == EINTR)  // We have received a signal
+            commands.push_back(internal_command(sig2cmd()));
+        // Timeouts and unfinished responses need looking at even when nothing is ready.
+        if (retval <= 0)
+            FD_ZERO(&fds);
 
-        // Handling state
-        switch (state) {
-            case VIDEO_SERVER_CONNECTED:
-            {
-                if (net_output->closed()) {
-                    commands.push_back(STOP_VIDEO_SERVER_CMD);
-                } else {
-                    while (!queue->empty()) {
-                        LibcameraEncoder::Msg msg = std::move(queue->front());
-                        queue->pop();
-                        completed_request = std::get<CompletedRequestPtr>(msg.payload);
-                        app.EncodeBuffer(completed_request, app.VideoStream());
+        for (unsigned int index = 0; index < sessions.size(); index++)
+        {
+            Session *session = sessions[index].get();
+            LibcameraEncoder &app = session->app;
+
+            // Camera frames
+            std::queue<LibcameraEncoder::Msg> queue = app.Poll();
+            while (!queue.empty()) {
+                LibcameraEncoder::Msg msg = pop_message(&queue);
+                if (msg.type != LibcameraEncoder::MsgType::RequestComplete)
+                    continue;
+                CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+                session->frames++;
+                publish_frame(app, session->publisher, completed_request, session->publish_stream);
+                if (session->always_encode ||
+                    (session->state == VIDEO_SERVER_CONNECTED && !session->net_output->closed()))
+                    app.EncodeBuffer(completed_request, app.VideoStream());
+                if (!session->snapshots.empty())
+                    save_snapshots(*session, session->snapshots, &completed_request);
+                if (!frame_sync)
+                    continue;
+                for (FrameSync::FrameSet &set : frame_sync->Add(index, completed_request))
+                {
+                    for (unsigned int i = 0; i < sessions.size(); i++)
+                    {
+                        if (!sessions[i]->synced_snapshots.empty())
+                            save_snapshots(*sessions[i], sessions[i]->synced_snapshots, &set.frames[i]);
                     }
                 }
-                break;
             }
-            case VIDEO_SERVER_WAITING:
+
+            if (session->socket_fd >= 0 && FD_ISSET(session->socket_fd, &fds)) // We have recevied socket connection
             {
-                if (time(NULL) - start_waiting_timestamp > SERVER_WAITING_TIMEOUT) {
-                    commands.push_back(STOP_VIDEO_SERVER_CMD);
-                }
-                break;
+                session->net_output->acceptConnection();
+                session->state = VIDEO_SERVER_CONNECTED;
             }
-        }
 
-        // Wait for signals and sockets
-        int retval = pselect(nfds, &rfds, NULL, NULL, &ts, &sigmask);
+            // Handling state
+            switch (session->state) {
+                case VIDEO_SERVER_CONNECTED:
+                {
+                    if (session->net_output->closed())
+                        commands.push_back(internal_command(STOP_VIDEO_SERVER_CMD, app.GetOptions()->camera));
+                    break;
+                }
+                case VIDEO_SERVER_WAITING:
+                {
+                    if (time(NULL) - session->start_waiting_timestamp > SERVER_WAITING_TIMEOUT)
+                        commands.push_back(internal_command(STOP_VIDEO_SERVER_CMD, app.GetOptions()->camera));
+                    break;
+                }
+            }
 
-        if (retval == -1 && errno == EINTR)  // We have received a signal
-        {
-            commands.push_back(sig2cmd());
+            if (session->bitrate_controller && session->state == VIDEO_SERVER_CONNECTED) {
+                uint32_t bitrate = session->bitrate_controller->Update(session->net_output->QueuedBytes(),
+                                                                       std::chrono::steady_clock::now());
+                if (bitrate) {
+                    EncoderParameters params;
+                    params.bitrate = bitrate;
+                    app.SetEncoderParameters(params);
+                    app.GetOptions()->bitrate = bitrate;
+                }
+            }
         }
-        else if (retval > 0) // We have recevied socket connection
+
+        // Synced snapshots mustn't wait forever if the cameras never line up.
+        // The oldest is first, and every camera has the same ones.
+        if (frame_sync && !sessions[0]->synced_snapshots.empty() &&
+            std::chrono::steady_clock::now() - sessions[0]->synced_snapshots[0].snapshot->request.received >
+                SYNC_SNAPSHOT_TIMEOUT)
         {
-            net_output->acceptConnection();
-            state = VIDEO_SERVER_CONNECTED;
+            for (auto &session : sessions)
+            {
+                for (PendingSnapshot &pending : session->synced_snapshots)
+                    pending.snapshot->error = "no frames from all the cameras within the --sync tolerance";
+                save_snapshots(*session, session->synced_snapshots, nullptr);
+            }
         }
 
-        // Handling command
-        if (commands.size() > 0) {
-            std::vector<int>::iterator iter = commands.begin();
-            for (; iter < commands.end(); iter++)
+        if (control)
+            control->Service(&fds, commands);
+        if (metrics)
+            metrics->Service(&fds);
+
+        // Handling command. Commands for no camera in particular go to all of them.
+        for (ControlSocket::Request const &request : commands)
+        {
+            try
             {
-                switch (*iter) {
+                std::vector<Session *> targets;
+                auto camera = request.args.find("camera");
+                for (auto &session : sessions)
+                {
+                    if (camera == request.args.end() ||
+                        std::to_string(session->app.GetOptions()->camera) == camera->second)
+                        targets.push_back(session.get());
+                }
+                if (targets.empty())
+                    throw std::invalid_argument("no camera " + camera->second);
+
+                switch (request.command) {
+                    case NO_CMD:
+                        break;
                     case SAVE_IMAGE_CMD:
                     {
-                        save_image(app, completed_request, app.VideoStream(), options->output);
-                        std::cout << "DONE" << std::endl;
+                        auto filename = request.args.find("filename");
+                        auto quality = request.args.find("quality");
+                        int q = quality != request.args.end() ? std::stoi(quality->second) : 93;
+                        auto snapshot = std::make_shared<Snapshot>(Snapshot{ request, (unsigned int)targets.size(), "" });
+                        bool synced = frame_sync && targets.size() == sessions.size();
+                        for (Session *session : targets)
+                        {
+                            unsigned int n = session->app.GetOptions()->camera;
+                            (synced ? session->synced_snapshots : session->snapshots).push_back(
+                                { snapshot,
+                                  filename != request.args.end() ? per_camera(filename->second, n, targets.size() > 1)
+                                                                 : session->app.GetOptions()->output,
+                                  q });
+                        }
+                        break; // replied to once saved
+                    }
+                    case TRIGGER_EVENT_CMD:
+                    {
+                        // Only a circular output with an --event-output has anywhere to save an event.
+                        std::string cameras;
+                        for (Session *session : targets)
+                        {
+                            if (!session->circular_output || !session->circular_output->Trigger())
+                                cameras += (cameras.empty() ? "" : " ") +
+                                           std::to_string(session->app.GetOptions()->camera);
+                        }
+                        if (cameras.empty())
+                            reply(request, ControlSocket::STATUS_OK, "");
+                        else
+                            reply(request, ControlSocket::STATUS_ERROR, "no event output for camera " + cameras);
                         break;
                     }
                     case START_VIDEO_SERVER_CMD:
                     {
-                        if (state == IDLE)
+                        std::string ports;
+                        for (Session *session : targets)
                         {
-                            socket_fd = net_output->startServer();
-                            nfds = socket_fd + 1;
-                            FD_SET(socket_fd, &rfds);
-                            app.SetEncodeOutputReadyCallback(std::bind(&NetOutput::OutputReady, net_output, _1, _2, _3, _4));
-                            app.StartEncoder();
-                            start_waiting_timestamp = time(NULL);
-                            state = VIDEO_SERVER_WAITING;
+                            start_video_server(*session);
+                            ports += (ports.empty() ? "" : " ") + std::to_string(session->net_output->get_port());
                         }
-                        std::cout << net_output->get_port() << std::endl;
+                        reply(request, ControlSocket::STATUS_OK, ports);
                         break;
                     }
                     case STOP_VIDEO_SERVER_CMD:
                     {
-                        FD_CLR(socket_fd, &rfds);
-                        nfds = 0;
-                        net_output->stopServer();
-                        app.StopEncoder();
-                        state = IDLE;
-                        std::cout << "DONE" << std::endl;
+                        for (Session *session : targets)
+                            stop_video_server(*session);
+                        reply(request, ControlSocket::STATUS_OK, "");
+                        break;
+                    }
+                    case SET_PARAMS_CMD:
+                    {
+                        // A running encoder picks these up at the next frame. They go in the
+                        // options too, so that they stick if the encoder is restarted.
+                        EncoderParameters params;
+                        for (auto const &[key, value] : request.args)
+                        {
+                            if (key == "bitrate")
+                                params.bitrate = std::stoul(value);
+                            else if (key == "intra")
+                                params.intra = std::stoul(value);
+                            else if (key == "quality")
+                                params.quality = std::stoi(value);
+                            else if (key == "keyframe")
+                                params.keyframe = true;
+                            else if (key != "camera")
+                                throw std::invalid_argument("unknown parameter " + key);
+                        }
+                        for (Session *session : targets)
+                        {
+                            session->app.SetEncoderParameters(params);
+                            VideoOptions *video_options = session->app.GetOptions();
+                            if (params.bitrate)
+                                video_options->bitrate = *params.bitrate;
+                            if (params.intra)
+                                video_options->intra = *params.intra;
+                            if (params.quality)
+                                video_options->quality = *params.quality;
+                        }
+                        reply(request, ControlSocket::STATUS_OK, "");
+                        break;
+                    }
+                    case TRACE_CMD:
+                    {
+                        if (!Trace::Enabled())
+                            throw std::runtime_error("tracing is not enabled (use --trace)");
+                        std::string const &filename = request.args.at("file");
+                        std::ofstream file(filename);
+                        Trace::Dump(file);
+                        if (!file)
+                            throw std::runtime_error("failed to write trace to " + filename);
+                        reply(request, ControlSocket::STATUS_OK, "");
                         break;
                     }
+                    case STATS_CMD:
+                    {
+                        std::string stats;
+                        for (Session *session : targets)
+                        {
+                            if (sessions.size() > 1)
+                                stats += "camera " + std::to_string(session->app.GetOptions()->camera) + "\n";
+                            stats += "state " + std::to_string(session->state) + "\nframes " +
+                                     std::to_string(session->frames) + "\nport " +
+                                     std::to_string(session->net_output->get_port()) + "\n";
+                            if (session->bitrate_controller)
+                            {
+                                BitrateController::Stats abr = session->bitrate_controller->GetStats();
+                                stats += "abr bitrate=" + std::to_string(abr.bitrate) + " queued_bytes=" +
+                                         std::to_string(abr.queued_bytes) + " decreases=" +
+                                         std::to_string(abr.decreases) + " increases=" +
+                                         std::to_string(abr.increases) + "\n";
+                            }
+                        }
+                        if (frame_sync)
+                        {
+                            FrameSync::Stats sync = frame_sync->GetStats();
+                            std::string unmatched;
+                            for (uint64_t n : sync.unmatched)
+                                unmatched += (unmatched.empty() ? "" : ",") + std::to_string(n);
+                            stats += "sync sets=" + std::to_string(sync.sets) + " unmatched=" + unmatched +
+                                     " mean_skew_us=" + std::to_string(sync.mean_skew_ns / 1000) +
+                                     " max_skew_us=" + std::to_string(sync.max_skew_ns / 1000) + "\n";
+                        }
+                        if (control)
+                            stats += control->Stats();
+                        reply(request, ControlSocket::STATUS_OK, stats);
+                        break;
+                    }
+                    default:
+                        reply(request, ControlSocket::STATUS_UNKNOWN_COMMAND, "");
                 }
             }
-            commands.clear();
+            catch (std::invalid_argument const &e)
+            {
+                reply(request, ControlSocket::STATUS_BAD_ARGUMENT, e.what());
+            }
+            catch (std::out_of_range const &e)
+            {
+                reply(request, ControlSocket::STATUS_BAD_ARGUMENT, e.what());
+            }
+            catch (std::exception const &e)
+            {
+                if (request.client < 0)
+                    throw;
+                reply(request, ControlSocket::STATUS_ERROR, e.what());
+            }
+        }
+        commands.clear();
+
+        // Frames waiting for a match still hold the old buffers.
+        for (auto &session : sessions)
+        {
+            if (!session->app.BufferCountChanged())
+                continue;
+            if (frame_sync)
+                frame_sync->Flush();
+            reconfigure_camera(*session);
         }
     }
 
@@ -216,14 +717,17 @@ int main(int argc, char *argv[])
 {
     try
     {
-        LibcameraEncoder app;
-        VideoOptions *options = app.GetOptions();
-        if (options->Parse(argc, argv))
+        VideoOptions options;
+        if (options.Parse(argc, argv))
         {
-            if (options->verbose)
-                options->Print();
-
-            event_loop(app);
+            if (options.verbose)
+                options.Print();
+
+            // One session for each camera, all sharing the one CameraManager.
+            std::vector<std::unique_ptr<Session>> sessions;
+            for (unsigned int i = 0; i < options.camera_list.size(); i++)
+                sessions.push_back(std::make_unique<Session>(session_options(options, i)));
+            event_loop(sessions, &options);
         }
     }
     catch (std::exception const &e)
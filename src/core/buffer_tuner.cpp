@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * buffer_tuner.cpp - find the fewest camera buffers the application can get by with.
+ */
+
+#include <algorithm>
+#include <iostream>
+
+#include "core/buffer_tuner.hpp"
+
+BufferTuner::BufferTuner(bool verbose)
+	: verbose_(verbose), count_(INITIAL_COUNT), high_water_(0), frames_(0), settled_(false)
+{
+}
+
+void BufferTuner::Update(unsigned int held, unsigned int total)
+{
+	high_water_ = std::max(high_water_, held);
+	unsigned int wanted = std::clamp(high_water_ + MARGIN, MIN_COUNT, MAX_COUNT);
+	if (held >= total && wanted > total)
+		change(total, wanted, "camera starved");
+	else if (!settled_ && ++frames_ >= WARMUP_FRAMES)
+	{
+		settled_ = true;
+		if (wanted < total)
+			change(total, wanted, "warm-up done");
+		else if (verbose_)
+			std::cerr << "BufferTuner: settled on " << total << " buffers" << std::endl;
+	}
+}
+
+void BufferTuner::change(unsigned int total, unsigned int count, char const *reason)
+{
+	// Until the application gets round to reconfiguring, we may be asked for the
+	// same change again, which only needs mentioning once.
+	if (count != Count() || verbose_)
+		std::cerr << "BufferTuner: " << reason << ", at most " << high_water_ << " buffers held, " << total
+				  << " -> " << count << " buffers" << std::endl;
+	count_.store(count, std::memory_order_relaxed);
+	high_water_ = 0;
+	frames_ = 0;
+}
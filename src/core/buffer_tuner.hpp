@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * buffer_tuner.hpp - find the fewest camera buffers the application can get by with.
+ */
+
+#pragma once
+
+#include <atomic>
+
+// Every camera buffer is a full frame of CMA memory, which is scarce on the
+// smaller boards, but too few and the camera runs out of requests and drops
+// frames. With --buffers auto we start at the old fixed count and, for each
+// frame, note how many buffers the application is holding on to. The camera
+// needs one to fill and another queued behind it, so over a warm-up period we
+// settle on the high-water mark plus MARGIN. If the application ever holds all
+// of them, the camera is starving and we grow straight away (and warm up
+// again, if we hadn't finished). Once settled we only ever grow.
+//
+// Changing the count means reconfiguring the camera, which is up to the
+// application; we only say what the count should be.
+
+class BufferTuner
+{
+public:
+	BufferTuner(bool verbose);
+	// What the buffer count should now be. Safe to call from any thread.
+	unsigned int Count() const { return count_.load(std::memory_order_relaxed); }
+	// Call for each frame with how many buffers the application holds, counting
+	// that frame's, and how many there are in all. Frames that arrive before the
+	// application has reconfigured to a new Count() should not be passed in.
+	void Update(unsigned int held, unsigned int total);
+
+private:
+	static constexpr unsigned int INITIAL_COUNT = 6;
+	static constexpr unsigned int MIN_COUNT = 3;
+	static constexpr unsigned int MAX_COUNT = 12;
+	static constexpr unsigned int MARGIN = 2;
+	static constexpr unsigned int WARMUP_FRAMES = 300;
+
+	void change(unsigned int total, unsigned int count, char const *reason);
+
+	bool verbose_;
+	std::atomic<unsigned int> count_;
+	unsigned int high_water_;
+	unsigned int frames_;
+	bool settled_;
+};
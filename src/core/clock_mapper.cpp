@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * clock_mapper.cpp - map timestamps from one clock onto another.
+ */
+
+#include <cstdlib>
+
+#include "core/clock_mapper.hpp"
+
+void ClockMapper::Reset()
+{
+	off_line_ = 0;
+	points_.clear();
+	current_ = { 0, 0 };
+	window_start_ns_ = 0;
+	started_ = false;
+	origin_ns_ = 0;
+	intercept_ns_ = 0;
+	slope_ = 0;
+}
+
+bool ClockMapper::Update(int64_t clock_ns, int64_t reference_ns)
+{
+	Point point = { clock_ns, reference_ns - clock_ns };
+	bool stepped = false;
+	if (started_ && max_step_ns_ && std::llabs(Map(clock_ns) - reference_ns) > max_step_ns_)
+	{
+		if (++off_line_ < STEP_READINGS)
+			return false;
+		Reset();
+		stepped = true;
+	}
+	off_line_ = 0;
+	if (!started_ || clock_ns - window_start_ns_ >= WINDOW_NS)
+	{
+		if (started_)
+		{
+			points_.push_back(current_);
+			if (points_.size() > NUM_WINDOWS)
+				points_.pop_front();
+			fit();
+		}
+		current_ = point;
+		window_start_ns_ = clock_ns;
+		started_ = true;
+	}
+	else if (point.offset_ns < current_.offset_ns)
+		current_ = point;
+
+	// Until the first window is done, the best we have is the smallest offset so far.
+	if (points_.empty())
+	{
+		origin_ns_ = current_.clock_ns;
+		intercept_ns_ = current_.offset_ns;
+	}
+
+	return stepped;
+}
+
+int64_t ClockMapper::Map(int64_t clock_ns) const
+{
+	return clock_ns + intercept_ns_ + static_cast<int64_t>(slope_ * (clock_ns - origin_ns_));
+}
+
+void ClockMapper::fit()
+{
+	// Least squares, relative to the first point so that the doubles keep their precision.
+	Point const &first = points_.front();
+	double n = points_.size(), sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+	for (Point const &p : points_)
+	{
+		double x = p.clock_ns - first.clock_ns, y = p.offset_ns - first.offset_ns;
+		sum_x += x;
+		sum_y += y;
+		sum_xx += x * x;
+		sum_xy += x * y;
+	}
+	double denominator = n * sum_xx - sum_x * sum_x;
+	slope_ = denominator > 0 ? (n * sum_xy - sum_x * sum_y) / denominator : 0;
+	origin_ns_ = first.clock_ns + static_cast<int64_t>(sum_x / n);
+	intercept_ns_ = first.offset_ns + static_cast<int64_t>(sum_y / n);
+}
@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * clock_mapper.hpp - map timestamps from one clock onto another.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+
+// Maps times on one clock (such as a sensor's) onto a reference clock, given
+// readings of the two taken together, or as near together as we can manage.
+// For a sensor, the reference reading is taken when the frame arrives, so it is
+// always late by a delivery latency that varies. The smallest difference seen
+// is the closest to the true offset, so we keep the smallest in each WINDOW and
+// fit a line through the last NUM_WINDOWS of those, which also follows any
+// drift between the clocks.
+//
+// Mapped times still include the smallest delivery latency. Cameras with
+// similar pipelines have similar latencies, so their mapped times can be
+// compared with each other.
+//
+// Two host clocks (CLOCK_MONOTONIC and CLOCK_REALTIME, say) can be read close
+// together, so their offset barely varies and a sudden change that lasts means
+// one of them was stepped (by NTP, perhaps). Given a max_step_ns, STEP_READINGS
+// offsets in a row further than that from the line throw away what we had and
+// start again from the last of them. Fewer are taken to be bad readings, and
+// ignored.
+
+class ClockMapper
+{
+public:
+	ClockMapper(int64_t max_step_ns = 0) : max_step_ns_(max_step_ns) { Reset(); }
+
+	void Reset();
+	// Returns true if the clocks were stepped, and we started again.
+	bool Update(int64_t clock_ns, int64_t reference_ns);
+	// The reference time for a time on the clock. Before any Update() we can
+	// only return the time unchanged.
+	int64_t Map(int64_t clock_ns) const;
+	// How much faster the reference clock runs, in parts per million.
+	double DriftPpm() const { return slope_ * 1e6; }
+
+private:
+	static constexpr int64_t WINDOW_NS = 1000000000;
+	static constexpr unsigned int NUM_WINDOWS = 32;
+	static constexpr unsigned int STEP_READINGS = 3;
+
+	struct Point
+	{
+		int64_t clock_ns;
+		int64_t offset_ns; // reference minus clock
+	};
+
+	void fit();
+
+	int64_t max_step_ns_;
+	unsigned int off_line_; // readings in a row too far from the line
+	std::deque<Point> points_; // the smallest offset in each finished window
+	Point current_; // the smallest in the window we're in
+	int64_t window_start_ns_;
+	bool started_;
+	// The offset at clock time t is intercept_ns_ + slope_ * (t - origin_ns_).
+	int64_t origin_ns_;
+	int64_t intercept_ns_;
+	double slope_;
+};
@@ -25,11 +25,21 @@ struct CompletedRequest
 	{
 		r->reuse();
 	}
+	// For frames that didn't come from a camera Request (see SyntheticSource).
+	CompletedRequest(unsigned int seq, BufferMap const &b, ControlList const &m)
+		: sequence(seq), buffers(b), metadata(m), request(nullptr)
+	{
+	}
 	unsigned int sequence;
 	BufferMap buffers;
 	ControlList metadata;
 	Request *request;
 	float framerate;
+	// The sensor timestamp mapped onto CLOCK_MONOTONIC (see ClockMapper), so that
+	// frames from different cameras can be compared.
+	int64_t monotonic_timestamp;
+	// And onto CLOCK_REALTIME, for placing recordings in time.
+	int64_t wallclock_timestamp;
 	Metadata post_process_metadata;
 };
 
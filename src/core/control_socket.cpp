@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * control_socket.cpp - command socket serviced by an application's event loop.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include "core/control_socket.hpp"
+
+ControlSocket::ControlSocket(std::string const &path, bool verbose) : path_(path), verbose_(verbose)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path_.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("control socket path too long");
+	strcpy(addr.sun_path, path_.c_str());
+	unlink(path_.c_str());
+	listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (listen_fd_ < 0 || bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd_, 8) < 0)
+		throw std::runtime_error("failed to listen on control socket " + path_);
+}
+
+ControlSocket::~ControlSocket()
+{
+	for (int fd : clients_)
+		close(fd);
+	close(listen_fd_);
+	unlink(path_.c_str());
+}
+
+int ControlSocket::AddFds(fd_set *fds, int nfds) const
+{
+	FD_SET(listen_fd_, fds);
+	nfds = std::max(nfds, listen_fd_ + 1);
+	for (int fd : clients_)
+	{
+		FD_SET(fd, fds);
+		nfds = std::max(nfds, fd + 1);
+	}
+	return nfds;
+}
+
+void ControlSocket::Service(fd_set const *fds, std::vector<Request> &requests)
+{
+	if (FD_ISSET(listen_fd_, fds))
+	{
+		int fd;
+		while ((fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0)
+		{
+			clients_.push_back(fd);
+			if (verbose_)
+				std::cerr << "ControlSocket: new client " << fd << std::endl;
+		}
+	}
+
+	// Take a copy, as clients may get dropped along the way.
+	std::vector<int> clients = clients_;
+	for (int fd : clients)
+	{
+		if (!FD_ISSET(fd, fds))
+			continue;
+
+		char buf[MAX_MESSAGE_SIZE];
+		ssize_t ret;
+		// MSG_TRUNC gets us the real length of a message too big for the buffer.
+		while ((ret = recv(fd, buf, sizeof(buf), MSG_TRUNC)) > 0)
+		{
+			if (ret < (ssize_t)sizeof(Header))
+			{
+				std::cerr << "WARNING: ControlSocket: short message from client " << fd << std::endl;
+				continue;
+			}
+			Header header;
+			memcpy(&header, buf, sizeof(header));
+			Request request = { fd, header.id, header.command, {}, std::chrono::steady_clock::now() };
+
+			// What we have of an oversized request can't be trusted, so refuse it.
+			if (ret > (ssize_t)sizeof(buf))
+			{
+				std::cerr << "WARNING: ControlSocket: " << ret << " byte message from client " << fd
+						  << " too long" << std::endl;
+				Reply(request, STATUS_BAD_ARGUMENT, "request too long");
+				continue;
+			}
+
+			std::istringstream args(std::string(buf + sizeof(header), ret - sizeof(header)));
+			for (std::string line; std::getline(args, line);)
+			{
+				size_t equals = line.find('=');
+				if (equals != std::string::npos)
+					request.args[line.substr(0, equals)] = line.substr(equals + 1);
+				else if (!line.empty())
+					request.args[line] = "";
+			}
+			requests.push_back(std::move(request));
+		}
+		if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			dropClient(fd);
+	}
+}
+
+void ControlSocket::Reply(Request const &request, uint16_t status, std::string const &text)
+{
+	auto now = std::chrono::steady_clock::now();
+	uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(now - request.received).count();
+	Latency &latency = latency_[request.command];
+	latency.count++;
+	latency.total_us += us;
+	latency.max_us = std::max(latency.max_us, us);
+
+	// The client may have gone away while we were busy.
+	if (std::find(clients_.begin(), clients_.end(), request.client) == clients_.end())
+		return;
+
+	char buf[MAX_MESSAGE_SIZE];
+	Header header = { request.id, request.command, status };
+	size_t length = std::min(text.size(), sizeof(buf) - sizeof(header));
+	memcpy(buf, &header, sizeof(header));
+	memcpy(buf + sizeof(header), text.data(), length);
+	// A client that isn't reading its replies doesn't get to hold us up.
+	if (send(request.client, buf, sizeof(header) + length, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+	{
+		std::cerr << "WARNING: ControlSocket: failed to reply to client " << request.client << std::endl;
+		dropClient(request.client);
+	}
+}
+
+std::string ControlSocket::Stats() const
+{
+	std::ostringstream stats;
+	for (auto const &[command, latency] : latency_)
+		stats << "latency " << command << " count=" << latency.count << " mean_us="
+			  << latency.total_us / latency.count << " max_us=" << latency.max_us << "\n";
+	return stats.str();
+}
+
+void ControlSocket::dropClient(int fd)
+{
+	auto it = std::find(clients_.begin(), clients_.end(), fd);
+	if (it == clients_.end())
+		return;
+	if (verbose_)
+		std::cerr << "ControlSocket: client " << fd << " gone" << std::endl;
+	close(fd);
+	clients_.erase(it);
+}
@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * control_socket.hpp - command socket serviced by an application's event loop.
+ */
+
+#pragma once
+
+#include <sys/select.h>
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Clients connect to a Unix (SOCK_SEQPACKET) socket, so every message arrives
+// whole. A request is a Header followed by optional "key=value" arguments, one
+// per line. The reply is a Header with the same id and command, a status, and
+// optional text. Ids are chosen by the client so that it can have several
+// requests in flight and match up the replies, which may come back in any
+// order. A request longer than MAX_MESSAGE_SIZE gets STATUS_BAD_ARGUMENT.
+//
+// The socket does no work of its own: the application adds its fds to the set
+// it waits on, hands them back to Service() to collect requests, and calls
+// Reply() once each one has been dealt with.
+
+class ControlSocket
+{
+public:
+	struct Header
+	{
+		uint32_t id;
+		uint16_t command;
+		uint16_t status; // zero in requests
+	};
+	enum Status : uint16_t
+	{
+		STATUS_OK = 0,
+		STATUS_ERROR = 1,
+		STATUS_UNKNOWN_COMMAND = 2,
+		STATUS_BAD_ARGUMENT = 3,
+	};
+	static constexpr size_t MAX_MESSAGE_SIZE = 4096;
+
+	struct Request
+	{
+		int client; // negative for requests that didn't come from the socket
+		uint32_t id;
+		uint16_t command;
+		std::map<std::string, std::string> args;
+		std::chrono::steady_clock::time_point received;
+	};
+
+	ControlSocket(std::string const &path, bool verbose);
+	~ControlSocket();
+	// Add our fds to the set, returning the highest one plus one (or nfds, if bigger).
+	int AddFds(fd_set *fds, int nfds) const;
+	// Accept new clients and read any requests that have arrived.
+	void Service(fd_set const *fds, std::vector<Request> &requests);
+	void Reply(Request const &request, uint16_t status, std::string const &text = "");
+	// Per-command latency, from receiving a request to replying to it.
+	std::string Stats() const;
+
+private:
+	struct Latency
+	{
+		unsigned int count = 0;
+		uint64_t total_us = 0;
+		uint64_t max_us = 0;
+	};
+
+	void dropClient(int fd);
+
+	std::string path_;
+	bool verbose_;
+	int listen_fd_;
+	std::vector<int> clients_;
+	std::map<uint16_t, Latency> latency_;
+};
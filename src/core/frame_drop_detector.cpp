@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * frame_drop_detector.cpp - spot and classify frames that never reached us.
+ */
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "core/frame_drop_detector.hpp"
+
+FrameDropDetector::FrameDropDetector()
+	: running_(false), requests_queued_(0), starved_(false), max_frame_duration_(0), last_timestamp_(0),
+	  cancelled_metric_(nullptr)
+{
+}
+
+void FrameDropDetector::Start(int64_t max_frame_duration, unsigned int requests_queued, std::string const &labels)
+{
+	labels_ = labels.empty() ? "" : labels + ",";
+	cancelled_metric_ = &Metrics::GetCounter("libcamera_requests_cancelled_total",
+											 "Requests the camera cancelled while it was running", labels);
+	max_frame_duration_ = max_frame_duration;
+	requests_queued_ = requests_queued;
+	starved_ = false;
+	last_timestamp_ = 0;
+	last_sequences_.clear();
+	running_ = true;
+}
+
+void FrameDropDetector::RequestCancelled()
+{
+	if (requests_queued_.fetch_sub(1, std::memory_order_relaxed) == 1)
+		starved_ = true;
+	if (!running_)
+		return;
+	cancelled_metric_->Inc();
+	std::cerr << "WARNING: FrameDropDetector: request cancelled while the camera was running" << std::endl;
+}
+
+unsigned int FrameDropDetector::FrameCompleted(std::map<std::string, StreamFrame> const &streams,
+											   int64_t timestamp_ns, int64_t frame_duration_us)
+{
+	// Anything lost since the last frame is down to starvation if we ran out of
+	// requests in between. This frame's request isn't queued any more either, so
+	// if that was the last one, the next frame may find us starved too.
+	bool starved = starved_.exchange(false);
+	if (requests_queued_.fetch_sub(1, std::memory_order_relaxed) == 1)
+		starved_ = true;
+
+	int64_t expected_ns = (frame_duration_us > 0 ? frame_duration_us : max_frame_duration_) * 1000;
+	int64_t gap_ns = timestamp_ns - last_timestamp_;
+	unsigned int timestamp_dropped = 0;
+	if (last_timestamp_ && expected_ns > 0 && gap_ns > expected_ns * 3 / 2)
+		timestamp_dropped = (gap_ns + expected_ns / 2) / expected_ns - 1;
+	last_timestamp_ = timestamp_ns;
+
+	unsigned int total = 0;
+	for (auto const &[name, frame] : streams)
+	{
+		unsigned int dropped = timestamp_dropped;
+		char const *cause = starved ? "starvation" : "sensor";
+		std::ostringstream detail;
+		auto last = last_sequences_.find(name);
+		if (frame.sequence && last != last_sequences_.end())
+		{
+			unsigned int sequence_dropped = *frame.sequence > last->second ? *frame.sequence - last->second - 1 : 0;
+			if (sequence_dropped)
+			{
+				dropped = sequence_dropped;
+				cause = starved ? "starvation" : "pipeline";
+				detail << "sequence " << last->second << " to " << *frame.sequence;
+			}
+			else
+				cause = "sensor";
+		}
+		if (frame.sequence)
+			last_sequences_[name] = *frame.sequence;
+
+		if (dropped)
+		{
+			if (detail.tellp() == 0)
+				detail << std::fixed << std::setprecision(1) << gap_ns / 1e6 << "ms since the last frame";
+			report(name, cause, dropped, detail.str());
+		}
+		if (frame.error)
+			report(name, "pipeline", 1, "frame completed with an error");
+		total = std::max(total, dropped);
+	}
+
+	return total;
+}
+
+void FrameDropDetector::report(std::string const &stream, char const *cause, unsigned int dropped,
+							   std::string const &detail)
+{
+	Metrics::GetCounter("libcamera_frame_drops_total", "Frames that never reached us, by stream and cause",
+						labels_ + "stream=\"" + stream + "\",cause=\"" + cause + "\"")
+		.Inc(dropped);
+	std::cerr << "WARNING: FrameDropDetector: " << dropped << " frame" << (dropped == 1 ? "" : "s") << " dropped on "
+			  << stream << " stream (" << cause << "), " << detail << std::endl;
+}
@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * frame_drop_detector.hpp - spot and classify frames that never reached us.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <optional>
+#include <string>
+
+#include "core/metrics.hpp"
+
+// Works out, from each frame that does arrive, how many were lost since the one
+// before, and why:
+//
+// - "starvation": at some point since the last frame we had no requests queued
+//   with the camera, so it had nowhere to put the frames. The application is
+//   holding on to too many buffers, or there aren't enough of them.
+// - "pipeline": the stream's sequence numbers jumped although we had requests
+//   queued, so the sensor made the frames but the pipeline (CSI receiver, ISP)
+//   dropped them. Requests that the camera completes with an error count here too.
+// - "sensor": the sequence numbers didn't jump but the timestamps did, so the
+//   sensor never produced the frames at all.
+//
+// Timestamp gaps are judged against the frame's own FrameDuration or, failing
+// that, the longest the configured FrameDurationLimits allow. Streams are
+// tracked separately because a pipeline can drop a frame on one stream and not
+// another.
+//
+// Requests are queued from application threads and complete on the camera's
+// thread. FrameCompleted() and RequestCancelled() must only be called from the
+// latter, and Start() and Stop() only while no requests are completing.
+
+class FrameDropDetector
+{
+public:
+	struct StreamFrame
+	{
+		std::optional<unsigned int> sequence; // not all sources have them
+		bool error;
+	};
+
+	FrameDropDetector();
+
+	// In microseconds, like the control, and zero if no limits were set. The
+	// labels (such as the camera) go on all our metrics.
+	void Start(int64_t max_frame_duration, unsigned int requests_queued, std::string const &labels);
+	// Cancellations after this are the camera stopping, not drops.
+	void Stop() { running_ = false; }
+
+	void RequestQueued() { requests_queued_.fetch_add(1, std::memory_order_relaxed); }
+	unsigned int RequestsQueued() const { return std::max(requests_queued_.load(std::memory_order_relaxed), 0); }
+	void RequestCancelled();
+	// streams are by name. The frame duration is from the frame's metadata, or
+	// zero if it has none. Returns the number of frames lost just before this one.
+	unsigned int FrameCompleted(std::map<std::string, StreamFrame> const &streams, int64_t timestamp_ns,
+								int64_t frame_duration_us);
+
+private:
+	void report(std::string const &stream, char const *cause, unsigned int dropped, std::string const &detail);
+
+	std::atomic<bool> running_;
+	std::atomic<int> requests_queued_;
+	std::atomic<bool> starved_;
+	int64_t max_frame_duration_;
+	int64_t last_timestamp_;
+	std::map<std::string, unsigned int> last_sequences_;
+	std::string labels_;
+	Counter *cancelled_metric_;
+};
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * frame_sync.cpp - pair up frames from several cameras by capture time.
+ */
+
+#include <algorithm>
+
+#include "core/frame_sync.hpp"
+
+FrameSync::FrameSync(std::vector<unsigned int> const &cameras, int64_t tolerance_ns, unsigned int max_queued)
+	: tolerance_ns_(tolerance_ns), max_queued_(std::max(max_queued, 1u)), queues_(cameras.size()), sets_(0),
+	  unmatched_(cameras.size(), 0), total_skew_ns_(0), max_skew_ns_(0)
+{
+	sets_metric_ = &Metrics::GetCounter("libcamera_sync_sets_total", "Sets of frames matched across the cameras");
+	skew_metric_ = &Metrics::GetHistogram("libcamera_sync_skew_seconds",
+										  "Capture time from the first to the last frame in each set");
+	for (unsigned int camera : cameras)
+		unmatched_metrics_.push_back(&Metrics::GetCounter("libcamera_sync_unmatched_frames_total",
+														  "Frames no other camera had a match for",
+														  "camera=\"" + std::to_string(camera) + "\""));
+}
+
+std::vector<FrameSync::FrameSet> FrameSync::Add(unsigned int index, CompletedRequestPtr const &frame)
+{
+	queues_[index].push_back(frame);
+	if (queues_[index].size() > max_queued_)
+		drop(index);
+
+	std::vector<FrameSet> sets;
+	while (std::all_of(queues_.begin(), queues_.end(), [](auto const &queue) { return !queue.empty(); }))
+	{
+		auto by_time = [](auto const &a, auto const &b) {
+			return a.front()->monotonic_timestamp < b.front()->monotonic_timestamp;
+		};
+		auto earliest = std::min_element(queues_.begin(), queues_.end(), by_time);
+		auto latest = std::max_element(queues_.begin(), queues_.end(), by_time);
+		int64_t skew_ns = latest->front()->monotonic_timestamp - earliest->front()->monotonic_timestamp;
+		if (skew_ns > tolerance_ns_)
+		{
+			drop(earliest - queues_.begin());
+			continue;
+		}
+
+		FrameSet set { earliest->front()->monotonic_timestamp, skew_ns, {} };
+		for (auto &queue : queues_)
+		{
+			set.frames.push_back(std::move(queue.front()));
+			queue.pop_front();
+		}
+		sets_++;
+		total_skew_ns_ += skew_ns;
+		max_skew_ns_ = std::max(max_skew_ns_, skew_ns);
+		sets_metric_->Inc();
+		skew_metric_->Observe(skew_ns / 1e9);
+		sets.push_back(std::move(set));
+	}
+
+	return sets;
+}
+
+void FrameSync::Flush()
+{
+	for (unsigned int i = 0; i < queues_.size(); i++)
+	{
+		while (!queues_[i].empty())
+			drop(i);
+	}
+}
+
+FrameSync::Stats FrameSync::GetStats() const
+{
+	return { sets_, unmatched_, sets_ ? total_skew_ns_ / static_cast<int64_t>(sets_) : 0, max_skew_ns_ };
+}
+
+void FrameSync::drop(unsigned int index)
+{
+	queues_[index].pop_front();
+	unmatched_[index]++;
+	unmatched_metrics_[index]->Inc();
+}
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * frame_sync.hpp - pair up frames from several cameras by capture time.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "core/completed_request.hpp"
+#include "core/metrics.hpp"
+
+// Each camera's frames are added in the order they arrive. We match them up
+// by their monotonic_timestamp (the sensor timestamp mapped onto a common
+// clock). When every camera has a frame waiting, the oldest ones form a set if
+// they're all within the tolerance. Otherwise the earliest of them can never
+// be matched, because everything else is later, so we drop it and try again.
+// If a camera stalls, the others would queue up frames (and so hold on to
+// their camera buffers), so each queue is limited to max_queued frames and the
+// oldest frame is dropped first.
+//
+// Not thread safe. The application adds frames from its event loop.
+
+class FrameSync
+{
+public:
+	struct FrameSet
+	{
+		int64_t timestamp_ns; // the earliest in the set
+		int64_t skew_ns; // from the earliest to the latest
+		std::vector<CompletedRequestPtr> frames; // one for each camera, in the order given to the constructor
+	};
+
+	struct Stats
+	{
+		uint64_t sets;
+		std::vector<uint64_t> unmatched; // for each camera
+		int64_t mean_skew_ns;
+		int64_t max_skew_ns;
+	};
+
+	// The cameras are only used to label metrics; frames are added by index in this list.
+	FrameSync(std::vector<unsigned int> const &cameras, int64_t tolerance_ns, unsigned int max_queued);
+	// The sets completed by this frame, oldest first.
+	std::vector<FrameSet> Add(unsigned int index, CompletedRequestPtr const &frame);
+	// Forget everything queued, for when the frames stop for a while (so the buffers go back to the cameras).
+	void Flush();
+	Stats GetStats() const;
+
+private:
+	void drop(unsigned int index);
+
+	int64_t tolerance_ns_;
+	unsigned int max_queued_;
+	std::vector<std::deque<CompletedRequestPtr>> queues_;
+	uint64_t sets_;
+	std::vector<uint64_t> unmatched_;
+	int64_t total_skew_ns_;
+	int64_t max_skew_ns_;
+	Counter *sets_metric_;
+	std::vector<Counter *> unmatched_metrics_;
+	Histogram *skew_metric_;
+};
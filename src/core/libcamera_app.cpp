@@ -8,11 +8,15 @@
 #include "frame_info.hpp"
 #include "libcamera_app.hpp"
 #include "options.hpp"
+#include "trace.hpp"
 
 #include <fcntl.h>
+#include <time.h>
 
 #include <sys/ioctl.h>
 
+#include <cstdlib>
+
 #include <linux/videodev2.h>
 
 // If we definitely appear to be running the old camera stack, complain and give up.
@@ -78,18 +82,95 @@ LibcameraApp::~LibcameraApp()
 
 std::string const &LibcameraApp::CameraId() const
 {
+	if (synthetic_source_)
+		return synthetic_source_->Id();
 	return camera_->id();
 }
 
+// libcamera allows only one CameraManager in a process, so applications running
+// several cameras share it. It stops when the last of them closes its camera.
+static std::shared_ptr<libcamera::CameraManager> get_camera_manager()
+{
+	static std::mutex mutex;
+	static std::weak_ptr<libcamera::CameraManager> weak_camera_manager;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	std::shared_ptr<libcamera::CameraManager> camera_manager = weak_camera_manager.lock();
+	if (!camera_manager)
+	{
+		camera_manager = std::make_shared<libcamera::CameraManager>();
+		int ret = camera_manager->start();
+		if (ret)
+			throw std::runtime_error("camera manager failed to start, code " + std::to_string(-ret));
+		weak_camera_manager = camera_manager;
+	}
+	return camera_manager;
+}
+
+// CLOCK_MONOTONIC and CLOCK_REALTIME as near together as we can: a monotonic
+// reading between two realtime ones is out by at most half the time between
+// those, and we keep the tightest of a few tries in case we were preempted.
+static void read_wallclock(int64_t &monotonic_ns, int64_t &realtime_ns)
+{
+	auto ns = [](timespec const &ts) { return ts.tv_sec * 1000000000LL + ts.tv_nsec; };
+	int64_t best_ns = INT64_MAX;
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		timespec before, monotonic, after;
+		clock_gettime(CLOCK_REALTIME, &before);
+		clock_gettime(CLOCK_MONOTONIC, &monotonic);
+		clock_gettime(CLOCK_REALTIME, &after);
+		int64_t interval_ns = ns(after) - ns(before);
+		if (interval_ns >= 0 && interval_ns < best_ns)
+		{
+			best_ns = interval_ns;
+			monotonic_ns = ns(monotonic);
+			realtime_ns = ns(before) + interval_ns / 2;
+		}
+	}
+	// Only if the realtime clock went backwards every time.
+	if (best_ns == INT64_MAX)
+	{
+		timespec monotonic, realtime;
+		clock_gettime(CLOCK_MONOTONIC, &monotonic);
+		clock_gettime(CLOCK_REALTIME, &realtime);
+		monotonic_ns = ns(monotonic);
+		realtime_ns = ns(realtime);
+	}
+}
+
+std::string LibcameraApp::metricLabels() const
+{
+	return "camera=\"" + std::to_string(options_->camera) + "\"";
+}
+
 void LibcameraApp::OpenCamera()
 {
+	Trace::Enable(options_->trace);
+
+	std::string labels = metricLabels();
+	frames_metric_ = &Metrics::GetCounter("libcamera_frames_total", "Frames received from the camera", labels);
+	fps_metric_ = &Metrics::GetGauge("libcamera_fps", "Instantaneous capture framerate", labels);
+	queue_depth_metric_ = &Metrics::GetGauge("libcamera_event_queue_depth",
+											 "Completed requests waiting for the application", labels);
+	buffers_metric_ = &Metrics::GetGauge("libcamera_camera_buffers", "Camera buffers for each stream", labels);
+	clock_drift_metric_ = &Metrics::GetGauge("libcamera_clock_drift_ppm",
+											 "How much faster CLOCK_MONOTONIC runs than the sensor clock", labels);
+	wallclock_steps_metric_ = &Metrics::GetCounter("libcamera_wallclock_steps_total",
+												   "Times the wall clock jumped while we were mapping onto it", labels);
+
+	if (options_->source != "camera")
+	{
+		synthetic_source_ = std::make_unique<SyntheticSource>(options_.get());
+		if (options_->verbose)
+			std::cerr << "Using synthetic source " << synthetic_source_->Id() << std::endl;
+		return;
+	}
+
 	if (options_->verbose)
 		std::cerr << "Opening camera..." << std::endl;
 
-	camera_manager_ = std::make_unique<CameraManager>();
-	int ret = camera_manager_->start();
-	if (ret)
-		throw std::runtime_error("camera manager failed to start, code " + std::to_string(-ret));
+	camera_manager_ = get_camera_manager();
 
 	std::vector<std::shared_ptr<libcamera::Camera>> cameras = camera_manager_->cameras();
 	// Do not show USB webcams as these are not supported in libcamera-apps!
@@ -125,6 +206,8 @@ void LibcameraApp::CloseCamera()
 
 	camera_manager_.reset();
 
+	synthetic_source_.reset();
+
 	if (options_->verbose && !options_->help)
 		std::cerr << "Camera closed" << std::endl;
 }
@@ -134,8 +217,16 @@ void LibcameraApp::ConfigureVideo(unsigned int flags)
 	if (options_->verbose)
 		std::cerr << "Configuring video..." << std::endl;
 
+	if (!options_->buffers && !(flags & FLAG_VIDEO_BUFFER_TUNING))
+		throw std::runtime_error("--buffers auto is not supported by this application");
+
 	bool have_raw_stream = (flags & FLAG_VIDEO_RAW) || options_->mode.bit_depth;
 	bool have_lores_stream = options_->lores_width && options_->lores_height;
+	if (synthetic_source_)
+	{
+		configureSynthetic(have_raw_stream, have_lores_stream);
+		return;
+	}
 	std::vector<libcamera::StreamRole> stream_roles = { StreamRole::VideoRecording };
 	int lores_index = 1;
 	if (have_raw_stream)
@@ -152,7 +243,7 @@ void LibcameraApp::ConfigureVideo(unsigned int flags)
 	// Now we get to override any of the default settings from the options_->
 	StreamConfiguration &cfg = configuration_->at(0);
 	cfg.pixelFormat = libcamera::formats::YUV420;
-	cfg.bufferCount = 6; // 6 buffers is better than 4
+	cfg.bufferCount = bufferCount();
 	if (options_->width)
 		cfg.size.width = options_->width;
 	if (options_->height)
@@ -204,6 +295,47 @@ void LibcameraApp::ConfigureVideo(unsigned int flags)
 		std::cerr << "Video setup complete" << std::endl;
 }
 
+unsigned int LibcameraApp::bufferCount()
+{
+	if (options_->buffers)
+		requested_buffers_ = options_->buffers;
+	else
+	{
+		if (!buffer_tuner_)
+			buffer_tuner_ = std::make_unique<BufferTuner>(options_->verbose);
+		requested_buffers_ = buffer_tuner_->Count();
+	}
+	return requested_buffers_;
+}
+
+void LibcameraApp::configureSynthetic(bool have_raw_stream, bool have_lores_stream)
+{
+	if (have_raw_stream)
+		throw std::runtime_error("synthetic source has no raw stream");
+
+	// The same default size that the Pi's pipeline handler gives VideoRecording.
+	Size size(options_->width ? options_->width : 1920, options_->height ? options_->height : 1080);
+	size.alignDownTo(2, 2);
+	Size lores_size;
+	if (have_lores_stream)
+	{
+		lores_size = Size(options_->lores_width, options_->lores_height);
+		lores_size.alignDownTo(2, 2);
+		if (lores_size.width > size.width || lores_size.height > size.height)
+			throw std::runtime_error("Low res image larger than video");
+	}
+	synthetic_source_->Configure(size, lores_size, bufferCount());
+
+	// We unmap these in Teardown, just like the camera's.
+	mapped_buffers_ = synthetic_source_->Mappings();
+	streams_["video"] = synthetic_source_->VideoStream();
+	if (have_lores_stream)
+		streams_["lores"] = synthetic_source_->LoresStream();
+
+	if (options_->verbose)
+		std::cerr << "Video setup complete" << std::endl;
+}
+
 void LibcameraApp::Teardown()
 {
 	if (options_->verbose && !options_->help)
@@ -230,6 +362,20 @@ void LibcameraApp::Teardown()
 
 void LibcameraApp::StartCamera()
 {
+	if (synthetic_source_)
+	{
+		camera_started_ = true;
+		last_timestamp_ = 0;
+		buffers_total_ = mapped_buffers_.size() / streams_.size();
+		buffers_metric_->Set(buffers_total_);
+		frame_drop_detector_.Start(options_->framerate > 0 ? 1000000 / options_->framerate : 0, buffers_total_,
+								   metricLabels());
+		synthetic_source_->Start([this](BufferMap const &buffers, ControlList const &metadata) {
+			syntheticComplete(buffers, metadata);
+		});
+		return;
+	}
+
 	// This makes all the Request objects that we shall need.
 	makeRequests();
 
@@ -286,11 +432,17 @@ void LibcameraApp::StartCamera()
 	if (!controls_.contains(controls::Sharpness.id()))
 		controls_.set(controls::Sharpness.id(), options_->sharpness);
 
+	auto frame_duration_limits = controls_.get(controls::FrameDurationLimits);
+	int64_t max_frame_duration = frame_duration_limits ? (*frame_duration_limits)[1] : 0;
+
 	if (camera_->start(&controls_))
 		throw std::runtime_error("failed to start camera");
 	controls_.clear();
 	camera_started_ = true;
 	last_timestamp_ = 0;
+	buffers_total_ = requests_.size();
+	buffers_metric_->Set(buffers_total_);
+	frame_drop_detector_.Start(max_frame_duration, buffers_total_, metricLabels());
 
 	camera_->requestCompleted.connect(this, &LibcameraApp::requestComplete);
 
@@ -306,7 +458,13 @@ void LibcameraApp::StopCamera()
 	{
 		// We don't want QueueRequest to run asynchronously while we stop the camera.
 		std::lock_guard<std::mutex> lock(camera_stop_mutex_);
-		if (camera_started_)
+		frame_drop_detector_.Stop();
+		if (camera_started_ && synthetic_source_)
+		{
+			synthetic_source_->Stop();
+			camera_started_ = false;
+		}
+		else if (camera_started_)
 		{
 			if (camera_->stop())
 				throw std::runtime_error("failed to stop camera");
@@ -337,13 +495,18 @@ std::queue<LibcameraApp::Msg> *LibcameraApp::Wait()
 	return msg_queue_.Wait();
 }
 
+std::queue<LibcameraApp::Msg> LibcameraApp::Poll()
+{
+	return msg_queue_.Poll();
+}
+
 void LibcameraApp::queueRequest(CompletedRequest *completed_request)
 {
 	BufferMap buffers(std::move(completed_request->buffers));
 
 	Request *request = completed_request->request;
 	delete completed_request;
-	assert(request);
+	assert(request || synthetic_source_);
 
 	// This function may run asynchronously so needs protection from the
 	// camera stopping at the same time.
@@ -361,6 +524,13 @@ void LibcameraApp::queueRequest(CompletedRequest *completed_request)
 		completed_requests_.erase(it);
 	}
 
+	frame_drop_detector_.RequestQueued();
+	if (synthetic_source_)
+	{
+		synthetic_source_->Requeue(buffers);
+		return;
+	}
+
 	for (auto const &p : buffers)
 	{
 		if (request->addBuffer(p.first, p.second) < 0)
@@ -550,9 +720,21 @@ void LibcameraApp::makeRequests()
 void LibcameraApp::requestComplete(Request *request)
 {
 	if (request->status() == Request::RequestCancelled)
+	{
+		frame_drop_detector_.RequestCancelled();
 		return;
+	}
+
+	completeRequest(new CompletedRequest(sequence_++, request));
+}
 
-	CompletedRequest *r = new CompletedRequest(sequence_++, request);
+void LibcameraApp::syntheticComplete(BufferMap const &buffers, ControlList const &metadata)
+{
+	completeRequest(new CompletedRequest(sequence_++, buffers, metadata));
+}
+
+void LibcameraApp::completeRequest(CompletedRequest *r)
+{
 	CompletedRequestPtr payload(r, [this](CompletedRequest *cr) { this->queueRequest(cr); });
 	{
 		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
@@ -569,9 +751,51 @@ void LibcameraApp::requestComplete(Request *request)
 		payload->framerate = 0;
 	else
 		payload->framerate = 1e9 / (timestamp - last_timestamp_);
+	// Sensor timestamps are normally on CLOCK_MONOTONIC already, when mapping them
+	// would only add the delivery latency. Any other clock is unlikely to be
+	// within a second of it.
+	int64_t now = Trace::Now();
+	clock_mapper_.Update(timestamp, now);
+	payload->monotonic_timestamp = clock_mapper_.Map(timestamp);
+	if (std::llabs(payload->monotonic_timestamp - (int64_t)timestamp) < 1000000000)
+		payload->monotonic_timestamp = timestamp;
+
+	// We sample the wall clock with every frame. The mapping smooths out the odd
+	// bad reading, and follows NTP as it slews the clock.
+	int64_t monotonic_ns, realtime_ns;
+	read_wallclock(monotonic_ns, realtime_ns);
+	if (wallclock_mapper_.Update(monotonic_ns, realtime_ns))
+	{
+		wallclock_steps_metric_->Inc();
+		std::cerr << "WARNING: LibcameraApp: wall clock stepped, starting its mapping again" << std::endl;
+	}
+	payload->wallclock_timestamp = wallclock_mapper_.Map(payload->monotonic_timestamp);
+
+	// The synthetic source's buffers have no sequence numbers (or status) of their own.
+	std::map<std::string, FrameDropDetector::StreamFrame> stream_frames;
+	for (auto const &[name, stream] : streams_)
+	{
+		auto it = payload->buffers.find(stream);
+		if (it == payload->buffers.end())
+			continue;
+		libcamera::FrameMetadata const &metadata = it->second->metadata();
+		if (synthetic_source_)
+			stream_frames[name] = { std::nullopt, false };
+		else
+			stream_frames[name] = { metadata.sequence, metadata.status != libcamera::FrameMetadata::FrameSuccess };
+	}
+	auto frame_duration = payload->metadata.get(controls::FrameDuration);
+	frame_drop_detector_.FrameCompleted(stream_frames, timestamp, frame_duration ? *frame_duration : 0);
+	if (buffer_tuner_ && !BufferCountChanged())
+		buffer_tuner_->Update(buffers_total_ - frame_drop_detector_.RequestsQueued(), buffers_total_);
+	frames_metric_->Inc();
+	fps_metric_->Set(payload->framerate);
+	clock_drift_metric_->Set(clock_mapper_.DriftPpm());
 	last_timestamp_ = timestamp;
+	Trace::Span("capture", timestamp / 1000, timestamp, now);
 
 	this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(payload)));
+	queue_depth_metric_->Set(msg_queue_.Size());
 }
 
 void LibcameraApp::configureDenoise(const std::string &denoise_mode)
@@ -7,7 +7,9 @@
 
 #pragma once
 
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include <condition_variable>
 #include <iostream>
@@ -28,8 +30,13 @@
 #include <libcamera/framebuffer_allocator.h>
 #include <libcamera/property_ids.h>
 
+#include "core/buffer_tuner.hpp"
+#include "core/clock_mapper.hpp"
 #include "core/completed_request.hpp"
+#include "core/frame_drop_detector.hpp"
+#include "core/metrics.hpp"
 #include "core/stream_info.hpp"
+#include "core/synthetic_source.hpp"
 
 struct Options;
 
@@ -82,6 +89,7 @@ public:
 	static constexpr unsigned int FLAG_VIDEO_NONE = 0;
 	static constexpr unsigned int FLAG_VIDEO_RAW = 1; // request raw image stream
 	static constexpr unsigned int FLAG_VIDEO_JPEG_COLOURSPACE = 2; // force JPEG colour space
+	static constexpr unsigned int FLAG_VIDEO_BUFFER_TUNING = 4; // we act on BufferCountChanged()
 
 	LibcameraApp(std::unique_ptr<Options> const opts = nullptr);
 	virtual ~LibcameraApp();
@@ -93,12 +101,23 @@ public:
 	void CloseCamera();
 
 	void ConfigureVideo(unsigned int flags = FLAG_VIDEO_NONE);
+	// With --buffers auto, true once the camera should be reconfigured with a
+	// different number of buffers. The application must stop the camera, and
+	// anything else still using its buffers, then Teardown(), ConfigureVideo()
+	// and StartCamera() again. Only applications that do this may pass
+	// FLAG_VIDEO_BUFFER_TUNING, and --buffers auto is refused without it.
+	bool BufferCountChanged() const { return buffer_tuner_ && buffer_tuner_->Count() != requested_buffers_; }
 
 	void Teardown();
 	void StartCamera();
 	void StopCamera();
 
 	std::queue<Msg> *Wait();
+	// For applications with an event loop of their own (perhaps serving several
+	// cameras): this fd becomes readable when messages arrive, and Poll() then
+	// hands over every message waiting (perhaps none) without blocking.
+	int EventFd() const { return msg_queue_.Fd(); }
+	std::queue<Msg> Poll();
 	void PostMessage(MsgType &t, MsgPayload &p);
 
 	Stream *GetStream(std::string const &name, StreamInfo *info = nullptr) const;
@@ -117,6 +136,9 @@ public:
 	StreamInfo GetStreamInfo(Stream const *stream) const;
 
 protected:
+	// Labels for any metrics that belong to this camera, such as camera="0".
+	std::string metricLabels() const;
+
 	std::unique_ptr<Options> options_;
 
 private:
@@ -124,12 +146,19 @@ private:
 	class MessageQueue
 	{
 	public:
+		MessageQueue() : fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+		{
+			if (fd_ < 0)
+				throw std::runtime_error("failed to create message queue eventfd");
+		}
+		~MessageQueue() { close(fd_); }
 		template <typename U>
 		void Post(U &&msg)
 		{
 			std::unique_lock<std::mutex> lock(mutex_);
 			queue_.push(std::forward<U>(msg));
 			cond_.notify_one();
+			eventfd_write(fd_, 1);
 		}
 		std::queue<T> *Wait()
 		{
@@ -145,6 +174,23 @@ private:
 			return messages;
 			*/
 		}
+		int Fd() const { return fd_; }
+		std::queue<T> Poll()
+		{
+			// Reset the fd first, so that anything posted after this still wakes the caller.
+			eventfd_t count;
+			eventfd_read(fd_, &count);
+			// The messages become the caller's, as the camera thread carries on posting.
+			std::queue<T> messages;
+			std::unique_lock<std::mutex> lock(mutex_);
+			messages.swap(queue_);
+			return messages;
+		}
+		size_t Size()
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			return queue_.size();
+		}
 		void Clear()
 		{
 			std::unique_lock<std::mutex> lock(mutex_);
@@ -152,6 +198,7 @@ private:
 		}
 
 	private:
+		int fd_;
 		std::queue<T> queue_;
 		std::mutex mutex_;
 		std::condition_variable cond_;
@@ -172,14 +219,19 @@ private:
 	};
 
 	void setupCapture();
+	unsigned int bufferCount();
+	void configureSynthetic(bool have_raw_stream, bool have_lores_stream);
 	void makeRequests();
 	void queueRequest(CompletedRequest *completed_request);
 	void requestComplete(Request *request);
+	void syntheticComplete(BufferMap const &buffers, ControlList const &metadata);
+	void completeRequest(CompletedRequest *r);
 	void configureDenoise(const std::string &denoise_mode);
 
-	std::unique_ptr<CameraManager> camera_manager_;
+	std::shared_ptr<CameraManager> camera_manager_; // shared by every LibcameraApp in the process
 	std::shared_ptr<Camera> camera_;
 	bool camera_acquired_ = false;
+	std::unique_ptr<SyntheticSource> synthetic_source_; // in place of the camera, when there is one
 	std::unique_ptr<CameraConfiguration> configuration_;
 	std::map<FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> mapped_buffers_;
 	std::map<std::string, Stream *> streams_;
@@ -197,4 +249,17 @@ private:
 	// Other:
 	uint64_t last_timestamp_;
 	uint64_t sequence_ = 0;
+	FrameDropDetector frame_drop_detector_;
+	ClockMapper clock_mapper_; // sensor timestamps onto CLOCK_MONOTONIC
+	ClockMapper wallclock_mapper_ { 5000000 }; // CLOCK_MONOTONIC onto CLOCK_REALTIME, noticing steps over 5ms
+	std::unique_ptr<BufferTuner> buffer_tuner_; // only with --buffers auto
+	unsigned int requested_buffers_ = 0;
+	unsigned int buffers_total_ = 0; // what we actually got
+	// Labelled with the camera, so looked up once we know which it is.
+	Counter *frames_metric_ = nullptr;
+	Gauge *fps_metric_ = nullptr;
+	Gauge *queue_depth_metric_ = nullptr;
+	Gauge *buffers_metric_ = nullptr;
+	Gauge *clock_drift_metric_ = nullptr;
+	Counter *wallclock_steps_metric_ = nullptr;
 };
@@ -5,13 +5,18 @@
  * libcamera_encoder.cpp - libcamera video encoding class.
  */
 
+#include <deque>
+
 #include "core/libcamera_app.hpp"
+#include "core/metrics.hpp"
 #include "core/stream_info.hpp"
+#include "core/trace.hpp"
 #include "core/video_options.hpp"
 
 #include "encoder/encoder.hpp"
 
-typedef std::function<void(void *, size_t, int64_t, bool)> EncodeOutputReadyCallback;
+// The frame's (sensor) timestamp, then its wall clock time, both in microseconds.
+typedef std::function<void(void *, size_t, int64_t, int64_t, bool)> EncodeOutputReadyCallback;
 
 class LibcameraEncoder : public LibcameraApp
 {
@@ -20,12 +25,19 @@ public:
 	using FrameBuffer = libcamera::FrameBuffer;
 
 	LibcameraEncoder() : LibcameraApp(std::make_unique<VideoOptions>()) {}
+	// For applications that add options of their own.
+	LibcameraEncoder(std::unique_ptr<VideoOptions> options) : LibcameraApp(std::move(options)) {}
 
 	void StartEncoder()
 	{
 		createEncoder();
+		std::string labels = metricLabels() + ",codec=\"" + GetOptions()->codec + "\"";
+		encode_latency_metric_ = &Metrics::GetHistogram(
+			"libcamera_encode_latency_seconds", "Time from a frame going into the encoder to it coming out", labels);
+		encoder_queue_metric_ = &Metrics::GetGauge("libcamera_encoder_queue_depth", "Frames held by the encoder", labels);
 		encoder_->SetInputDoneCallback(std::bind(&LibcameraEncoder::encodeBufferDone, this, std::placeholders::_1));
-		encoder_->SetOutputReadyCallback(encode_output_ready_callback_);
+		encoder_->SetOutputReadyCallback(std::bind(&LibcameraEncoder::encodeOutputReady, this, std::placeholders::_1,
+												   std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
 	}
 	// This is callback when the encoder gives you the encoded output data.
 	void SetEncodeOutputReadyCallback(EncodeOutputReadyCallback callback) { encode_output_ready_callback_ = callback; }
@@ -41,14 +53,34 @@ public:
 		int64_t timestamp_ns = completed_request->metadata.contains(controls::SensorTimestamp.id())
 								? *completed_request->metadata.get(controls::SensorTimestamp)
 								: buffer->metadata().timestamp;
+		TraceScope trace("encode_buffer", timestamp_ns / 1000);
+		Trace::AsyncBegin("encode", timestamp_ns / 1000);
 		{
 			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
 			encode_buffer_queue_.push(completed_request); // creates a new reference
+			encoder_queue_metric_->Set(encode_buffer_queue_.size());
+			encode_starts_.push_back(
+				{ timestamp_ns / 1000, completed_request->wallclock_timestamp / 1000, std::chrono::steady_clock::now() });
 		}
 		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
 	}
 	VideoOptions *GetOptions() const { return static_cast<VideoOptions *>(options_.get()); }
-	void StopEncoder() { encoder_.reset(); }
+	// Change the running encoder's parameters. Returns false if there is no encoder running.
+	bool SetEncoderParameters(EncoderParameters const &params)
+	{
+		if (!encoder_)
+			return false;
+		encoder_->SetParameters(params);
+		return true;
+	}
+	void StopEncoder()
+	{
+		encoder_.reset();
+		// Frames the encoder never finished with mustn't keep their buffers from the camera.
+		std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
+		encode_buffer_queue_ = {};
+		encode_starts_.clear();
+	}
 
 protected:
 	virtual void createEncoder()
@@ -62,6 +94,26 @@ protected:
 	std::unique_ptr<Encoder> encoder_;
 
 private:
+	void encodeOutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe)
+	{
+		Trace::AsyncEnd("encode", timestamp_us);
+		int64_t wallclock_us = 0; // unknown, if the encoder made the timestamp up
+		{
+			// Frames come out in the order they went in, but some may have been dropped.
+			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
+			while (!encode_starts_.empty() && encode_starts_.front().timestamp_us < timestamp_us)
+				encode_starts_.pop_front();
+			if (!encode_starts_.empty() && encode_starts_.front().timestamp_us == timestamp_us)
+			{
+				std::chrono::duration<double> latency = std::chrono::steady_clock::now() - encode_starts_.front().time;
+				encode_latency_metric_->Observe(latency.count());
+				wallclock_us = encode_starts_.front().wallclock_us;
+				encode_starts_.pop_front();
+			}
+		}
+		TraceScope trace("output", timestamp_us);
+		encode_output_ready_callback_(mem, size, timestamp_us, wallclock_us, keyframe);
+	}
 	void encodeBufferDone(void *mem)
 	{
 		// If non-NULL, mem would indicate which buffer has been completed, but
@@ -74,10 +126,20 @@ private:
 			if (encode_buffer_queue_.empty())
 				throw std::runtime_error("no buffer available to return");
 			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			encoder_queue_metric_->Set(encode_buffer_queue_.size());
 		}
 	}
 
 	std::queue<CompletedRequestPtr> encode_buffer_queue_;
+	struct EncodeStart
+	{
+		int64_t timestamp_us;
+		int64_t wallclock_us;
+		std::chrono::steady_clock::time_point time;
+	};
+	std::deque<EncodeStart> encode_starts_;
+	Histogram *encode_latency_metric_ = nullptr;
+	Gauge *encoder_queue_metric_ = nullptr;
 	std::mutex encode_buffer_queue_mutex_;
 	EncodeOutputReadyCallback encode_output_ready_callback_;
 };
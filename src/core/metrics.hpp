@@ -0,0 +1,173 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * metrics.hpp - counters, gauges and histograms in Prometheus form.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// Anything in the pipeline can look up a metric by name (and labels) once,
+// keep the reference, and then update it from any thread with nothing more
+// than relaxed atomics. Looking metrics up, removing them and Expose() take a
+// lock, so don't do those per frame.
+//
+// Labels are given already formatted, e.g. codec="h264". A metric that is
+// removed must no longer be in use, so only the code that owns it (such as
+// NetOutput for its clients) should remove it.
+
+class Metric
+{
+public:
+	virtual ~Metric() {}
+	virtual void Write(std::ostream &os, std::string const &name, std::string const &labels) const = 0;
+
+protected:
+	static std::string braces(std::string const &labels) { return labels.empty() ? "" : "{" + labels + "}"; }
+};
+
+class Counter : public Metric
+{
+public:
+	void Inc(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+	void Write(std::ostream &os, std::string const &name, std::string const &labels) const override
+	{
+		os << name << braces(labels) << " " << value_.load(std::memory_order_relaxed) << "\n";
+	}
+
+private:
+	std::atomic<uint64_t> value_ { 0 };
+};
+
+class Gauge : public Metric
+{
+public:
+	void Set(double value) { value_.store(value, std::memory_order_relaxed); }
+	void Write(std::ostream &os, std::string const &name, std::string const &labels) const override
+	{
+		os << name << braces(labels) << " " << value_.load(std::memory_order_relaxed) << "\n";
+	}
+
+private:
+	std::atomic<double> value_ { 0 };
+};
+
+// Latencies, in seconds, from a millisecond up to a few seconds.
+class Histogram : public Metric
+{
+public:
+	void Observe(double seconds)
+	{
+		unsigned int i = 0;
+		while (i < NUM_BUCKETS && seconds > BUCKETS[i])
+			i++;
+		buckets_[i].fetch_add(1, std::memory_order_relaxed);
+		sum_us_.fetch_add(seconds * 1e6, std::memory_order_relaxed);
+	}
+	void Write(std::ostream &os, std::string const &name, std::string const &labels) const override
+	{
+		std::string sep = labels.empty() ? "" : ",";
+		uint64_t count = 0;
+		for (unsigned int i = 0; i <= NUM_BUCKETS; i++)
+		{
+			count += buckets_[i].load(std::memory_order_relaxed);
+			os << name << "_bucket{" << labels << sep << "le=\"";
+			if (i < NUM_BUCKETS)
+				os << BUCKETS[i];
+			else
+				os << "+Inf";
+			os << "\"} " << count << "\n";
+		}
+		os << name << "_sum" << braces(labels) << " " << sum_us_.load(std::memory_order_relaxed) / 1e6 << "\n";
+		os << name << "_count" << braces(labels) << " " << count << "\n";
+	}
+
+private:
+	static constexpr unsigned int NUM_BUCKETS = 12;
+	static constexpr double BUCKETS[NUM_BUCKETS] = { 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5 };
+	std::atomic<uint64_t> buckets_[NUM_BUCKETS + 1] = {}; // the last is for anything bigger
+	std::atomic<uint64_t> sum_us_ { 0 };
+};
+
+class Metrics
+{
+public:
+	static Counter &GetCounter(std::string const &name, std::string const &help, std::string const &labels = "")
+	{
+		return get<Counter>("counter", name, help, labels);
+	}
+	static Gauge &GetGauge(std::string const &name, std::string const &help, std::string const &labels = "")
+	{
+		return get<Gauge>("gauge", name, help, labels);
+	}
+	static Histogram &GetHistogram(std::string const &name, std::string const &help, std::string const &labels = "")
+	{
+		return get<Histogram>("histogram", name, help, labels);
+	}
+	static void Remove(std::string const &name, std::string const &labels)
+	{
+		std::lock_guard<std::mutex> lock(registry().mutex);
+		auto family = registry().families.find(name);
+		if (family != registry().families.end())
+			family->second.metrics.erase(labels);
+	}
+
+	// Everything, in the Prometheus text exposition format.
+	static std::string Expose()
+	{
+		std::ostringstream os;
+		std::lock_guard<std::mutex> lock(registry().mutex);
+		for (auto const &[name, family] : registry().families)
+		{
+			if (family.metrics.empty())
+				continue;
+			os << "# HELP " << name << " " << family.help << "\n";
+			os << "# TYPE " << name << " " << family.type << "\n";
+			for (auto const &[labels, metric] : family.metrics)
+				metric->Write(os, name, labels);
+		}
+		return os.str();
+	}
+
+private:
+	struct Family
+	{
+		std::string type;
+		std::string help;
+		std::map<std::string, std::unique_ptr<Metric>> metrics; // by labels
+	};
+	struct Registry
+	{
+		std::mutex mutex;
+		std::map<std::string, Family> families;
+	};
+
+	static Registry &registry()
+	{
+		static Registry registry;
+		return registry;
+	}
+
+	template <typename T>
+	static T &get(char const *type, std::string const &name, std::string const &help, std::string const &labels)
+	{
+		std::lock_guard<std::mutex> lock(registry().mutex);
+		Family &family = registry().families[name];
+		if (family.type.empty())
+			family.type = type, family.help = help;
+		else if (family.type != type)
+			throw std::runtime_error("metric " + name + " is already a " + family.type);
+		std::unique_ptr<Metric> &metric = family.metrics[labels];
+		if (!metric)
+			metric = std::make_unique<T>();
+		return static_cast<T &>(*metric);
+	}
+};
@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * metrics_server.cpp - serve /metrics over HTTP from an application's event loop.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <stdexcept>
+
+#include "core/metrics.hpp"
+#include "core/metrics_server.hpp"
+
+MetricsServer::MetricsServer(std::string const &address, bool verbose) : verbose_(verbose)
+{
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	size_t colon = address.rfind(':');
+	std::string ip = colon == std::string::npos ? "127.0.0.1" : address.substr(0, colon);
+	addr.sin_port = htons(std::stoi(address.substr(colon == std::string::npos ? 0 : colon + 1)));
+	if (inet_aton(ip.c_str(), &addr.sin_addr) == 0)
+		throw std::runtime_error("bad metrics address " + address);
+
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	int enable = 1;
+	if (listen_fd_ < 0 || setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 ||
+		bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd_, 8) < 0)
+		throw std::runtime_error("failed to listen for metrics on " + address);
+	if (verbose_)
+		std::cerr << "MetricsServer: listening on " << ip << ":" << ntohs(addr.sin_port) << std::endl;
+}
+
+MetricsServer::~MetricsServer()
+{
+	for (Client &client : clients_)
+		close(client.fd);
+	close(listen_fd_);
+}
+
+int MetricsServer::AddFds(fd_set *fds, int nfds) const
+{
+	FD_SET(listen_fd_, fds);
+	nfds = std::max(nfds, listen_fd_ + 1);
+	for (Client const &client : clients_)
+	{
+		FD_SET(client.fd, fds);
+		nfds = std::max(nfds, client.fd + 1);
+	}
+	return nfds;
+}
+
+void MetricsServer::Service(fd_set const *fds)
+{
+	auto now = std::chrono::steady_clock::now();
+	if (FD_ISSET(listen_fd_, fds))
+	{
+		int fd;
+		while ((fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0)
+		{
+			if (clients_.size() >= MAX_CLIENTS)
+			{
+				close(fd);
+				continue;
+			}
+			clients_.push_back({ fd, now, "", "", 0 });
+		}
+	}
+
+	for (auto it = clients_.begin(); it != clients_.end();)
+	{
+		bool done = false;
+		if (it->response.empty() && FD_ISSET(it->fd, fds))
+		{
+			char buf[1024];
+			ssize_t ret;
+			while ((ret = recv(it->fd, buf, sizeof(buf), 0)) > 0 && it->request.size() < MAX_REQUEST_SIZE)
+				it->request.append(buf, ret);
+			if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+				done = true;
+			else if (it->request.find("\r\n\r\n") != std::string::npos ||
+					 it->request.find("\n\n") != std::string::npos || it->request.size() >= MAX_REQUEST_SIZE)
+				respond(*it);
+		}
+		if (!done && !it->response.empty())
+			done = sendResponse(*it);
+		if (!done && now - it->connected > CLIENT_TIMEOUT)
+		{
+			std::cerr << "WARNING: MetricsServer: dropping slow client" << std::endl;
+			done = true;
+		}
+
+		if (done)
+		{
+			close(it->fd);
+			it = clients_.erase(it);
+		}
+		else
+			it++;
+	}
+}
+
+void MetricsServer::respond(Client &client)
+{
+	std::string status = "200 OK", body;
+	if (client.request.compare(0, 13, "GET /metrics ") == 0 || client.request.compare(0, 14, "GET /metrics\r\n") == 0)
+		body = Metrics::Expose();
+	else
+		status = "404 Not Found";
+	client.response = "HTTP/1.1 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+					  std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+	client.sent = 0;
+	if (verbose_)
+		std::cerr << "MetricsServer: " << status << ", " << body.size() << " bytes" << std::endl;
+}
+
+bool MetricsServer::sendResponse(Client &client)
+{
+	ssize_t ret = send(client.fd, client.response.data() + client.sent, client.response.size() - client.sent,
+					   MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (ret < 0)
+		return errno != EAGAIN && errno != EWOULDBLOCK;
+	client.sent += ret;
+	return client.sent == client.response.size();
+}
@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * metrics_server.hpp - serve /metrics over HTTP from an application's event loop.
+ */
+
+#pragma once
+
+#include <sys/select.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+// A minimal HTTP server for Prometheus to scrape. GET /metrics returns
+// Metrics::Expose(), anything else gets a 404, and every connection is closed
+// after one response.
+//
+// Like ControlSocket it never blocks and has no thread of its own: the
+// application adds our fds to the set it waits on and calls Service() each time
+// round its loop. Responses that don't fit in the socket buffer in one go are
+// finished off on later calls, and clients that take too long are dropped.
+
+class MetricsServer
+{
+public:
+	// address is [ip:]port, where the ip defaults to 127.0.0.1.
+	MetricsServer(std::string const &address, bool verbose);
+	~MetricsServer();
+	// Add our fds to the set, returning the highest one plus one (or nfds, if bigger).
+	int AddFds(fd_set *fds, int nfds) const;
+	// Call every time round the loop, whether or not any of our fds are ready.
+	void Service(fd_set const *fds);
+
+private:
+	static constexpr unsigned int MAX_CLIENTS = 16;
+	static constexpr size_t MAX_REQUEST_SIZE = 8192;
+	static constexpr std::chrono::seconds CLIENT_TIMEOUT { 5 };
+
+	struct Client
+	{
+		int fd;
+		std::chrono::steady_clock::time_point connected;
+		std::string request;
+		std::string response; // empty until the request is complete
+		size_t sent;
+	};
+
+	void respond(Client &client);
+	// Returns true once the client is finished with.
+	bool sendResponse(Client &client);
+
+	bool verbose_;
+	int listen_fd_;
+	std::vector<Client> clients_;
+};
@@ -180,6 +180,28 @@ bool Options::Parse(int argc, char *argv[])
 	if (sscanf(awbgains.c_str(), "%f,%f", &awb_gain_r, &awb_gain_b) != 2)
 		throw std::runtime_error("Invalid AWB gains");
 
+	if (buffers_string == "auto")
+		buffers = 0;
+	else
+	{
+		// stoul would happily turn "-1" into a huge number.
+		size_t end = 0;
+		unsigned long count = 0;
+		if (buffers_string.find('-') == std::string::npos)
+		{
+			try
+			{
+				count = std::stoul(buffers_string, &end);
+			}
+			catch (std::exception const &)
+			{
+			}
+		}
+		if (!end || end != buffers_string.size() || count < 2 || count > 32)
+			throw std::runtime_error("Invalid buffer count: " + buffers_string);
+		buffers = count;
+	}
+
 	brightness = std::clamp(brightness, -1.0f, 1.0f);
 	contrast = std::clamp(contrast, 0.0f, 15.99f); // limits are arbitrary..
 	saturation = std::clamp(saturation, 0.0f, 15.99f); // limits are arbitrary..
@@ -230,6 +252,9 @@ void Options::Print() const
 	std::cerr << "    saturation: " << saturation << std::endl;
 	std::cerr << "    sharpness: " << sharpness << std::endl;
 	std::cerr << "    framerate: " << framerate << std::endl;
+	std::cerr << "    buffers: " << buffers_string << std::endl;
+	std::cerr << "    source: " << source << std::endl;
+	std::cerr << "    trace: " << trace << std::endl;
 	std::cerr << "    denoise: " << denoise << std::endl;
 	std::cerr << "    viewfinder-width: " << viewfinder_width << std::endl;
 	std::cerr << "    viewfinder-height: " << viewfinder_height << std::endl;
@@ -48,6 +48,11 @@ struct Options
 			 "Lists the available cameras attached to the system.")
 			("camera", value<unsigned int>(&camera)->default_value(0),
 			 "Chooses the camera to use. To list the available indexes, use the --list-cameras option.")
+			("trace", value<bool>(&trace)->default_value(false)->implicit_value(true),
+			 "Record per-frame trace points, which the application can dump as Chrome trace JSON")
+			("source", value<std::string>(&source)->default_value("camera"),
+			 "Where frames come from: \"camera\", \"pattern\" for a generated test pattern, or the name of a file "
+			 "of raw YUV420 frames at the output width and height to replay")
 			("verbose,v", value<bool>(&verbose)->default_value(false)->implicit_value(true),
 			 "Output extra debug and diagnostics")
 			("config,c", value<std::string>(&config_file)->implicit_value("config.txt"),
@@ -68,7 +73,7 @@ struct Options
 			("output,o", value<std::string>(&output),
 			 "Set the output file name")
 			("server", value<std::string>(&server),
-			 "Set video server address") 
+			 "Set video server address, tcp://0.0.0.0:port to serve clients or udp://group:port for MPEG-TS multicast")
 			("rawfull", value<bool>(&rawfull)->default_value(false)->implicit_value(true),
 			 "Force use of full resolution raw frames")
 			("hflip", value<bool>(&hflip_)->default_value(false)->implicit_value(true), "Request a horizontal flip transform")
@@ -105,6 +110,9 @@ struct Options
 			 "Adjust the sharpness of the output image, where 1.0 = normal sharpening")
 			("framerate", value<float>(&framerate)->default_value(30.0),
 			 "Set the fixed framerate for preview and video modes")
+			("buffers", value<std::string>(&buffers_string)->default_value("6"),
+			 "Number of camera buffers for each stream (2 to 32), or \"auto\" to find the fewest that avoid "
+			 "dropping frames")
 			("denoise", value<std::string>(&denoise)->default_value("auto"),
 			 "Sets the Denoise operating mode: auto, off, cdn_off, cdn_fast, cdn_hq")
 			("tuning-file", value<std::string>(&tuning_file)->default_value("-"),
@@ -154,6 +162,8 @@ struct Options
 	float saturation;
 	float sharpness;
 	float framerate;
+	std::string buffers_string;
+	unsigned int buffers; // 0 for auto
 	std::string denoise;
 	std::string info_text;
 	unsigned int viewfinder_width;
@@ -163,6 +173,8 @@ struct Options
 	unsigned int lores_width;
 	unsigned int lores_height;
 	unsigned int camera;
+	std::string source;
+	bool trace;
 	std::string mode_string;
 	Mode mode;
 	std::string viewfinder_mode_string;
@@ -0,0 +1,250 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * synthetic_source.cpp - generate or replay frames in place of a camera.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+#include <libcamera/control_ids.h>
+#include <libcamera/formats.h>
+
+#include "core/options.hpp"
+#include "core/synthetic_source.hpp"
+
+// All we need is to be able to fill in the configuration, which only the Camera gets to do.
+class SyntheticSource::Stream : public libcamera::Stream
+{
+public:
+	Stream(libcamera::StreamConfiguration const &cfg) { configuration_ = cfg; }
+};
+
+SyntheticSource::SyntheticSource(Options const *options) : options_(options), fp_(nullptr), abort_(false)
+{
+	if (options->source == "pattern")
+		id_ = "synthetic/pattern";
+	else
+	{
+		fp_ = fopen(options->source.c_str(), "rb");
+		if (!fp_)
+			throw std::runtime_error("failed to open frame source " + options->source);
+		id_ = "synthetic/" + options->source;
+	}
+	if (options->framerate <= 0)
+		throw std::runtime_error("synthetic frame source needs a framerate");
+}
+
+SyntheticSource::~SyntheticSource()
+{
+	Stop();
+	if (fp_)
+		fclose(fp_);
+}
+
+void SyntheticSource::Configure(libcamera::Size video_size, libcamera::Size lores_size, unsigned int buffer_count)
+{
+	// Anything from a previous configuration has already been unmapped by the application.
+	streams_.clear();
+	buffers_.clear();
+	mappings_.clear();
+	buffer_index_.clear();
+
+	auto make_stream = [this, buffer_count](libcamera::Size size) {
+		libcamera::StreamConfiguration cfg;
+		cfg.pixelFormat = libcamera::formats::YUV420;
+		cfg.size = size;
+		cfg.stride = (size.width + 63) & ~63;
+		cfg.frameSize = cfg.stride * size.height * 3 / 2;
+		cfg.bufferCount = buffer_count;
+		streams_.push_back(std::make_unique<Stream>(cfg));
+		buffers_.emplace_back();
+
+		unsigned int y_size = cfg.stride * size.height, uv_size = y_size / 4;
+		for (unsigned int i = 0; i < buffer_count; i++)
+		{
+			int fd = memfd_create("libcamera-synthetic", MFD_CLOEXEC);
+			if (fd < 0 || ftruncate(fd, cfg.frameSize) < 0)
+				throw std::runtime_error("failed to allocate synthetic frame buffer");
+			void *mem = mmap(nullptr, cfg.frameSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (mem == MAP_FAILED)
+				throw std::runtime_error("failed to map synthetic frame buffer");
+
+			libcamera::SharedFD shared_fd(std::move(fd));
+			std::vector<libcamera::FrameBuffer::Plane> planes(3);
+			planes[0] = { shared_fd, 0, y_size };
+			planes[1] = { shared_fd, y_size, uv_size };
+			planes[2] = { shared_fd, y_size + uv_size, uv_size };
+			auto buffer = std::make_unique<libcamera::FrameBuffer>(planes);
+			mappings_[buffer.get()].push_back(
+				libcamera::Span<uint8_t>(static_cast<uint8_t *>(mem), cfg.frameSize));
+			buffer_index_[buffer.get()] = i;
+			buffers_.back().push_back(std::move(buffer));
+		}
+	};
+
+	make_stream(video_size);
+	if (!lores_size.isNull())
+		make_stream(lores_size);
+
+	if (fp_)
+	{
+		fseek(fp_, 0, SEEK_END);
+		if (ftell(fp_) < (long)(video_size.width * video_size.height * 3 / 2))
+			throw std::runtime_error("frame source " + options_->source + " doesn't hold a whole " +
+									 video_size.toString() + " YUV420 frame");
+		rewind(fp_);
+	}
+	if (options_->verbose)
+		std::cerr << "Synthetic source " << id_ << " configured at " << video_size.toString() << std::endl;
+}
+
+void SyntheticSource::Start(CompleteCallback callback)
+{
+	callback_ = callback;
+	abort_ = false;
+	free_.clear();
+	for (unsigned int i = 0; i < buffers_[0].size(); i++)
+		free_.push_back(i);
+	frame_thread_ = std::thread(&SyntheticSource::frameThread, this);
+}
+
+void SyntheticSource::Stop()
+{
+	if (!frame_thread_.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_var_.notify_one();
+	}
+	frame_thread_.join();
+}
+
+void SyntheticSource::Requeue(BufferMap const &buffers)
+{
+	if (buffers.empty())
+		return;
+	std::lock_guard<std::mutex> lock(mutex_);
+	free_.push_back(buffer_index_.at(buffers.begin()->second));
+}
+
+void SyntheticSource::frameThread()
+{
+	using namespace std::chrono;
+	nanoseconds frame_duration((int64_t)(1e9 / options_->framerate));
+	int64_t frame_duration_us = duration_cast<microseconds>(frame_duration).count();
+	steady_clock::time_point next = steady_clock::now();
+	unsigned int dropped = 0;
+
+	for (uint64_t frame = 0;; frame++, next += frame_duration)
+	{
+		unsigned int index;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (cond_var_.wait_until(lock, next, [this] { return abort_; }))
+				break;
+			// A sensor doesn't wait for anyone, so if there's no buffer, or we're
+			// more than a frame late, this frame is lost.
+			if (free_.empty() || steady_clock::now() > next + frame_duration)
+			{
+				dropped++;
+				continue;
+			}
+			index = free_.back();
+			free_.pop_back();
+		}
+
+		BufferMap buffers;
+		for (unsigned int i = 0; i < streams_.size(); i++)
+			buffers[streams_[i].get()] = buffers_[i][index].get();
+		uint8_t *video = mappings_[buffers_[0][index].get()][0].data();
+		fillVideo(video, frame);
+		if (streams_.size() > 1)
+			fillLores(video, mappings_[buffers_[1][index].get()][0].data());
+
+		// steady_clock is CLOCK_MONOTONIC, the same clock as the camera's sensor timestamps.
+		libcamera::ControlList metadata(libcamera::controls::controls);
+		metadata.set(libcamera::controls::SensorTimestamp, (int64_t)duration_cast<nanoseconds>(next.time_since_epoch()).count());
+		metadata.set(libcamera::controls::FrameDuration, frame_duration_us);
+		metadata.set(libcamera::controls::ExposureTime, (int32_t)frame_duration_us);
+		metadata.set(libcamera::controls::AnalogueGain, 1.0f);
+		callback_(buffers, metadata);
+	}
+
+	if (options_->verbose)
+		std::cerr << "Synthetic source stopped, " << dropped << " frames dropped" << std::endl;
+}
+
+void SyntheticSource::fillVideo(uint8_t *mem, uint64_t frame)
+{
+	libcamera::StreamConfiguration const &cfg = streams_[0]->configuration();
+	unsigned int width = cfg.size.width, height = cfg.size.height, stride = cfg.stride;
+	uint8_t *Y = mem, *U = Y + stride * height, *V = U + stride / 2 * height / 2;
+
+	if (fp_)
+	{
+		// The file is tightly packed, our buffers aren't.
+		bool ok = true;
+		for (unsigned int y = 0; y < height && ok; y++)
+			ok = fread(Y + y * stride, width, 1, fp_) == 1;
+		for (uint8_t *plane : { U, V })
+			for (unsigned int y = 0; y < height / 2 && ok; y++)
+				ok = fread(plane + y * stride / 2, width / 2, 1, fp_) == 1;
+		if (!ok)
+		{
+			rewind(fp_);
+			fillVideo(mem, frame);
+		}
+		return;
+	}
+
+	// Scrolling texture with a little noise, so that encoders have some real work to do.
+	uint32_t noise = 0x9e3779b9 * (frame + 1);
+	for (unsigned int y = 0; y < height; y++)
+	{
+		uint8_t *row = Y + y * stride;
+		for (unsigned int x = 0; x < width; x++)
+		{
+			noise ^= noise << 13, noise ^= noise >> 17, noise ^= noise << 5;
+			row[x] = (((x + frame * 4) ^ (y + frame)) & 0xff) / 2 + 64 + (noise & 7);
+		}
+	}
+	for (unsigned int y = 0; y < height / 2; y++)
+	{
+		for (unsigned int x = 0; x < width / 2; x++)
+		{
+			U[y * stride / 2 + x] = 112 + ((x + frame) >> 3 & 31);
+			V[y * stride / 2 + x] = 112 + ((y + frame) >> 3 & 31);
+		}
+	}
+}
+
+void SyntheticSource::fillLores(uint8_t const *video, uint8_t *mem)
+{
+	// Nearest neighbour is plenty for analytics-sized images.
+	libcamera::StreamConfiguration const &src = streams_[0]->configuration();
+	libcamera::StreamConfiguration const &dst = streams_[1]->configuration();
+	for (unsigned int plane = 0; plane < 3; plane++)
+	{
+		unsigned int shift = plane ? 1 : 0;
+		unsigned int src_stride = src.stride >> shift, dst_stride = dst.stride >> shift;
+		unsigned int src_width = src.size.width >> shift, src_height = src.size.height >> shift;
+		unsigned int dst_width = dst.size.width >> shift, dst_height = dst.size.height >> shift;
+		uint8_t const *src_plane = video + (plane ? src.stride * src.size.height : 0) +
+								   (plane == 2 ? src_stride * src_height : 0);
+		uint8_t *dst_plane = mem + (plane ? dst.stride * dst.size.height : 0) + (plane == 2 ? dst_stride * dst_height : 0);
+		for (unsigned int y = 0; y < dst_height; y++)
+		{
+			uint8_t const *src_row = src_plane + (y * src_height / dst_height) * src_stride;
+			uint8_t *dst_row = dst_plane + y * dst_stride;
+			for (unsigned int x = 0; x < dst_width; x++)
+				dst_row[x] = src_row[x * src_width / dst_width];
+		}
+	}
+}
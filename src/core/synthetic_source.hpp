@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * synthetic_source.hpp - generate or replay frames in place of a camera.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <libcamera/base/span.h>
+#include <libcamera/controls.h>
+#include <libcamera/framebuffer.h>
+#include <libcamera/request.h>
+#include <libcamera/stream.h>
+
+struct Options;
+
+// Stands in for the camera when --source isn't "camera", so that encoders,
+// outputs and applications can be run and benchmarked without hardware.
+// Frames are either a moving test pattern ("pattern") or read from a file of
+// raw YUV420 frames at the --width and --height (looping at the end). They
+// arrive at --framerate with timestamps on CLOCK_MONOTONIC spaced at the frame
+// duration, like a sensor's. As with a real camera, if every buffer is still
+// held by the application when a frame is due, that frame is simply lost.
+//
+// LibcameraApp makes the same CompletedRequests from these frames as it does
+// for the camera, so nothing downstream can tell the difference (except that
+// the buffers are memfds, so only encoders that read through the mapping, not
+// the V4L2 codec, can use them).
+
+class SyntheticSource
+{
+public:
+	using BufferMap = libcamera::Request::BufferMap;
+	using CompleteCallback = std::function<void(BufferMap const &, libcamera::ControlList const &)>;
+
+	SyntheticSource(Options const *options);
+	~SyntheticSource();
+
+	std::string const &Id() const { return id_; }
+	// Make the video (and optionally lores) streams and their buffers. The
+	// caller owns the mappings, and must unmap them after Stop().
+	void Configure(libcamera::Size video_size, libcamera::Size lores_size, unsigned int buffer_count);
+	libcamera::Stream *VideoStream() const { return streams_[0].get(); }
+	libcamera::Stream *LoresStream() const { return streams_.size() > 1 ? streams_[1].get() : nullptr; }
+	std::map<libcamera::FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> const &Mappings() const
+	{
+		return mappings_;
+	}
+
+	void Start(CompleteCallback callback);
+	void Stop();
+	// Give back the buffers from a completed request.
+	void Requeue(BufferMap const &buffers);
+
+private:
+	class Stream;
+
+	void frameThread();
+	void fillVideo(uint8_t *mem, uint64_t frame);
+	void fillLores(uint8_t const *video, uint8_t *mem);
+
+	Options const *options_;
+	std::string id_;
+	FILE *fp_;
+	std::vector<std::unique_ptr<libcamera::Stream>> streams_;
+	std::vector<std::vector<std::unique_ptr<libcamera::FrameBuffer>>> buffers_; // per stream
+	std::map<libcamera::FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> mappings_;
+	std::map<libcamera::FrameBuffer *, unsigned int> buffer_index_;
+	std::vector<unsigned int> free_; // buffer sets available for the next frame
+
+	CompleteCallback callback_;
+	bool abort_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::thread frame_thread_;
+};
@@ -0,0 +1,224 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * trace.hpp - per-frame trace points, dumped as Chrome trace JSON.
+ */
+
+#pragma once
+
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Trace points record what happened to each frame, and when, as it goes from
+// the camera through the event loop, the encoder and the outputs. A frame is
+// identified everywhere by its sensor timestamp in microseconds, which is the
+// one thing that travels with it through the whole pipeline.
+//
+// Each thread records into its own fixed-size ring, so recording is a clock
+// read and a few stores with no locks or allocation, and can be left on. The
+// oldest events are simply overwritten. Dump() writes whatever the rings hold
+// as Chrome trace JSON, for chrome://tracing or https://ui.perfetto.dev.
+//
+// Names must be string literals (or otherwise live forever), because only the
+// pointer is kept.
+
+class Trace
+{
+public:
+	static void Enable(bool enable) { enabled().store(enable, std::memory_order_relaxed); }
+	static bool Enabled() { return enabled().load(std::memory_order_relaxed); }
+
+	// CLOCK_MONOTONIC, the clock sensor timestamps use, in nanoseconds.
+	static int64_t Now()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	}
+
+	// Something that took from start_ns to end_ns on this thread.
+	static void Span(char const *name, int64_t frame, int64_t start_ns, int64_t end_ns)
+	{
+		if (Enabled())
+			record('X', name, frame, start_ns, end_ns - start_ns);
+	}
+	// Something that happened to the frame just now.
+	static void Instant(char const *name, int64_t frame)
+	{
+		if (Enabled())
+			record('i', name, frame, Now(), 0);
+	}
+	// Spans that start on one thread and end on another, such as a frame's time
+	// inside the encoder, are matched up by name and frame.
+	static void AsyncBegin(char const *name, int64_t frame)
+	{
+		if (Enabled())
+			record('b', name, frame, Now(), 0);
+	}
+	static void AsyncEnd(char const *name, int64_t frame)
+	{
+		if (Enabled())
+			record('e', name, frame, Now(), 0);
+	}
+
+	static void Dump(std::ostream &os)
+	{
+		std::vector<Event> events;
+		{
+			std::lock_guard<std::mutex> lock(registry().mutex);
+			for (auto &ring : registry().rings)
+				ring->Copy(events);
+		}
+
+		os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		char const *sep = "\n";
+		for (Event const &e : events)
+		{
+			os << sep << "{\"name\":\"" << e.name << "\",\"cat\":\"frame\",\"ph\":\"" << e.phase
+			   << "\",\"pid\":" << getpid() << ",\"tid\":" << e.tid << ",\"ts\":" << e.start_ns / 1000 << "."
+			   << e.start_ns / 100 % 10;
+			if (e.phase == 'X')
+				os << ",\"dur\":" << e.duration_ns / 1000 << "." << e.duration_ns / 100 % 10;
+			else if (e.phase == 'i')
+				os << ",\"s\":\"t\"";
+			else
+				os << ",\"id\":" << e.frame;
+			os << ",\"args\":{\"frame\":" << e.frame << "}}";
+			sep = ",\n";
+		}
+		os << "\n]}\n";
+	}
+
+private:
+	static constexpr unsigned int RING_SIZE = 4096; // events per thread
+
+	struct Event
+	{
+		char const *name;
+		char phase;
+		pid_t tid;
+		int64_t frame;
+		int64_t start_ns;
+		int64_t duration_ns;
+	};
+
+	// Written only by its own thread. Readers copy out the events and then
+	// discard any that the writer may have overwritten while they did so.
+	struct Ring
+	{
+		Event events[RING_SIZE];
+		std::atomic<uint64_t> head { 0 };
+		std::atomic<bool> in_use { true };
+
+		void Copy(std::vector<Event> &out) const
+		{
+			uint64_t end = head.load(std::memory_order_acquire);
+			uint64_t begin = end > RING_SIZE ? end - RING_SIZE : 0;
+			size_t first = out.size();
+			for (uint64_t i = begin; i < end; i++)
+				out.push_back(events[i % RING_SIZE]);
+			// The fence keeps the copying above from moving after the second load of
+			// head, as in a seqlock. The writer may also be halfway through the slot
+			// after its head.
+			std::atomic_thread_fence(std::memory_order_acquire);
+			uint64_t overwritten = head.load(std::memory_order_relaxed) + 1;
+			if (overwritten > begin + RING_SIZE)
+				out.erase(out.begin() + first,
+						  out.begin() + first + std::min<uint64_t>(overwritten - begin - RING_SIZE, end - begin));
+		}
+	};
+
+	struct Registry
+	{
+		std::mutex mutex;
+		std::vector<std::unique_ptr<Ring>> rings;
+	};
+
+	// Gives the thread's ring back when the thread exits, so that threads that
+	// come and go (encoders are restarted for each client) reuse them.
+	struct RingHolder
+	{
+		Ring *ring = nullptr;
+		~RingHolder()
+		{
+			if (ring)
+				ring->in_use.store(false, std::memory_order_release);
+		}
+	};
+
+	static std::atomic<bool> &enabled()
+	{
+		static std::atomic<bool> enabled(false);
+		return enabled;
+	}
+	static Registry &registry()
+	{
+		static Registry registry;
+		return registry;
+	}
+
+	static Ring *threadRing()
+	{
+		thread_local RingHolder holder;
+		if (!holder.ring)
+		{
+			std::lock_guard<std::mutex> lock(registry().mutex);
+			for (auto &ring : registry().rings)
+			{
+				bool expected = false;
+				if (ring->in_use.compare_exchange_strong(expected, true))
+				{
+					holder.ring = ring.get();
+					break;
+				}
+			}
+			if (!holder.ring)
+			{
+				registry().rings.push_back(std::make_unique<Ring>());
+				holder.ring = registry().rings.back().get();
+			}
+		}
+		return holder.ring;
+	}
+
+	static void record(char phase, char const *name, int64_t frame, int64_t start_ns, int64_t duration_ns)
+	{
+		thread_local pid_t tid = syscall(SYS_gettid);
+		Ring *ring = threadRing();
+		uint64_t head = ring->head.load(std::memory_order_relaxed);
+		// As for a seqlock writer, this keeps the slot from changing before the last
+		// store to head can be seen, which is what Copy() relies on to spot it.
+		std::atomic_thread_fence(std::memory_order_release);
+		ring->events[head % RING_SIZE] = { name, phase, tid, frame, start_ns, duration_ns };
+		ring->head.store(head + 1, std::memory_order_release);
+	}
+};
+
+// Records a span for the rest of the enclosing scope.
+class TraceScope
+{
+public:
+	TraceScope(char const *name, int64_t frame)
+		: name_(name), frame_(frame), start_ns_(Trace::Enabled() ? Trace::Now() : 0)
+	{
+	}
+	~TraceScope()
+	{
+		if (start_ns_)
+			Trace::Span(name_, frame_, start_ns_, Trace::Now());
+	}
+
+private:
+	char const *name_;
+	int64_t frame_;
+	int64_t start_ns_;
+};
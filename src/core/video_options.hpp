@@ -8,8 +8,11 @@
 #pragma once
 
 #include <cstdio>
+#include <cstdlib>
 
+#include <sstream>
 #include <string>
+#include <vector>
 
 #include "options.hpp"
 
@@ -33,7 +36,13 @@ struct VideoOptions : public Options
 			("inline", value<bool>(&inline_headers)->default_value(false)->implicit_value(true),
 			 "Force PPS/SPS header with every I frame (h264 only)")
 			("codec", value<std::string>(&codec)->default_value("h264"),
-			 "Set the codec to use, either h264, mjpeg or yuv420")
+			 "Set the codec to use, either h264, libav (software h264), mjpeg or yuv420")
+			("libav-video-codec", value<std::string>(&libav_video_codec)->default_value("libx264"),
+			 "Which libavcodec encoder to use with the libav codec, such as libx264 or libopenh264")
+			("libav-preset", value<std::string>(&libav_preset)->default_value("ultrafast"),
+			 "Encoder speed/quality preset for the libav codec")
+			("libav-threads", value<unsigned int>(&libav_threads)->default_value(0),
+			 "Number of slice threads for the libav codec (0 = automatic)")
 			("save-pts", value<std::string>(&save_pts),
 			 "Save a timestamp file with this name")
 			("quality,q", value<int>(&quality)->default_value(50),
@@ -50,8 +59,45 @@ struct VideoOptions : public Options
 			 "Create a new output file every time recording is paused and then resumed")
 			("segment", value<uint32_t>(&segment)->default_value(0),
 			 "Break the recording into files of approximately this many milliseconds")
+			("write-ring", value<uint32_t>(&write_ring)->default_value(8),
+			 "Size (in MB) of the buffer ring through which output files are written in the background")
+			("retain-size", value<uint32_t>(&retain_size)->default_value(0),
+			 "Delete the oldest segments once the recordings exceed this many MB (0 = no limit)")
+			("retain-age", value<uint32_t>(&retain_age)->default_value(0),
+			 "Delete segments older than this many seconds (0 = no limit)")
+			("index", value<std::string>(&index),
+			 "Keep a time index of every keyframe in the recording in this file")
 			("circular", value<size_t>(&circular)->default_value(0)->implicit_value(4),
 			 "Write output to a circular buffer of the given size (in MB) which is saved on exit")
+			("record", value<std::string>(&record),
+			 "Record to this file (a pattern when used with --segment) while also serving the stream (libcamera-server only)")
+			("circular-file", value<std::string>(&circular_file),
+			 "Keep the circular buffer in this file, so that it survives the program crashing, and recover it at startup")
+			("event-output", value<std::string>(&event_output),
+			 "With --circular, save the buffer around each event (signal) to a new file with this name")
+			("preroll", value<uint32_t>(&preroll)->default_value(5),
+			 "Number of seconds before an event to save from the circular buffer")
+			("postroll", value<uint32_t>(&postroll)->default_value(5),
+			 "Number of seconds after an event to save")
+			("abr-min-bitrate", value<uint32_t>(&abr_min_bitrate)->default_value(0),
+			 "Adapt the bitrate to how fast tcp clients keep up, down to this many bits/second (0 = off, h264 only, "
+			 "not with --record or --circular)")
+			("abr-max-bitrate", value<uint32_t>(&abr_max_bitrate)->default_value(0),
+			 "The most that adaptive bitrate will go up to (defaults to --bitrate)")
+			("control", value<std::string>(&control),
+			 "Accept commands on this Unix socket as well as by signal (libcamera-server only)")
+			("metrics", value<std::string>(&metrics),
+			 "Serve Prometheus metrics over HTTP on [address:]port, the address defaulting to 127.0.0.1 "
+			 "(libcamera-server only)")
+			("publish", value<std::string>(&publish),
+			 "Share raw frames (lores if configured) with local processes through this Unix socket (libcamera-server only)")
+			("cameras", value<std::string>(&cameras),
+			 "Run all these comma-separated cameras, instead of just --camera, in the one process. %c in file names "
+			 "and socket paths becomes the camera number (or, with several cameras, it goes before the extension), "
+			 "and each camera's --server port is one more than the last (libcamera-server only)")
+			("sync", value<uint32_t>(&sync)->default_value(0),
+			 "With several cameras, match up frames captured within this many microseconds of each other, and take "
+			 "snapshots of all the cameras from one such set (0 = off, libcamera-server only)")
 			("frames", value<unsigned int>(&frames)->default_value(0),
 			 "Run for the exact number of frames specified. This will override any timeout set.")
 			;
@@ -65,6 +111,9 @@ struct VideoOptions : public Options
 	bool inline_headers;
 	std::string codec;
 	std::string libav_format;
+	std::string libav_video_codec;
+	std::string libav_preset;
+	unsigned int libav_threads;
 	bool libav_audio;
 	std::string audio_codec;
 	std::string audio_device;
@@ -79,7 +128,24 @@ struct VideoOptions : public Options
 	bool pause;
 	bool split;
 	uint32_t segment;
+	uint32_t write_ring;
+	uint32_t retain_size;
+	uint32_t retain_age;
+	std::string index;
 	size_t circular;
+	std::string record;
+	std::string circular_file;
+	std::string event_output;
+	uint32_t preroll;
+	uint32_t postroll;
+	uint32_t abr_min_bitrate;
+	uint32_t abr_max_bitrate;
+	std::string control;
+	std::string metrics;
+	std::string publish;
+	std::string cameras;
+	std::vector<unsigned int> camera_list; // from --cameras, or just --camera
+	uint32_t sync;
 	uint32_t frames;
 
 	virtual bool Parse(int argc, char *argv[]) override
@@ -111,6 +177,34 @@ struct VideoOptions : public Options
 			std::cerr << "WARNING: consider inline headers with 'pause'/split/segment/circular" << std::endl;
 		if ((split || segment) && output.find('%') == std::string::npos)
 			std::cerr << "WARNING: expected % directive in output filename" << std::endl;
+		if (abr_min_bitrate)
+		{
+			if (codec != "h264" && codec != "libav")
+				throw std::runtime_error("adaptive bitrate requires the h264 or libav codec");
+			// The recording would get whatever bitrate the stream's clients could manage.
+			if (!record.empty() || circular)
+				throw std::runtime_error(
+					"adaptive bitrate can't be used with --record or --circular, which share the encoder");
+			if (!abr_max_bitrate)
+				abr_max_bitrate = bitrate;
+			if (abr_max_bitrate < abr_min_bitrate)
+				throw std::runtime_error("adaptive bitrate needs --abr-max-bitrate or --bitrate above --abr-min-bitrate");
+		}
+		camera_list.clear();
+		if (cameras.empty())
+			camera_list.push_back(camera);
+		else
+		{
+			std::stringstream list(cameras);
+			for (std::string item; std::getline(list, item, ',');)
+			{
+				char *end;
+				unsigned long n = strtoul(item.c_str(), &end, 10);
+				if (item.empty() || *end)
+					throw std::runtime_error("bad camera list " + cameras);
+				camera_list.push_back(n);
+			}
+		}
 
 		return true;
 	}
@@ -124,12 +218,31 @@ struct VideoOptions : public Options
 		std::cerr << "    inline: " << inline_headers << std::endl;
 		std::cerr << "    save-pts: " << save_pts << std::endl;
 		std::cerr << "    codec: " << codec << std::endl;
+		std::cerr << "    libav-video-codec: " << libav_video_codec << std::endl;
+		std::cerr << "    libav-preset: " << libav_preset << std::endl;
+		std::cerr << "    libav-threads: " << libav_threads << std::endl;
 		std::cerr << "    quality (for MJPEG): " << quality << std::endl;
 		std::cerr << "    keypress: " << keypress << std::endl;
 		std::cerr << "    signal: " << signal << std::endl;
 		std::cerr << "    initial: " << initial << std::endl;
 		std::cerr << "    split: " << split << std::endl;
 		std::cerr << "    segment: " << segment << std::endl;
+		std::cerr << "    write-ring: " << write_ring << std::endl;
+		std::cerr << "    retain-size: " << retain_size << std::endl;
+		std::cerr << "    retain-age: " << retain_age << std::endl;
+		std::cerr << "    index: " << index << std::endl;
 		std::cerr << "    circular: " << circular << std::endl;
+		std::cerr << "    record: " << record << std::endl;
+		std::cerr << "    circular-file: " << circular_file << std::endl;
+		std::cerr << "    event-output: " << event_output << std::endl;
+		std::cerr << "    preroll: " << preroll << std::endl;
+		std::cerr << "    postroll: " << postroll << std::endl;
+		std::cerr << "    abr-min-bitrate: " << abr_min_bitrate << std::endl;
+		std::cerr << "    abr-max-bitrate: " << abr_max_bitrate << std::endl;
+		std::cerr << "    control: " << control << std::endl;
+		std::cerr << "    metrics: " << metrics << std::endl;
+		std::cerr << "    publish: " << publish << std::endl;
+		std::cerr << "    cameras: " << cameras << std::endl;
+		std::cerr << "    sync: " << sync << std::endl;
 	}
 };
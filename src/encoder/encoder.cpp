@@ -6,11 +6,17 @@
  */
 
 #include <cstring>
+#include <iostream>
+
+#include <unistd.h>
 
 #include "encoder.hpp"
 #include "h264_encoder.hpp"
 #include "mjpeg_encoder.hpp"
 #include "null_encoder.hpp"
+#if LIBAV_PRESENT
+#include "libav_encoder.hpp"
+#endif
 
 
 Encoder *Encoder::Create(VideoOptions const *options, const StreamInfo &info)
@@ -18,7 +24,21 @@ Encoder *Encoder::Create(VideoOptions const *options, const StreamInfo &info)
 	if (strcasecmp(options->codec.c_str(), "yuv420") == 0)
 		return new NullEncoder(options);
 	else if (strcasecmp(options->codec.c_str(), "h264") == 0)
+	{
+#if LIBAV_PRESENT
+		// Without the hardware codec, we can still do it in software.
+		if (access("/dev/video1", F_OK) < 0)
+		{
+			std::cerr << "WARNING: no V4L2 H264 encoder, using libav instead" << std::endl;
+			return new LibAvEncoder(options, info);
+		}
+#endif
 		return new H264Encoder(options, info);
+	}
+#if LIBAV_PRESENT
+	else if (strcasecmp(options->codec.c_str(), "libav") == 0)
+		return new LibAvEncoder(options, info);
+#endif
 	else if (strcasecmp(options->codec.c_str(), "mjpeg") == 0)
 		return new MjpegEncoder(options);
 	throw std::runtime_error("Unrecognised codec " + options->codec);
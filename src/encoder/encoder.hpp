@@ -8,10 +8,22 @@
 #pragma once
 
 #include <functional>
+#include <optional>
+#include <stdexcept>
 
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
 
+// Parameters that can be changed while the encoder is running. Fields that
+// aren't set are left alone.
+struct EncoderParameters
+{
+	std::optional<uint32_t> bitrate;
+	std::optional<unsigned int> intra;
+	std::optional<int> quality;
+	bool keyframe = false; // make the next frame a keyframe
+};
+
 typedef std::function<void(void *)> InputDoneCallback;
 typedef std::function<void(void *, size_t, int64_t, bool)> OutputReadyCallback;
 
@@ -32,6 +44,14 @@ public:
 	// Encode the given buffer. The buffer is specified both by an fd and size
 	// describing a DMABUF, and by a mmapped userland pointer.
 	virtual void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) = 0;
+	// Change parameters without restarting the encoder. They take effect from the
+	// next frame passed to EncodeBuffer. Encoders throw if asked to change
+	// something they can't.
+	virtual void SetParameters(EncoderParameters const &params)
+	{
+		if (params.bitrate || params.intra || params.quality || params.keyframe)
+			throw std::runtime_error("encoder parameters cannot be changed");
+	}
 
 protected:
 	InputDoneCallback input_done_callback_;
@@ -249,6 +249,7 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 		index = input_buffers_available_.front();
 		input_buffers_available_.pop();
 	}
+	applyParameters();
 	v4l2_buffer buf = {};
 	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
 	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
@@ -266,6 +267,54 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 		throw std::runtime_error("failed to queue input to codec");
 }
 
+void H264Encoder::SetParameters(EncoderParameters const &params)
+{
+	if (params.quality)
+		throw std::runtime_error("quality only applies to mjpeg");
+	std::lock_guard<std::mutex> lock(parameters_mutex_);
+	if (params.bitrate)
+		pending_parameters_.bitrate = params.bitrate;
+	if (params.intra)
+		pending_parameters_.intra = params.intra;
+	pending_parameters_.keyframe |= params.keyframe;
+}
+
+void H264Encoder::applyParameters()
+{
+	EncoderParameters params;
+	{
+		std::lock_guard<std::mutex> lock(parameters_mutex_);
+		std::swap(params, pending_parameters_);
+	}
+
+	// The codec takes these between frames, so we don't want to stop encoding
+	// if one of them fails.
+	v4l2_control ctrl = {};
+	if (params.bitrate)
+	{
+		ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+		ctrl.value = *params.bitrate;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			std::cerr << "WARNING: H264Encoder: failed to set bitrate " << *params.bitrate << std::endl;
+		else if (options_->verbose)
+			std::cerr << "H264Encoder: bitrate now " << *params.bitrate << std::endl;
+	}
+	if (params.intra)
+	{
+		ctrl.id = V4L2_CID_MPEG_VIDEO_H264_I_PERIOD;
+		ctrl.value = *params.intra;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			std::cerr << "WARNING: H264Encoder: failed to set intra period " << *params.intra << std::endl;
+	}
+	if (params.keyframe)
+	{
+		ctrl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+		ctrl.value = 1;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			std::cerr << "WARNING: H264Encoder: failed to force keyframe" << std::endl;
+	}
+}
+
 void H264Encoder::pollThread()
 {
 	while (true)
@@ -21,6 +21,7 @@ public:
 	~H264Encoder();
 	// Encode the given DMABUF.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	void SetParameters(EncoderParameters const &params) override;
 
 private:
 	// We want at least as many output buffers as there are in the camera queue
@@ -40,6 +41,9 @@ private:
 	// re-use.
 	void outputThread();
 
+	// Apply any parameter changes, just before queueing the next frame.
+	void applyParameters();
+
 	bool abortPoll_;
 	bool abortOutput_;
 	int fd_;
@@ -66,4 +70,6 @@ private:
 	std::mutex output_mutex_;
 	std::condition_variable output_cond_var_;
 	std::thread output_thread_;
+	std::mutex parameters_mutex_;
+	EncoderParameters pending_parameters_;
 };
@@ -0,0 +1,238 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * libav_encoder.cpp - software h264 encoder using libavcodec.
+ */
+
+#include <chrono>
+#include <iostream>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+}
+
+#include "libav_encoder.hpp"
+
+LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
+	: Encoder(options), codec_ctx_(nullptr), info_(info), abortEncode_(false), abortOutput_(false),
+	  frames_dropped_(0), frames_queued_(0)
+{
+	AVCodec const *codec = avcodec_find_encoder_by_name(options->libav_video_codec.c_str());
+	if (!codec)
+		throw std::runtime_error("libav: codec " + options->libav_video_codec + " not available");
+	codec_ctx_ = avcodec_alloc_context3(codec);
+	if (!codec_ctx_)
+		throw std::runtime_error("libav: failed to allocate codec context");
+
+	codec_ctx_->width = info.width;
+	codec_ctx_->height = info.height;
+	codec_ctx_->pix_fmt = AV_PIX_FMT_YUV420P;
+	// We pass timestamps straight through in microseconds.
+	codec_ctx_->time_base = { 1, 1000000 };
+	float framerate = options->framerate > 0 ? options->framerate : 30;
+	codec_ctx_->framerate = av_d2q(framerate, 1000);
+	// Default to a keyframe every couple of seconds, which suits streaming better than libavcodec's 12.
+	codec_ctx_->gop_size = options->intra ? options->intra : 2 * framerate;
+	codec_ctx_->max_b_frames = 0;
+	if (options->bitrate)
+		codec_ctx_->bit_rate = options->bitrate;
+	// Slice threads add no latency, unlike frame threads.
+	codec_ctx_->thread_type = FF_THREAD_SLICE;
+	codec_ctx_->thread_count = options->libav_threads;
+
+	// libx264 understands all of these; other codecs ignore the ones they don't.
+	av_opt_set(codec_ctx_->priv_data, "preset", options->libav_preset.c_str(), 0);
+	av_opt_set(codec_ctx_->priv_data, "tune", "zerolatency", 0);
+	av_opt_set_int(codec_ctx_->priv_data, "forced-idr", 1, 0);
+	if (!options->profile.empty())
+		av_opt_set(codec_ctx_->priv_data, "profile", options->profile.c_str(), 0);
+
+	if (avcodec_open2(codec_ctx_, codec, nullptr) < 0)
+	{
+		avcodec_free_context(&codec_ctx_);
+		throw std::runtime_error("libav: failed to open codec " + options->libav_video_codec);
+	}
+	if (options->verbose)
+		std::cerr << "Opened LibAvEncoder using " << options->libav_video_codec << ", preset "
+				  << options->libav_preset << std::endl;
+
+	output_thread_ = std::thread(&LibAvEncoder::outputThread, this);
+	encode_thread_ = std::thread(&LibAvEncoder::encodeThread, this);
+}
+
+LibAvEncoder::~LibAvEncoder()
+{
+	{
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		abortEncode_ = true;
+		encode_cond_var_.notify_one();
+	}
+	encode_thread_.join();
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abortOutput_ = true;
+		output_cond_var_.notify_one();
+	}
+	output_thread_.join();
+	avcodec_free_context(&codec_ctx_);
+	if (options_->verbose)
+		std::cerr << "LibAvEncoder closed, " << frames_dropped_ << " frames dropped" << std::endl;
+}
+
+void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+{
+	std::lock_guard<std::mutex> lock(encode_mutex_);
+	bool drop = frames_queued_ >= MAX_QUEUED_FRAMES;
+	if (drop)
+		frames_dropped_++;
+	else
+		frames_queued_++;
+	encode_queue_.push({ mem, timestamp_us, drop });
+	encode_cond_var_.notify_one();
+}
+
+void LibAvEncoder::SetParameters(EncoderParameters const &params)
+{
+	// libx264 picks up bitrate changes between frames, but not the GOP size.
+	if (params.intra || params.quality)
+		throw std::runtime_error("libav encoder can only change bitrate at runtime");
+	std::lock_guard<std::mutex> lock(parameters_mutex_);
+	if (params.bitrate)
+		pending_parameters_.bitrate = params.bitrate;
+	pending_parameters_.keyframe |= params.keyframe;
+}
+
+void LibAvEncoder::encodeThread()
+{
+	AVFrame *frame = av_frame_alloc();
+	if (!frame)
+		throw std::runtime_error("libav: failed to allocate frame");
+	std::chrono::duration<double> encode_time(0);
+	unsigned int frames = 0;
+
+	EncodeItem item;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(encode_mutex_);
+			while (true)
+			{
+				using namespace std::chrono_literals;
+				if (!encode_queue_.empty())
+				{
+					item = encode_queue_.front();
+					encode_queue_.pop();
+					break;
+				}
+				if (abortEncode_)
+				{
+					// Flush out whatever the codec is still holding on to.
+					avcodec_send_frame(codec_ctx_, nullptr);
+					receivePackets();
+					av_frame_free(&frame);
+					if (frames && options_->verbose)
+						std::cerr << "Encode " << frames << " frames, average time "
+								  << encode_time.count() * 1000 / frames << "ms" << std::endl;
+					return;
+				}
+				encode_cond_var_.wait_for(lock, 200ms);
+			}
+		}
+
+		if (item.drop)
+		{
+			input_done_callback_(nullptr);
+			continue;
+		}
+
+		EncoderParameters params;
+		{
+			std::lock_guard<std::mutex> lock(parameters_mutex_);
+			std::swap(params, pending_parameters_);
+		}
+		if (params.bitrate)
+			codec_ctx_->bit_rate = *params.bitrate;
+
+		// Wrap the camera buffer; libavcodec takes its own copy if it needs to keep it.
+		uint8_t *Y = (uint8_t *)item.mem;
+		frame->format = AV_PIX_FMT_YUV420P;
+		frame->width = info_.width;
+		frame->height = info_.height;
+		frame->data[0] = Y;
+		frame->data[1] = Y + info_.stride * info_.height;
+		frame->data[2] = frame->data[1] + (info_.stride / 2) * (info_.height / 2);
+		frame->linesize[0] = info_.stride;
+		frame->linesize[1] = frame->linesize[2] = info_.stride / 2;
+		frame->pts = item.timestamp_us;
+		frame->pict_type = params.keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+		auto start_time = std::chrono::high_resolution_clock::now();
+		int ret = avcodec_send_frame(codec_ctx_, frame);
+		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
+		frames++;
+		{
+			std::lock_guard<std::mutex> lock(encode_mutex_);
+			frames_queued_--;
+		}
+		// The codec is done with our buffer now, so it can go back, in order.
+		input_done_callback_(nullptr);
+		if (ret < 0)
+			throw std::runtime_error("libav: failed to send frame to codec");
+		receivePackets();
+	}
+}
+
+void LibAvEncoder::receivePackets()
+{
+	while (true)
+	{
+		AVPacket *packet = av_packet_alloc();
+		if (!packet)
+			throw std::runtime_error("libav: failed to allocate packet");
+		int ret = avcodec_receive_packet(codec_ctx_, packet);
+		if (ret < 0)
+		{
+			av_packet_free(&packet);
+			if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+				return;
+			throw std::runtime_error("libav: failed to receive packet from codec");
+		}
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		output_queue_.push(packet);
+		output_cond_var_.notify_one();
+	}
+}
+
+void LibAvEncoder::outputThread()
+{
+	AVPacket *packet;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(output_mutex_);
+			while (true)
+			{
+				using namespace std::chrono_literals;
+				// Must check the abort first, to allow items in the output
+				// queue to have a callback.
+				if (abortOutput_ && output_queue_.empty())
+					return;
+
+				if (!output_queue_.empty())
+				{
+					packet = output_queue_.front();
+					output_queue_.pop();
+					break;
+				}
+				else
+					output_cond_var_.wait_for(lock, 200ms);
+			}
+		}
+
+		output_ready_callback_(packet->data, packet->size, packet->pts, !!(packet->flags & AV_PKT_FLAG_KEY));
+		av_packet_free(&packet);
+	}
+}
@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * libav_encoder.hpp - software h264 encoder using libavcodec.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+#include "encoder.hpp"
+
+struct AVCodecContext;
+struct AVPacket;
+
+// Produces the same H.264 elementary stream as H264Encoder, but in software,
+// for when there is no V4L2 codec. Frames are handed to libavcodec in order
+// by a single thread, which then returns the input buffer, so the caller's
+// "input done" callbacks still come back in the order the frames went in.
+//
+// Software encoding can fall behind the camera. Rather than let latency
+// grow, once MAX_QUEUED_FRAMES are waiting any further frames are returned
+// unencoded (still in order).
+
+class LibAvEncoder : public Encoder
+{
+public:
+	LibAvEncoder(VideoOptions const *options, StreamInfo const &info);
+	~LibAvEncoder();
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	void SetParameters(EncoderParameters const &params) override;
+
+private:
+	static constexpr unsigned int MAX_QUEUED_FRAMES = 3;
+
+	// Feeds frames to the codec and collects whatever packets it has ready.
+	void encodeThread();
+
+	// As with the other encoders, the application gets its output on another
+	// thread so that it can take its time without holding up encoding.
+	void outputThread();
+
+	void receivePackets();
+
+	AVCodecContext *codec_ctx_;
+	StreamInfo info_;
+	bool abortEncode_;
+	bool abortOutput_;
+	unsigned int frames_dropped_;
+
+	struct EncodeItem
+	{
+		void *mem;
+		int64_t timestamp_us;
+		bool drop;
+	};
+	std::queue<EncodeItem> encode_queue_;
+	unsigned int frames_queued_; // not counting ones we're dropping
+	std::mutex encode_mutex_;
+	std::condition_variable encode_cond_var_;
+	std::thread encode_thread_;
+
+	std::mutex parameters_mutex_;
+	EncoderParameters pending_parameters_;
+
+	std::queue<AVPacket *> output_queue_;
+	std::mutex output_mutex_;
+	std::condition_variable output_cond_var_;
+	std::thread output_thread_;
+};
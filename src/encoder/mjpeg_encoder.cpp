@@ -19,7 +19,7 @@ typedef unsigned long jpeg_mem_len_t;
 #endif
 
 MjpegEncoder::MjpegEncoder(VideoOptions const *options)
-	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0)
+	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0), quality_(options->quality)
 {
 	output_thread_ = std::thread(&MjpegEncoder::outputThread, this);
 	for (int i = 0; i < NUM_ENC_THREADS; i++)
@@ -42,11 +42,21 @@ MjpegEncoder::~MjpegEncoder()
 void MjpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
 	std::lock_guard<std::mutex> lock(encode_mutex_);
-	EncodeItem item = { mem, info, timestamp_us, index_++ };
+	EncodeItem item = { mem, info, timestamp_us, index_++, quality_ };
 	encode_queue_.push(item);
 	encode_cond_var_.notify_all();
 }
 
+void MjpegEncoder::SetParameters(EncoderParameters const &params)
+{
+	if (params.bitrate || params.intra)
+		throw std::runtime_error("bitrate and intra only apply to h264");
+	// Every mjpeg frame is a keyframe anyway.
+	std::lock_guard<std::mutex> lock(encode_mutex_);
+	if (params.quality)
+		quality_ = *params.quality;
+}
+
 void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer,
 							  size_t &buffer_len)
 {
@@ -59,7 +69,7 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 
 	jpeg_set_defaults(&cinfo);
 	cinfo.raw_data_in = TRUE;
-	jpeg_set_quality(&cinfo, options_->quality, TRUE);
+	jpeg_set_quality(&cinfo, item.quality, TRUE);
 	encoded_buffer = nullptr;
 	buffer_len = 0;
 	jpeg_mem_len_t jpeg_mem_len;
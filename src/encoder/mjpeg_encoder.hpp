@@ -23,6 +23,7 @@ public:
 	~MjpegEncoder();
 	// Encode the given buffer.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	void SetParameters(EncoderParameters const &params) override;
 
 private:
 	// How many threads to use. Whichever thread is idle will pick up the next frame.
@@ -39,6 +40,9 @@ private:
 	bool abortEncode_;
 	bool abortOutput_;
 	uint64_t index_;
+	// Each frame carries the quality it was queued with, so a change applies from
+	// the next frame whichever thread happens to encode it.
+	int quality_;
 
 	struct EncodeItem
 	{
@@ -46,6 +50,7 @@ private:
 		StreamInfo info;
 		int64_t timestamp_us;
 		uint64_t index;
+		int quality;
 	};
 	std::queue<EncodeItem> encode_queue_;
 	std::mutex encode_mutex_;
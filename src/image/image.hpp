@@ -18,7 +18,8 @@
 
 // In jpeg.cpp:
 void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
-			   libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_name);
+			   libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_name,
+			   int quality = 93);
 
 // In yuv.cpp:
 void yuv_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
@@ -510,7 +510,7 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem,
 
 void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			   ControlList const &metadata, std::string const &filename,
-			   std::string const &cam_name)
+			   std::string const &cam_name, int quality)
 {
 	FILE *fp = nullptr;
 	uint8_t *thumb_buffer = nullptr;
@@ -538,7 +538,7 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 		// YUV422 or YUV420 planar format).
 
 		jpeg_mem_len_t jpeg_len;
-		YUV_to_JPEG((uint8_t *)(mem[0].data()), info, info.width, info.height, 93,
+		YUV_to_JPEG((uint8_t *)(mem[0].data()), info, info.width, info.height, quality,
 					0, jpeg_buffer, jpeg_len);
 
 		// Write everything out.
@@ -0,0 +1,278 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * async_writer.cpp - write files in the background from a ring of aligned buffers.
+ */
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "async_writer.hpp"
+
+#if LIBURING_PRESENT
+#include <liburing.h>
+#else
+struct io_uring
+{
+};
+#endif
+
+static constexpr size_t ALIGN = 4096;
+
+AsyncWriter::AsyncWriter(size_t buffer_size, unsigned int num_buffers, bool verbose)
+	: buffer_size_(buffer_size), buffers_(num_buffers), current_(nullptr), error_(0), ring_failed_(false),
+	  abort_(false)
+{
+	for (Buffer &buffer : buffers_)
+	{
+		void *mem;
+		if (posix_memalign(&mem, ALIGN, buffer_size_))
+			throw std::runtime_error("failed to allocate write buffers");
+		buffer.mem = static_cast<uint8_t *>(mem);
+		free_buffers_.push(&buffer);
+	}
+
+#if LIBURING_PRESENT
+	// One extra entry for the nop that wakes the completion thread at the end.
+	ring_ = std::make_unique<io_uring>();
+	int ret = io_uring_queue_init(num_buffers + 1, ring_.get(), 0);
+	if (ret == 0)
+	{
+		completion_thread_ = std::thread(&AsyncWriter::completionThread, this);
+		if (verbose)
+			std::cerr << "AsyncWriter: using io_uring" << std::endl;
+		return;
+	}
+	ring_.reset();
+	if (verbose)
+		std::cerr << "AsyncWriter: io_uring unavailable (" << strerror(-ret) << ")" << std::endl;
+#endif
+
+	for (int i = 0; i < NUM_WORKER_THREADS; i++)
+		worker_threads_.emplace_back(&AsyncWriter::workerThread, this);
+	if (verbose)
+		std::cerr << "AsyncWriter: using " << NUM_WORKER_THREADS << " writer threads" << std::endl;
+}
+
+AsyncWriter::~AsyncWriter()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_var_.wait(lock, [this] { return pending_.empty(); });
+		abort_ = true;
+		jobs_cond_var_.notify_all();
+	}
+	for (auto &thread : worker_threads_)
+		thread.join();
+
+#if LIBURING_PRESENT
+	if (ring_)
+	{
+		{
+			std::lock_guard<std::mutex> lock(ring_mutex_);
+			io_uring_sqe *sqe = io_uring_get_sqe(ring_.get());
+			io_uring_prep_nop(sqe);
+			io_uring_sqe_set_data(sqe, nullptr);
+			io_uring_submit(ring_.get());
+		}
+		completion_thread_.join();
+		io_uring_queue_exit(ring_.get());
+	}
+#endif
+
+	for (Buffer &buffer : buffers_)
+		free(buffer.mem);
+}
+
+bool AsyncWriter::Write(int fd, off_t offset, void const *mem, size_t size, bool flush)
+{
+	// Any earlier failure gets reported here, on the caller's thread.
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (error_)
+			throw std::runtime_error("failed to write output bytes: " + std::string(strerror(error_)));
+	}
+
+	if (current_ && (current_->fd != fd || current_->offset + (off_t)current_->used != offset))
+		Flush();
+
+	// Work out how many fresh buffers we need and make sure they're there before
+	// copying anything, so that we never write out part of the data.
+	size_t space = current_ ? buffer_size_ - current_->used : 0;
+	size_t needed = size > space ? (size - space + buffer_size_ - 1) / buffer_size_ : 0;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (free_buffers_.size() < needed)
+			return false;
+	}
+
+	uint8_t const *src = static_cast<uint8_t const *>(mem);
+	while (size)
+	{
+		if (!current_)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			current_ = free_buffers_.front();
+			free_buffers_.pop();
+			current_->fd = fd;
+			current_->offset = offset;
+			current_->used = 0;
+			current_->done = 0;
+		}
+		size_t n = std::min(size, buffer_size_ - current_->used);
+		memcpy(current_->mem + current_->used, src, n);
+		current_->used += n;
+		src += n;
+		offset += n;
+		size -= n;
+		if (current_->used == buffer_size_)
+			Flush();
+	}
+
+	if (flush)
+		Flush();
+
+	return true;
+}
+
+void AsyncWriter::Flush()
+{
+	if (current_)
+		submit(current_);
+	current_ = nullptr;
+}
+
+void AsyncWriter::Wait(int fd)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	cond_var_.wait(lock, [this, fd] { return pending_.find(fd) == pending_.end(); });
+}
+
+void AsyncWriter::submit(Buffer *buffer)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (ring_failed_)
+	{
+		free_buffers_.push(buffer);
+		return;
+	}
+	pending_[buffer->fd]++;
+
+#if LIBURING_PRESENT
+	if (ring_)
+	{
+		// There are never more buffers in flight than ring entries, so we always get an sqe.
+		std::lock_guard<std::mutex> ring_lock(ring_mutex_);
+		io_uring_sqe *sqe = io_uring_get_sqe(ring_.get());
+		io_uring_prep_write(sqe, buffer->fd, buffer->mem + buffer->done, buffer->used - buffer->done,
+							buffer->offset + buffer->done);
+		io_uring_sqe_set_data(sqe, buffer);
+		io_uring_submit(ring_.get());
+		return;
+	}
+#endif
+
+	jobs_.push(buffer);
+	jobs_cond_var_.notify_one();
+}
+
+void AsyncWriter::finish(Buffer *buffer, int error)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (error && !error_)
+		error_ = error;
+	auto it = pending_.find(buffer->fd);
+	if (--it->second == 0)
+		pending_.erase(it);
+	free_buffers_.push(buffer);
+	cond_var_.notify_all();
+}
+
+void AsyncWriter::workerThread()
+{
+	while (true)
+	{
+		Buffer *buffer;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			jobs_cond_var_.wait(lock, [this] { return abort_ || !jobs_.empty(); });
+			if (jobs_.empty())
+				return;
+			buffer = jobs_.front();
+			jobs_.pop();
+		}
+
+		int error = 0;
+		while (buffer->done < buffer->used)
+		{
+			ssize_t ret = pwrite(buffer->fd, buffer->mem + buffer->done, buffer->used - buffer->done,
+								 buffer->offset + buffer->done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+			{
+				error = ret < 0 ? errno : EIO;
+				break;
+			}
+			buffer->done += ret;
+		}
+		finish(buffer, error);
+	}
+}
+
+void AsyncWriter::completionThread()
+{
+#if LIBURING_PRESENT
+	while (true)
+	{
+		io_uring_cqe *cqe;
+		int ret = io_uring_wait_cqe(ring_.get(), &cqe);
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0)
+		{
+			// Whatever is in flight will never complete, so stop anyone waiting for it.
+			// The error reaches the caller at its next Write().
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!error_)
+				error_ = -ret;
+			ring_failed_ = true;
+			pending_.clear();
+			cond_var_.notify_all();
+			return;
+		}
+		Buffer *buffer = static_cast<Buffer *>(io_uring_cqe_get_data(cqe));
+		int res = cqe->res;
+		io_uring_cqe_seen(ring_.get(), cqe);
+		if (!buffer)
+			return;
+
+		if (res == -EINTR || res == -EAGAIN)
+			res = 0;
+		else if (res <= 0)
+		{
+			finish(buffer, res < 0 ? -res : EIO);
+			continue;
+		}
+
+		// Short writes just get resubmitted for the remainder.
+		buffer->done += res;
+		if (buffer->done < buffer->used)
+		{
+			std::lock_guard<std::mutex> lock(ring_mutex_);
+			io_uring_sqe *sqe = io_uring_get_sqe(ring_.get());
+			io_uring_prep_write(sqe, buffer->fd, buffer->mem + buffer->done, buffer->used - buffer->done,
+								buffer->offset + buffer->done);
+			io_uring_sqe_set_data(sqe, buffer);
+			io_uring_submit(ring_.get());
+		}
+		else
+			finish(buffer, 0);
+	}
+#endif
+}
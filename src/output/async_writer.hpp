@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * async_writer.hpp - write files in the background from a ring of aligned buffers.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+struct io_uring;
+
+// Data handed to Write() is copied into a preallocated ring of page-aligned
+// buffers, and full buffers are written out asynchronously, either through
+// io_uring or, where that is unavailable, by a small pool of threads doing
+// pwrite. Writes must be to regular files as the buffers may complete out
+// of order (FileOutput writes anything else, such as a fifo, directly).
+//
+// Errors are reported by the next Write() on the caller's thread, never thrown
+// from ours.
+//
+// The overflow policy is simple: if there aren't enough free buffers to take
+// the whole of the data, none of it is copied and Write() returns false. It's
+// up to the caller to decide what to do about it (FileOutput drops frames until
+// the next keyframe).
+
+class AsyncWriter
+{
+public:
+	AsyncWriter(size_t buffer_size, unsigned int num_buffers, bool verbose);
+	~AsyncWriter();
+	// Queue size bytes for writing to fd at the given offset. Writes that carry on
+	// from where the last one ended share buffers. Any partially filled buffer is
+	// submitted straight away if flush is set. Only one thread may call Write()
+	// and Flush().
+	bool Write(int fd, off_t offset, void const *mem, size_t size, bool flush);
+	// Submit any partially filled buffer.
+	void Flush();
+	// Wait for all submitted writes to fd to complete. Data not yet submitted
+	// (see Flush()) is not waited for.
+	void Wait(int fd);
+
+private:
+	static constexpr int NUM_WORKER_THREADS = 2;
+
+	struct Buffer
+	{
+		uint8_t *mem;
+		int fd;
+		off_t offset;
+		size_t used;
+		size_t done;
+	};
+
+	void submit(Buffer *buffer);
+	void finish(Buffer *buffer, int error);
+	void workerThread();
+	void completionThread();
+
+	size_t buffer_size_;
+	std::vector<Buffer> buffers_;
+	Buffer *current_;
+	std::queue<Buffer *> free_buffers_;
+	std::map<int, unsigned int> pending_;
+	int error_;
+	bool ring_failed_; // nothing more will complete, so nothing more is submitted
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+
+	// The thread pool fallback.
+	std::queue<Buffer *> jobs_;
+	bool abort_;
+	std::condition_variable jobs_cond_var_;
+	std::vector<std::thread> worker_threads_;
+
+	// The io_uring implementation.
+	std::unique_ptr<io_uring> ring_;
+	std::mutex ring_mutex_;
+	std::thread completion_thread_;
+};
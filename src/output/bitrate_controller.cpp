@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * bitrate_controller.cpp - adapt the bitrate to how fast clients drain the stream.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "bitrate_controller.hpp"
+
+static std::string directionLabels(std::string const &labels, char const *direction)
+{
+	return (labels.empty() ? "" : labels + ",") + "direction=\"" + direction + "\"";
+}
+
+BitrateController::BitrateController(uint32_t min_bitrate, uint32_t max_bitrate, uint32_t initial_bitrate,
+									 bool verbose, std::string const &labels)
+	: min_bitrate_(min_bitrate), max_bitrate_(max_bitrate), verbose_(verbose), stats_({ max_bitrate, 0, 0, 0 }),
+	  congested_(false), clear_(false),
+	  bitrate_metric_(Metrics::GetGauge("libcamera_abr_bitrate", "Bitrate chosen by adaptive bitrate", labels)),
+	  queued_metric_(Metrics::GetGauge("libcamera_abr_queued_bytes",
+									   "Bytes queued for the slowest tcp client, as seen by adaptive bitrate", labels)),
+	  decreases_metric_(Metrics::GetCounter("libcamera_abr_changes_total", "Bitrate changes made by adaptive bitrate",
+											directionLabels(labels, "down"))),
+	  increases_metric_(Metrics::GetCounter("libcamera_abr_changes_total", "Bitrate changes made by adaptive bitrate",
+											directionLabels(labels, "up")))
+{
+	if (!min_bitrate || min_bitrate > max_bitrate)
+		throw std::runtime_error("bad bitrate range for adaptive bitrate");
+	if (initial_bitrate)
+		stats_.bitrate = std::clamp(initial_bitrate, min_bitrate, max_bitrate);
+	bitrate_metric_.Set(stats_.bitrate);
+	queued_metric_.Set(0);
+}
+
+uint32_t BitrateController::Update(size_t queued_bytes, std::chrono::steady_clock::time_point now)
+{
+	using namespace std::chrono;
+	stats_.queued_bytes = queued_bytes;
+	queued_metric_.Set(queued_bytes);
+	microseconds delay(queued_bytes * 8 * 1000000 / stats_.bitrate);
+
+	bool congested = delay > HIGH_DELAY, clear = delay < LOW_DELAY;
+	if (congested && !congested_)
+		congested_since_ = now;
+	if (clear && !clear_)
+		clear_since_ = now;
+	congested_ = congested;
+	clear_ = clear;
+
+	if (now < hold_off_until_)
+		return 0;
+	if (congested_ && now - congested_since_ >= CONGESTED_TIME && stats_.bitrate > min_bitrate_)
+	{
+		stats_.decreases++;
+		decreases_metric_.Inc();
+		return change(std::max<uint32_t>(stats_.bitrate * DECREASE_FACTOR, min_bitrate_), now);
+	}
+	if (clear_ && now - clear_since_ >= CLEAR_TIME && stats_.bitrate < max_bitrate_)
+	{
+		stats_.increases++;
+		increases_metric_.Inc();
+		// Start timing the clear period again, so that we keep stepping up slowly.
+		clear_since_ = now;
+		return change(std::min<uint32_t>(stats_.bitrate + max_bitrate_ * INCREASE_STEP, max_bitrate_), now);
+	}
+	return 0;
+}
+
+uint32_t BitrateController::change(uint32_t bitrate, std::chrono::steady_clock::time_point now)
+{
+	if (verbose_)
+		std::cerr << "BitrateController: " << stats_.queued_bytes << " bytes queued, bitrate " << stats_.bitrate
+				  << " -> " << bitrate << std::endl;
+	stats_.bitrate = bitrate;
+	bitrate_metric_.Set(bitrate);
+	hold_off_until_ = now + HOLD_OFF_TIME;
+	// Whatever the backlog was doing, it needs to do it again at the new rate.
+	congested_since_ = clear_since_ = now;
+	return bitrate;
+}
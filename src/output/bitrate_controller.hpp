@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * bitrate_controller.hpp - adapt the bitrate to how fast clients drain the stream.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "core/metrics.hpp"
+
+// The application feeds in how many bytes are sitting unsent in the worst
+// client's socket, and we turn that into how long the backlog would take to
+// drain at the current bitrate. A backlog that stays above HIGH_DELAY cuts
+// the bitrate sharply; the bitrate only creeps back up once the backlog has
+// stayed below LOW_DELAY for a good while. After any change we hold off for
+// a bit to see what it did, so we don't oscillate.
+//
+// The bitrate, the backlog and the changes made are also kept as metrics, with
+// whatever labels we're given (such as the camera).
+
+class BitrateController
+{
+public:
+	struct Stats
+	{
+		uint32_t bitrate;
+		size_t queued_bytes;
+		unsigned int decreases;
+		unsigned int increases;
+	};
+
+	// The initial bitrate is whatever the encoder was started with (zero meaning the maximum).
+	BitrateController(uint32_t min_bitrate, uint32_t max_bitrate, uint32_t initial_bitrate, bool verbose,
+					  std::string const &labels = "");
+	// Returns the new bitrate when it should change, otherwise zero.
+	uint32_t Update(size_t queued_bytes, std::chrono::steady_clock::time_point now);
+	Stats GetStats() const { return stats_; }
+
+private:
+	static constexpr std::chrono::milliseconds HIGH_DELAY { 500 };
+	static constexpr std::chrono::milliseconds LOW_DELAY { 50 };
+	static constexpr std::chrono::seconds CONGESTED_TIME { 1 };
+	static constexpr std::chrono::seconds CLEAR_TIME { 10 };
+	static constexpr std::chrono::seconds HOLD_OFF_TIME { 2 };
+	static constexpr double DECREASE_FACTOR = 0.7;
+	static constexpr double INCREASE_STEP = 0.05; // of the maximum
+
+	uint32_t change(uint32_t bitrate, std::chrono::steady_clock::time_point now);
+
+	uint32_t min_bitrate_;
+	uint32_t max_bitrate_;
+	bool verbose_;
+	Stats stats_;
+	std::chrono::steady_clock::time_point congested_since_;
+	std::chrono::steady_clock::time_point clear_since_;
+	std::chrono::steady_clock::time_point hold_off_until_;
+	bool congested_;
+	bool clear_;
+	Gauge &bitrate_metric_;
+	Gauge &queued_metric_;
+	Counter &decreases_metric_;
+	Counter &increases_metric_;
+};
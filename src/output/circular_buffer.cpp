@@ -0,0 +1,165 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * circular_buffer.cpp - circular buffer of variable sized records.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "circular_buffer.hpp"
+
+// A buffer file starts with this, padded out to a page.
+struct CircularBuffer::State
+{
+	char magic[8];
+	uint64_t size;
+	uint64_t rptr;
+	uint64_t wptr;
+	uint64_t end;
+};
+static constexpr size_t STATE_SIZE = 4096;
+static char const MAGIC[8] = { 'L', 'C', 'A', 'R', 'I', 'N', 'G', '2' };
+
+CircularBuffer::CircularBuffer(size_t size, std::string const &filename)
+	: size_(size), buf_(nullptr), state_(nullptr), map_size_(0), recovered_(false), rptr_(0), wptr_(0), end_(size),
+	  reserved_(0)
+{
+	if (filename.empty())
+	{
+		heap_.resize(size_);
+		buf_ = heap_.data();
+		return;
+	}
+
+	int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (fd < 0)
+		throw std::runtime_error("failed to open circular buffer file " + filename);
+	struct stat st;
+	State state;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size > STATE_SIZE && pread(fd, &state, sizeof(state), 0) == sizeof(state) &&
+		memcmp(state.magic, MAGIC, sizeof(MAGIC)) == 0 && (size_t)st.st_size == STATE_SIZE + state.size &&
+		state.end <= state.size && state.rptr < state.end && state.wptr < state.size)
+	{
+		if (state.size != size_)
+			std::cerr << "WARNING: CircularBuffer: keeping existing " << (state.size >> 20) << "MB buffer in "
+					  << filename << std::endl;
+		size_ = state.size;
+		rptr_ = state.rptr;
+		wptr_ = state.wptr;
+		end_ = state.end;
+		recovered_ = true;
+	}
+	else
+	{
+		// Allocate the whole file now, as running out of space later would get us a SIGBUS.
+		memcpy(state.magic, MAGIC, sizeof(MAGIC));
+		state.size = state.end = size_;
+		state.rptr = state.wptr = 0;
+		if (ftruncate(fd, 0) < 0 || posix_fallocate(fd, 0, STATE_SIZE + size_) ||
+			pwrite(fd, &state, sizeof(state), 0) != sizeof(state))
+		{
+			close(fd);
+			throw std::runtime_error("failed to create circular buffer file " + filename);
+		}
+	}
+
+	map_size_ = STATE_SIZE + size_;
+	void *mem = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		throw std::runtime_error("failed to map circular buffer file " + filename);
+	state_ = static_cast<State *>(mem);
+	buf_ = static_cast<uint8_t *>(mem) + STATE_SIZE;
+}
+
+CircularBuffer::~CircularBuffer()
+{
+	if (state_)
+		munmap(state_, map_size_);
+}
+
+uint8_t *CircularBuffer::Reserve(size_t n)
+{
+	// Once empty, we may as well start again from the beginning.
+	if (Empty() && rptr_)
+	{
+		rptr_ = wptr_ = 0;
+		end_ = size_;
+		store();
+	}
+
+	// The write pointer may never catch up with the read pointer, or we'd look empty.
+	if (wptr_ >= rptr_)
+	{
+		if (wptr_ + n < size_ || (wptr_ + n == size_ && rptr_))
+			reserved_ = wptr_;
+		else if (n < rptr_)
+			reserved_ = 0;
+		else
+			return nullptr;
+	}
+	else if (wptr_ + n < rptr_)
+		reserved_ = wptr_;
+	else
+		return nullptr;
+
+	return buf_ + reserved_;
+}
+
+void CircularBuffer::Commit(size_t n)
+{
+	// Where we went back to the start, the end must be recorded first.
+	if (reserved_ == 0 && wptr_)
+	{
+		end_ = wptr_;
+		if (state_)
+			__atomic_store_n(&state_->end, end_, __ATOMIC_RELEASE);
+	}
+	wptr_ = reserved_ + n;
+	if (wptr_ == size_)
+		wptr_ = 0;
+	if (state_)
+		__atomic_store_n(&state_->wptr, wptr_, __ATOMIC_RELEASE);
+}
+
+void CircularBuffer::Release(size_t n)
+{
+	rptr_ += n;
+	if (rptr_ >= end_)
+	{
+		rptr_ = 0;
+		end_ = size_;
+	}
+	store();
+}
+
+void CircularBuffer::Clear()
+{
+	rptr_ = wptr_;
+	store();
+}
+
+void CircularBuffer::Truncate(size_t pos)
+{
+	wptr_ = pos;
+	if (wptr_ >= rptr_)
+		end_ = size_;
+	store();
+}
+
+void CircularBuffer::store()
+{
+	if (!state_)
+		return;
+	__atomic_store_n(&state_->rptr, rptr_, __ATOMIC_RELEASE);
+	__atomic_store_n(&state_->end, end_, __ATOMIC_RELEASE);
+	__atomic_store_n(&state_->wptr, wptr_, __ATOMIC_RELEASE);
+}
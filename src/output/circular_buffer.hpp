@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * circular_buffer.hpp - circular buffer of variable sized records.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A circular buffer used by the CircularOutput class. It hands out contiguous
+// space (a "bip buffer"), so a record never straddles the end of the buffer:
+// if it won't fit in the space at the end, that space is left unused and the
+// record goes at the start instead. Records can then be written in place, and
+// read back out, without being split.
+//
+// Records must be released from the front in the same sizes they were
+// committed in, which is what lets us know where the unused space at the end
+// begins and so where to jump back to the start.
+//
+// Given a filename, the buffer lives in a shared mapping of that file instead
+// of on the heap, behind a small header holding the read and write pointers.
+// The read pointer is stored as soon as anything is released, before the space
+// can be reused, and the write pointer only when a record is committed, so
+// whatever is between them in the file is always complete if the process
+// crashes. Nothing is synced to disk, so after a power cut the pages may have
+// been written back in any order, or not at all; records need checks of their
+// own to catch that. If the file already holds a buffer (of any size) it is
+// reused, and Recovered() says so.
+
+class CircularBuffer
+{
+public:
+	CircularBuffer(size_t size, std::string const &filename = "");
+	~CircularBuffer();
+	CircularBuffer(CircularBuffer const &) = delete;
+	CircularBuffer &operator=(CircularBuffer const &) = delete;
+	bool Recovered() const { return recovered_; }
+	size_t Size() const { return size_; }
+	bool Empty() const { return rptr_ == wptr_; }
+	// Return n contiguous bytes of space to write a record into, or nullptr if
+	// there isn't room for it without releasing something first.
+	uint8_t *Reserve(size_t n);
+	// Add the last reserved record, which is n bytes long, to the buffer.
+	void Commit(size_t n);
+	// Remove the oldest record, which is n bytes long.
+	void Release(size_t n);
+	void Clear();
+	// Throw away everything from pos onwards, which must be a record in the buffer.
+	void Truncate(size_t pos);
+
+	uint8_t *Data(size_t pos) const { return buf_ + pos; }
+	size_t Offset(uint8_t const *ptr) const { return ptr - buf_; }
+	size_t ReadPtr() const { return rptr_; }
+	size_t WritePtr() const { return wptr_; }
+	// The position of the record after the n byte one at pos.
+	size_t Next(size_t pos, size_t n) const { return pos + n >= end_ ? 0 : pos + n; }
+	// The number of bytes of data in the buffer from pos (which must be in the
+	// buffer) up to the end or to where it goes back to the start.
+	size_t Contiguous(size_t pos) const { return wptr_ < rptr_ && pos >= rptr_ ? end_ - pos : wptr_ - pos; }
+
+private:
+	struct State;
+	void store();
+
+	size_t size_;
+	std::vector<uint8_t> heap_;
+	uint8_t *buf_;
+	State *state_;
+	size_t map_size_;
+	bool recovered_;
+	size_t rptr_, wptr_;
+	// Where the data stops and goes back to the start, if it does.
+	size_t end_;
+	size_t reserved_;
+};
@@ -5,21 +5,57 @@
  * circular_output.cpp - Write output to circular buffer which we save on exit.
  */
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+
 #include "circular_output.hpp"
 
 // We're going to align the frames within the buffer to friendly byte boundaries
 static constexpr int ALIGN = 16; // power of 2, please
 
-struct Header
+struct alignas(ALIGN) Header
 {
 	unsigned int length;
 	bool keyframe;
+	uint16_t check; // lets us spot garbage when recovering a buffer file
 	int64_t timestamp;
+	uint32_t payload_check; // and frames that never all reached the disk
 };
 static_assert(sizeof(Header) % ALIGN == 0, "Header should have aligned size");
 
+static uint16_t headerCheck(Header const &header)
+{
+	return 0xc1c1 ^ header.length ^ (header.length >> 16) ^ header.keyframe ^ (uint16_t)header.timestamp;
+}
+
+// Not a CRC, but a word at a time, so cheap enough to do for every frame.
+static uint32_t payloadCheck(uint8_t const *data, size_t length)
+{
+	uint64_t hash = 0xcbf29ce484222325;
+	size_t i = 0;
+	for (uint64_t word; i + sizeof(word) <= length; i += sizeof(word))
+	{
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3;
+	}
+	for (; i < length; i++)
+		hash = (hash ^ data[i]) * 0x100000001b3;
+	return hash ^ (hash >> 32);
+}
+
+// The space a frame of this length takes up in the buffer.
+static size_t recordSize(size_t length)
+{
+	return sizeof(Header) + ((length + ALIGN - 1) & ~(ALIGN - 1));
+}
+
 // Size of buffer (options->circular) is given in megabytes.
-CircularOutput::CircularOutput(VideoOptions const *options) : Output(options), cb_(options->circular<<20)
+CircularOutput::CircularOutput(VideoOptions const *options)
+	: Output(options), cb_(options->circular<<20, options->circular_file), fp_(nullptr), first_frame_(0), trigger_(false), event_active_(false),
+	  event_end_us_(0), event_count_(0), abort_event_(false)
 {
 	// Open this now, so that we can get any complaints out of the way
 	if (options_->output == "-")
@@ -28,62 +64,261 @@ CircularOutput::CircularOutput(VideoOptions const *options) : Output(options), c
 	{
 		fp_ = fopen(options_->output.c_str(), "w");
 	}
-	if (!fp_)
+	// Saving the buffer on exit is optional when we're saving events, or when the
+	// buffer is in a file anyway.
+	if (!fp_ && (!options_->output.empty() || (options_->event_output.empty() && options_->circular_file.empty())))
 		throw std::runtime_error("could not open output file");
+
+	if (cb_.Recovered())
+		recover();
+
+	if (!options_->event_output.empty())
+		event_thread_ = std::thread(&CircularOutput::eventThread, this);
 }
 
 CircularOutput::~CircularOutput()
 {
+	if (event_thread_.joinable())
+	{
+		// Finish off any event in progress (it just gets a shorter post-roll).
+		if (event_active_)
+			queueEventJob({ "", {}, true });
+		{
+			std::lock_guard<std::mutex> lock(event_mutex_);
+			abort_event_ = true;
+			event_cond_var_.notify_one();
+		}
+		event_thread_.join();
+	}
+
+	if (!fp_)
+		return;
+
 	// We do have to skip to the first I frame before dumping stuff to disk. If there are
 	// no I frames you will get nothing. Caveat emptor, methinks.
 	unsigned int total = 0, frames = 0;
-	bool seen_keyframe = false;
-	Header header;
-	FILE *fp = fp_; // can't capture a class member in a lambda
-	while (!cb_.Empty())
+	if (!keyframes_.empty())
 	{
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		seen_keyframe |= header.keyframe;
-		if (seen_keyframe)
-		{
-			cb_.Read([fp](void *src, int n) { fwrite(src, 1, n, fp); }, header.length);
-			cb_.Skip((ALIGN - header.length) & (ALIGN - 1));
-			total += header.length;
-			frames++;
-		}
-		else
-			cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
+		FILE *fp = fp_; // can't capture a class member in a lambda
+		copyFrames(keyframes_.front(), [fp, &total](void *src, int n) {
+			fwrite(src, 1, n, fp);
+			total += n;
+		});
+		frames = first_frame_ + frames_.size() - keyframes_.front();
 	}
 	fclose(fp_);
 	std::cerr << "Wrote " << total << " bytes (" << frames << " frames)" << std::endl;
+
+	// It's been saved, so there's nothing to recover next time.
+	cb_.Clear();
 }
 
-void CircularOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+void CircularOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, int64_t wallclock_us, uint32_t flags)
 {
 	// First make sure there's enough space.
-	int pad = (ALIGN - size) & (ALIGN - 1);
-	while (size + pad + sizeof(Header) > cb_.Available())
+	size_t record_size = recordSize(size);
+	uint8_t *dst;
+	while (!(dst = cb_.Reserve(record_size)))
 	{
-		if (cb_.Empty())
+		if (frames_.empty())
 			throw std::runtime_error("circular buffer too small");
+		cb_.Release(recordSize(frames_.front().length));
+		if (!keyframes_.empty() && keyframes_.front() == first_frame_)
+			keyframes_.pop_front();
+		frames_.pop_front();
+		first_frame_++;
+	}
+	if (flags & FLAG_KEYFRAME)
+		keyframes_.push_back(first_frame_ + frames_.size());
+	frames_.push_back({ cb_.Offset(dst), static_cast<unsigned int>(size), !!(flags & FLAG_KEYFRAME), timestamp_us });
+	// Only a buffer file ever gets recovered, and so needs checking.
+	Header header = { static_cast<unsigned int>(size), !!(flags & FLAG_KEYFRAME), 0, timestamp_us, 0 };
+	header.check = headerCheck(header);
+	if (!options_->circular_file.empty())
+		header.payload_check = payloadCheck(static_cast<uint8_t *>(mem), size);
+	memcpy(dst, &header, sizeof(header));
+	memcpy(dst + sizeof(header), mem, size);
+	cb_.Commit(record_size);
+
+	// The frame is in the buffer, so a new event will include it. Otherwise an
+	// event in progress gets a copy of it.
+	if (event_active_)
+	{
+		uint8_t *src = static_cast<uint8_t *>(mem);
+		queueEventJob({ "", std::vector<uint8_t>(src, src + size), false });
+	}
+	if (trigger_.exchange(false))
+	{
+		if (!event_active_)
+			startEvent(timestamp_us);
+		event_end_us_ = timestamp_us + options_->postroll * (int64_t)1000000;
+		if (options_->verbose)
+			std::cerr << "CircularOutput: event at " << timestamp_us << "us" << std::endl;
+	}
+
+	if (event_active_ && timestamp_us >= event_end_us_)
+	{
+		queueEventJob({ "", {}, true });
+		event_active_ = false;
+	}
+}
+
+void CircularOutput::Signal()
+{
+	if (options_->event_output.empty())
+		Output::Signal();
+	else
+		Trigger();
+}
+
+bool CircularOutput::Trigger()
+{
+	if (options_->event_output.empty())
+		return false;
+	trigger_ = true;
+	return true;
+}
+
+void CircularOutput::startEvent(int64_t timestamp_us)
+{
+	// Start from the last keyframe at least preroll seconds before the event.
+	uint64_t start;
+	if (!findKeyframe(timestamp_us - options_->preroll * (int64_t)1000000, start))
+		return;
+
+	// Copy those frames out, so that the buffer can carry on being overwritten.
+	EventJob job;
+	char filename[256];
+	int n = snprintf(filename, sizeof(filename), options_->event_output.c_str(), event_count_++);
+	if (n < 0)
+		throw std::runtime_error("failed to generate event filename");
+	job.filename = filename;
+	job.close = false;
+	copyFrames(start, [&job](void *src, int n) {
+		job.data.insert(job.data.end(), (uint8_t *)src, (uint8_t *)src + n);
+	});
+	queueEventJob(std::move(job));
+	event_active_ = true;
+}
+
+void CircularOutput::recover()
+{
+	// Rebuild the frame records for whatever a previous run left in the buffer file,
+	// dropping anything from the first frame that doesn't look right.
+	size_t pos = cb_.ReadPtr();
+	while (pos != cb_.WritePtr())
+	{
+		size_t remaining = cb_.Contiguous(pos);
 		Header header;
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
+		if (remaining >= sizeof(header))
+			memcpy(&header, cb_.Data(pos), sizeof(header));
+		if (remaining < sizeof(header) || header.check != headerCheck(header) ||
+			recordSize(header.length) > remaining ||
+			header.payload_check != payloadCheck(cb_.Data(pos) + sizeof(header), header.length))
+		{
+			std::cerr << "WARNING: CircularOutput: discarding bad data from " << options_->circular_file << std::endl;
+			cb_.Truncate(pos);
+			break;
+		}
+		if (header.keyframe)
+			keyframes_.push_back(first_frame_ + frames_.size());
+		frames_.push_back({ pos, header.length, header.keyframe, header.timestamp });
+		pos = cb_.Next(pos, recordSize(header.length));
+	}
+
+	// Save it to a file of its own, as our timestamps will start again from zero.
+	if (!keyframes_.empty())
+	{
+		std::string filename = options_->circular_file + ".recovered-" + std::to_string(time(NULL));
+		FILE *fp = fopen(filename.c_str(), "w");
+		if (!fp)
+			throw std::runtime_error("failed to open " + filename);
+		unsigned int total = 0;
+		copyFrames(keyframes_.front(), [fp, &total](void *src, int n) {
+			fwrite(src, 1, n, fp);
+			total += n;
+		});
+		if (fflush(fp) || fsync(fileno(fp)) < 0 || fclose(fp))
+			throw std::runtime_error("failed to write " + filename);
+		std::cerr << "Recovered " << total << " bytes (" << first_frame_ + frames_.size() - keyframes_.front()
+				  << " frames) to " << filename << std::endl;
+	}
+
+	cb_.Clear();
+	frames_.clear();
+	keyframes_.clear();
+}
+
+bool CircularOutput::findKeyframe(int64_t timestamp_us, uint64_t &frame) const
+{
+	if (keyframes_.empty())
+		return false;
+	auto it = std::upper_bound(keyframes_.begin(), keyframes_.end(), timestamp_us,
+							   [this](int64_t t, uint64_t k) { return t < frames_[k - first_frame_].timestamp; });
+	frame = it == keyframes_.begin() ? keyframes_.front() : *(it - 1);
+	return true;
+}
+
+void CircularOutput::copyFrames(uint64_t frame, std::function<void(void *src, unsigned int n)> dst) const
+{
+	for (auto it = frames_.begin() + (frame - first_frame_); it != frames_.end(); it++)
+		dst(cb_.Data(it->pos) + sizeof(Header), it->length);
+}
+
+void CircularOutput::queueEventJob(EventJob &&job)
+{
+	std::lock_guard<std::mutex> lock(event_mutex_);
+	event_jobs_.push(std::move(job));
+	event_cond_var_.notify_one();
+}
+
+void CircularOutput::eventThread()
+{
+	FILE *fp = nullptr;
+	std::string filename;
+	size_t total = 0;
+	while (true)
+	{
+		EventJob job;
+		{
+			std::unique_lock<std::mutex> lock(event_mutex_);
+			while (true)
+			{
+				using namespace std::chrono_literals;
+				if (!event_jobs_.empty())
+				{
+					job = std::move(event_jobs_.front());
+					event_jobs_.pop();
+					break;
+				}
+				if (abort_event_)
+					return;
+				event_cond_var_.wait_for(lock, 200ms);
+			}
+		}
+
+		// Failures are reported but must not stop the recording.
+		if (!job.filename.empty())
+		{
+			filename = job.filename;
+			total = 0;
+			fp = fopen(filename.c_str(), "w");
+			if (!fp)
+				std::cerr << "WARNING: CircularOutput: failed to open event file " << filename << std::endl;
+		}
+		if (fp && !job.data.empty() && fwrite(job.data.data(), job.data.size(), 1, fp) != 1)
+		{
+			std::cerr << "WARNING: CircularOutput: failed to write event file " << filename << std::endl;
+			fclose(fp);
+			fp = nullptr;
+		}
+		total += job.data.size();
+		if (fp && job.close)
+		{
+			fclose(fp);
+			fp = nullptr;
+			if (options_->verbose)
+				std::cerr << "CircularOutput: wrote " << total << " bytes to " << filename << std::endl;
+		}
 	}
-	Header header = { static_cast<unsigned int>(size), !!(flags & FLAG_KEYFRAME), timestamp_us };
-	cb_.Write(&header, sizeof(header));
-	cb_.Write(mem, size);
-	cb_.Pad(pad);
 }
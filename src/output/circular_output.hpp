@@ -7,61 +7,80 @@
 
 #pragma once
 
-#include "output.hpp"
-
-// A simple circular buffer implementation used by the CircularOutput class.
-
-class CircularBuffer
-{
-public:
-	CircularBuffer(size_t size) : size_(size), buf_(size), rptr_(0), wptr_(0) {}
-	bool Empty() const { return rptr_ == wptr_; }
-	size_t Available() const { return wptr_ == rptr_ ? size_ - 1 : (size_ - wptr_ + rptr_) % size_ - 1; }
-	void Skip(unsigned int n) { rptr_ = (rptr_ + n) % size_; }
-	// The dst function allows bytes read to go straight to memory or a file etc.
-	void Read(std::function<void(void *src, unsigned int n)> dst, unsigned int n)
-	{
-		if (rptr_ + n >= size_)
-		{
-			dst(&buf_[rptr_], size_ - rptr_);
-			n -= size_ - rptr_;
-			rptr_ = 0;
-		}
-		dst(&buf_[rptr_], n);
-		rptr_ += n;
-	}
-	void Pad(unsigned int n) { wptr_ = (wptr_ + n) % size_; }
-	void Write(const void *ptr, unsigned int n)
-	{
-		if (wptr_ + n >= size_)
-		{
-			memcpy(&buf_[wptr_], ptr, size_ - wptr_);
-			n -= size_ - wptr_;
-			ptr = static_cast<const uint8_t *>(ptr) + size_ - wptr_;
-			wptr_ = 0;
-		}
-		memcpy(&buf_[wptr_], ptr, n);
-		wptr_ += n;
-	}
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
 
-private:
-	const size_t size_;
-	std::vector<uint8_t> buf_;
-	size_t rptr_, wptr_;
-};
+#include "circular_buffer.hpp"
+#include "output.hpp"
 
 // Write frames to a circular buffer, and dump them to disk when we quit.
+//
+// With --event-output, Signal() no longer pauses the output but triggers an
+// event instead. The buffer is saved to a new file starting from the last
+// keyframe at least --preroll seconds before the event, and frames keep being
+// appended until --postroll seconds after it (a further event in the meantime
+// extends this). Files are written on a background thread and recording into
+// the buffer carries on throughout.
 
 class CircularOutput : public Output
 {
 public:
 	CircularOutput(VideoOptions const *options);
 	~CircularOutput();
+	void Signal() override;
+	// Save an event file. This may be called from any thread. Without an
+	// --event-output there's nowhere to save it, and we return false.
+	bool Trigger();
 
 protected:
-	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, int64_t wallclock_us, uint32_t flags) override;
 
 private:
+	struct EventJob
+	{
+		std::string filename; // the file to open, if not empty
+		std::vector<uint8_t> data;
+		bool close;
+	};
+
+	// Every frame in the buffer has a record here, oldest first, so that we never
+	// have to walk the headers in the buffer itself. Frames are numbered from the
+	// start of the recording; first_frame_ is the number of frames_.front().
+	struct FrameRecord
+	{
+		size_t pos; // of the frame's header in the buffer
+		unsigned int length;
+		bool keyframe;
+		int64_t timestamp;
+	};
+	// Find the last keyframe at or before the given time, or else the oldest one.
+	bool findKeyframe(int64_t timestamp_us, uint64_t &frame) const;
+	// Pass the contents of all the frames from this one onwards to dst.
+	void copyFrames(uint64_t frame, std::function<void(void *src, unsigned int n)> dst) const;
+	void startEvent(int64_t timestamp_us);
+	void recover();
+	void queueEventJob(EventJob &&job);
+	void eventThread();
+
 	CircularBuffer cb_;
 	FILE *fp_;
+	std::deque<FrameRecord> frames_;
+	std::deque<uint64_t> keyframes_;
+	uint64_t first_frame_;
+
+	std::atomic<bool> trigger_;
+	bool event_active_;
+	int64_t event_end_us_;
+	unsigned int event_count_;
+	bool abort_event_;
+	std::queue<EventJob> event_jobs_;
+	std::mutex event_mutex_;
+	std::condition_variable event_cond_var_;
+	std::thread event_thread_;
 };
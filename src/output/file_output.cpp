@@ -5,35 +5,144 @@
  * file_output.cpp - Write output to file.
  */
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+
 #include "file_output.hpp"
 
+static int64_t wallclockUs()
+{
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * (int64_t)1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t wallclockMs()
+{
+	return wallclockUs() / 1000;
+}
+
 FileOutput::FileOutput(VideoOptions const *options)
-	: Output(options), fp_(nullptr), count_(0), file_start_time_ms_(0)
+	: Output(options), fp_(nullptr), fd_(-1), file_offset_(0), last_file_size_(0), dropping_(false),
+	  index_behind_(false), count_(0), segment_(0), next_segment_(0), file_start_time_ms_(0),
+	  file_start_wallclock_ms_(0), retired_ms_(0), abort_segment_(false), next_fd_(-1)
 {
+	// Writes to stdout stay synchronous, everything else goes through the writer.
+	if (!options_->output.empty() && options_->output != "-")
+	{
+		unsigned int num_buffers = std::max<size_t>(((size_t)options_->write_ring << 20) / WRITE_BUFFER_SIZE, 2);
+		writer_ = std::make_unique<AsyncWriter>(WRITE_BUFFER_SIZE, num_buffers, options_->verbose);
+
+		// With an index, segment numbers carry on from the last run so that old
+		// entries still point at the right files.
+		if (!options_->index.empty())
+		{
+			index_ = std::make_unique<RecordingIndex>(options_->index, options_->output, options_->wrap);
+			next_segment_ = index_->NextSegment();
+			count_ = options_->wrap ? next_segment_ % options_->wrap : next_segment_;
+			if (options_->verbose)
+				std::cerr << "FileOutput: index " << options_->index << " has " << index_->Size()
+						  << " entries, starting at segment " << next_segment_ << std::endl;
+		}
+
+		// The retention index lives alongside the recordings, named after them so that
+		// each camera (which has an output of its own) keeps its own.
+		if (options_->retain_size || options_->retain_age)
+		{
+			size_t slash = options_->output.rfind('/');
+			std::string dir = slash == std::string::npos ? "." : options_->output.substr(0, slash);
+			std::string name = options_->output.substr(slash == std::string::npos ? 0 : slash + 1);
+			size_t dot = name.rfind('.');
+			if (dot != std::string::npos && dot > 0)
+				name.resize(dot);
+			retention_ = std::make_unique<SegmentRetention>(dir + "/." + name + ".segments",
+															(uint64_t)options_->retain_size << 20,
+															(int64_t)options_->retain_age * 1000, options_->verbose);
+			// The first file gets opened on this thread, before the segment thread can
+			// forget it for us.
+			retention_->Forget(makeFilename(count_));
+		}
+
+		segment_thread_ = std::thread(&FileOutput::segmentThread, this);
+	}
 }
 
 FileOutput::~FileOutput()
 {
 	closeFile();
+
+	if (segment_thread_.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(segment_mutex_);
+			abort_segment_ = true;
+			segment_cond_var_.notify_one();
+		}
+		segment_thread_.join();
+	}
+
+	// A file we opened in advance but never used shouldn't be left lying around.
+	// It's still under its temporary name, so whatever had the real name is safe.
+	if (next_fd_ >= 0)
+	{
+		close(next_fd_);
+		unlink(tempFilename(next_filename_).c_str());
+	}
 }
 
-void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, int64_t wallclock_us, uint32_t flags)
 {
 	// We need to open a new file if we're in "segment" mode and our segment is full
 	// (though we have to wait for the next I frame), or if we're in "split" mode
 	// and recording is being restarted (this is necessarily an I-frame already).
-	if (fp_ == nullptr ||
+	if ((fp_ == nullptr && fd_ < 0) ||
 		(options_->segment && (flags & FLAG_KEYFRAME) &&
 		 timestamp_us / 1000 - file_start_time_ms_ > options_->segment) ||
 		(options_->split && (flags & FLAG_RESTART)))
 	{
 		closeFile();
-		openFile(timestamp_us);
+		openFile(timestamp_us, wallclock_us);
 	}
 
 	if (options_->verbose)
 		std::cerr << "FileOutput: output buffer " << mem << " size " << size << "\n";
-	if (fp_ && size)
+	if (fd_ >= 0 && size)
+	{
+		// When the write ring is full the frame is dropped, and so is everything
+		// else until the next keyframe, so that what reaches the file still decodes.
+		if (dropping_ && !(flags & FLAG_KEYFRAME))
+			return;
+		bool dropped = !writer_->Write(fd_, file_offset_, mem, size, options_->flush);
+		if (dropped && !dropping_)
+			std::cerr << "WARNING: FileOutput: write ring full, dropping frames until next keyframe" << std::endl;
+		dropping_ = dropped;
+		if (!dropped)
+		{
+			// The frame's own wall clock time, if we have it, rather than whenever it
+			// happened to get through the encoder. After the clock is stepped back,
+			// nothing can be indexed until it passes the last entry again.
+			if (index_ && (flags & FLAG_KEYFRAME))
+			{
+				index_->Retire(retired_ms_ * 1000);
+				bool indexed =
+					index_->Append({ wallclock_us ? wallclock_us : wallclockUs(), sensorTimestamp(timestamp_us),
+									 (uint64_t)file_offset_, segment_, RecordingIndex::FLAG_KEYFRAME });
+				if (!indexed && !index_behind_)
+					std::cerr << "WARNING: FileOutput: wall clock is behind the index, keyframes not indexed"
+							  << std::endl;
+				index_behind_ = !indexed;
+			}
+			file_offset_ += size;
+		}
+	}
+	else if (fp_ && size)
 	{
 		if (fwrite(mem, size, 1, fp_) != 1)
 			throw std::runtime_error("failed to write output bytes");
@@ -42,34 +151,191 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 	}
 }
 
-void FileOutput::openFile(int64_t timestamp_us)
+std::string FileOutput::makeFilename(unsigned int count) const
+{
+	char filename[256];
+	int n = snprintf(filename, sizeof(filename), options_->output.c_str(), count);
+	if (n < 0)
+		throw std::runtime_error("failed to generate filename");
+	return filename;
+}
+
+void FileOutput::openFile(int64_t timestamp_us, int64_t wallclock_us)
 {
 	if (options_->output == "-")
 		fp_ = stdout;
 	else if (!options_->output.empty())
 	{
 		// Generate the next output file name.
-		char filename[256];
-		int n = snprintf(filename, sizeof(filename), options_->output.c_str(), count_);
+		filename_ = makeFilename(count_);
 		count_++;
+		segment_ = next_segment_++;
 		if (options_->wrap)
 			count_ = count_ % options_->wrap;
-		if (n < 0)
-			throw std::runtime_error("failed to generate filename");
 
-		fp_ = fopen(filename, "w");
-		if (!fp_)
-			throw std::runtime_error("failed to open output file " + std::string(filename));
+		// Normally the segment thread has this file open and waiting for us. If it's
+		// still busy opening it we must wait, or it could truncate what we write.
+		// Files it was asked for get swapped into place once we've started on them.
+		bool prepared;
+		{
+			std::unique_lock<std::mutex> lock(segment_mutex_);
+			segment_cond_var_.wait(lock, [this] { return pending_open_ != filename_; });
+			prepared = next_filename_ == filename_;
+			if (prepared)
+			{
+				fd_ = next_fd_;
+				next_fd_ = -1;
+				next_filename_.clear();
+			}
+		}
+		if (fd_ < 0)
+			fd_ = open(prepared ? tempFilename(filename_).c_str() : filename_.c_str(),
+					   O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (fd_ < 0)
+			throw std::runtime_error("failed to open output file " + filename_);
+		if (prepared)
+		{
+			std::lock_guard<std::mutex> lock(segment_mutex_);
+			segment_jobs_.push({ SegmentJob::SWAP, filename_, -1, 0, 0 });
+			segment_cond_var_.notify_all();
+		}
+		file_offset_ = 0;
+
+		// The writer needs files it can write at any offset. Anything else, such as
+		// a fifo or a device, is written directly, as stdout is.
+		struct stat st;
+		if (fstat(fd_, &st) == 0 && !S_ISREG(st.st_mode))
+		{
+			fp_ = fdopen(fd_, "w");
+			if (!fp_)
+			{
+				close(fd_);
+				fd_ = -1;
+				throw std::runtime_error("failed to open output file " + filename_);
+			}
+			fd_ = -1;
+		}
 		if (options_->verbose)
-			std::cerr << "FileOutput: opened output file " << filename << std::endl;
+			std::cerr << "FileOutput: opened output file " << filename_ << std::endl;
 
 		file_start_time_ms_ = timestamp_us / 1000;
+		file_start_wallclock_ms_ = wallclock_us ? wallclock_us / 1000 : wallclockMs();
+
+		// Get the one after ready too, unless it's the file we're about to write
+		// (as may happen with --wrap).
+		std::string next_filename = makeFilename(count_);
+		if ((options_->segment || options_->split) && next_filename != filename_)
+		{
+			std::lock_guard<std::mutex> lock(segment_mutex_);
+			pending_open_ = next_filename;
+			segment_jobs_.push({ SegmentJob::OPEN, next_filename, -1, 0, 0 });
+			segment_cond_var_.notify_all();
+		}
 	}
 }
 
 void FileOutput::closeFile()
 {
+	if (fd_ >= 0)
+	{
+		writer_->Flush();
+		std::lock_guard<std::mutex> lock(segment_mutex_);
+		last_file_size_ = file_offset_;
+		segment_jobs_.push({ SegmentJob::CLOSE, filename_, fd_, file_offset_, file_start_wallclock_ms_ });
+		segment_cond_var_.notify_all();
+	}
+	fd_ = -1;
 	if (fp_ && fp_ != stdout)
 		fclose(fp_);
 	fp_ = nullptr;
 }
+
+void FileOutput::segmentThread()
+{
+	SegmentJob job;
+	while (true)
+	{
+		off_t estimate;
+		{
+			std::unique_lock<std::mutex> lock(segment_mutex_);
+			while (true)
+			{
+				using namespace std::chrono_literals;
+				if (!segment_jobs_.empty())
+				{
+					job = segment_jobs_.front();
+					segment_jobs_.pop();
+					break;
+				}
+				if (abort_segment_)
+					return;
+				segment_cond_var_.wait_for(lock, 200ms);
+			}
+			estimate = last_file_size_;
+		}
+
+		if (job.type == SegmentJob::OPEN)
+		{
+			// A failure isn't fatal here, openFile will try again and report it properly.
+			int fd = open(tempFilename(job.filename).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+			if (fd < 0)
+				std::cerr << "WARNING: FileOutput: failed to open " << job.filename << " in advance" << std::endl;
+
+			// Reserve the space we expect to need, without changing the file size,
+			// so that the file doesn't end up scattered across the card.
+			if (options_->bitrate && options_->segment)
+				estimate = (off_t)options_->bitrate / 8 * options_->segment / 1000;
+			estimate += estimate / 4;
+			if (fd >= 0 && estimate && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, estimate) < 0 && options_->verbose)
+				std::cerr << "FileOutput: fallocate failed for " << job.filename << std::endl;
+
+			std::lock_guard<std::mutex> lock(segment_mutex_);
+			if (next_fd_ >= 0)
+			{
+				close(next_fd_);
+				unlink(tempFilename(next_filename_).c_str());
+			}
+			next_fd_ = fd;
+			next_filename_ = job.filename;
+			if (pending_open_ == job.filename)
+				pending_open_.clear();
+			segment_cond_var_.notify_all();
+		}
+		else if (job.type == SegmentJob::SWAP)
+		{
+			// The file it replaces stops being tracked first, so that it can't be
+			// deleted once it's ours. Any earlier segment's retention has already run.
+			if (retention_)
+				retention_->Forget(job.filename);
+			if (rename(tempFilename(job.filename).c_str(), job.filename.c_str()) < 0)
+				std::cerr << "WARNING: FileOutput: failed to rename " << tempFilename(job.filename) << " to "
+						  << job.filename << ": " << strerror(errno) << std::endl;
+		}
+		else
+		{
+			// Drop any space we reserved but didn't use, and make sure it's all on disk.
+			writer_->Wait(job.fd);
+			if (ftruncate(job.fd, job.size) < 0)
+				std::cerr << "WARNING: FileOutput: failed to truncate " << job.filename << std::endl;
+			if (fsync(job.fd) < 0)
+				std::cerr << "WARNING: FileOutput: failed to sync " << job.filename << std::endl;
+			close(job.fd);
+			if (options_->verbose)
+				std::cerr << "FileOutput: closed output file " << job.filename << " (" << job.size << " bytes)"
+						  << std::endl;
+
+			if (retention_)
+			{
+				try
+				{
+					retention_->Add(job.filename, job.size, job.start_ms, wallclockMs());
+					retired_ms_ = retention_->DeletedUntilMs();
+				}
+				catch (std::exception const &e)
+				{
+					std::cerr << "WARNING: FileOutput: " << e.what() << std::endl;
+				}
+			}
+		}
+	}
+}
@@ -7,7 +7,18 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+
+#include "async_writer.hpp"
 #include "output.hpp"
+#include "recording_index.hpp"
+#include "segment_retention.hpp"
 
 class FileOutput : public Output
 {
@@ -16,12 +27,63 @@ public:
 	~FileOutput();
 
 protected:
-	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, int64_t wallclock_us, uint32_t flags) override;
 
 private:
-	void openFile(int64_t timestamp_us);
+	// Files are written through a ring of buffers of this size (see --write-ring).
+	static constexpr size_t WRITE_BUFFER_SIZE = 256 << 10;
+
+	void openFile(int64_t timestamp_us, int64_t wallclock_us);
 	void closeFile();
+	std::string makeFilename(unsigned int count) const;
+
+	// The segment thread opens and preallocates the next file before we need it,
+	// and finishes off closed files (truncate to size, fsync, close) so that none
+	// of this happens on the frame path. The next file is opened under a temporary
+	// name, and only takes over its real name (replacing the old file, with
+	// --wrap) once we start writing it.
+	void segmentThread();
+	static std::string tempFilename(std::string const &filename) { return filename + ".tmp"; }
+	struct SegmentJob
+	{
+		enum Type
+		{
+			OPEN,
+			SWAP,
+			CLOSE
+		};
+		Type type;
+		std::string filename;
+		int fd;
+		off_t size;
+		int64_t start_ms;
+	};
+
 	FILE *fp_;
+	int fd_;
+	off_t file_offset_;
+	off_t last_file_size_;
+	bool dropping_;
+	bool index_behind_;
+	std::unique_ptr<AsyncWriter> writer_;
 	unsigned int count_;
+	uint32_t segment_;
+	uint32_t next_segment_;
 	int64_t file_start_time_ms_;
+	int64_t file_start_wallclock_ms_;
+	std::string filename_;
+	std::unique_ptr<SegmentRetention> retention_;
+	std::unique_ptr<RecordingIndex> index_;
+	// Set by the segment thread when retention deletes segments, and passed on to
+	// the index by the output thread, which is the only one to touch it.
+	std::atomic<int64_t> retired_ms_;
+
+	bool abort_segment_;
+	std::queue<SegmentJob> segment_jobs_;
+	std::string pending_open_;
+	std::string next_filename_;
+	int next_fd_;
+	std::mutex segment_mutex_;
+	std::condition_variable segment_cond_var_;
+	std::thread segment_thread_;
 };
@@ -0,0 +1,215 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * frame_publisher.cpp - share raw frames with other local processes.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "frame_publisher.hpp"
+
+FramePublisher::FramePublisher(std::string const &socket_path, unsigned int width, unsigned int height,
+							   unsigned int stride, uint32_t fourcc, size_t frame_size, bool verbose)
+	: socket_path_(socket_path), verbose_(verbose), memfd_(-1), mem_(nullptr), listen_fd_(-1), wake_fd_(-1),
+	  next_slot_(0), refcounts_(NUM_SLOTS, 0)
+{
+	// Page aligned slots, so subscribers could map them individually if they wanted.
+	size_t slot_size = (frame_size + 4095) & ~4095;
+	hello_ = { MAGIC, NUM_SLOTS, (uint32_t)slot_size, width, height, stride, fourcc };
+	mem_size_ = slot_size * NUM_SLOTS;
+
+	// Seal the size so that subscribers can map it without fear of SIGBUS.
+	memfd_ = memfd_create("libcamera-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd_ < 0 || ftruncate(memfd_, mem_size_) < 0 ||
+		fcntl(memfd_, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+		throw std::runtime_error("failed to create frame publisher memfd");
+	void *mem = mmap(nullptr, mem_size_, PROT_READ | PROT_WRITE, MAP_SHARED, memfd_, 0);
+	if (mem == MAP_FAILED)
+		throw std::runtime_error("failed to map frame publisher memfd");
+	mem_ = static_cast<uint8_t *>(mem);
+
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (socket_path_.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("frame publisher socket path too long");
+	strcpy(addr.sun_path, socket_path_.c_str());
+	unlink(socket_path_.c_str());
+	listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0 || bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd_, 8) < 0)
+		throw std::runtime_error("failed to listen on " + socket_path_);
+
+	wake_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (wake_fd_ < 0)
+		throw std::runtime_error("failed to create frame publisher eventfd");
+	socket_thread_ = std::thread(&FramePublisher::socketThread, this);
+}
+
+FramePublisher::~FramePublisher()
+{
+	uint64_t one = 1;
+	if (write(wake_fd_, &one, sizeof(one)) != sizeof(one))
+		std::cerr << "WARNING: FramePublisher: failed to stop socket thread" << std::endl;
+	socket_thread_.join();
+
+	while (!subscribers_.empty())
+		dropSubscriber(subscribers_.size() - 1);
+	close(wake_fd_);
+	close(listen_fd_);
+	unlink(socket_path_.c_str());
+	munmap(mem_, mem_size_);
+	close(memfd_);
+}
+
+void FramePublisher::Publish(void const *mem, size_t size, uint64_t sequence, int64_t timestamp_us)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (subscribers_.empty())
+		return;
+	if (size > hello_.slot_size)
+		throw std::runtime_error("frame too big for frame publisher");
+
+	unsigned int slot = next_slot_;
+	for (unsigned int i = 0; refcounts_[slot]; i++, slot = (slot + 1) % NUM_SLOTS)
+	{
+		if (i == NUM_SLOTS)
+		{
+			if (verbose_)
+				std::cerr << "FramePublisher: no free slot, frame " << sequence << " not published" << std::endl;
+			return;
+		}
+	}
+	next_slot_ = (slot + 1) % NUM_SLOTS;
+	memcpy(mem_ + slot * hello_.slot_size, mem, size);
+
+	FrameMsg msg = { slot, (uint32_t)size, sequence, timestamp_us };
+	for (size_t i = 0; i < subscribers_.size();)
+	{
+		Subscriber &subscriber = subscribers_[i];
+		if (subscriber.held.size() < MAX_HELD)
+		{
+			if (send(subscriber.fd, &msg, sizeof(msg), MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(msg))
+			{
+				subscriber.held.push_back(slot);
+				refcounts_[slot]++;
+			}
+			else if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				dropSubscriber(i);
+				continue;
+			}
+		}
+		i++;
+	}
+}
+
+void FramePublisher::socketThread()
+{
+	std::vector<pollfd> fds;
+	while (true)
+	{
+		fds.clear();
+		fds.push_back({ wake_fd_, POLLIN, 0 });
+		fds.push_back({ listen_fd_, POLLIN, 0 });
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (Subscriber const &subscriber : subscribers_)
+				fds.push_back({ subscriber.fd, POLLIN, 0 });
+		}
+
+		if (poll(fds.data(), fds.size(), -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("frame publisher poll failed");
+		}
+		if (fds[0].revents)
+			return;
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (fds[1].revents & POLLIN)
+		{
+			int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+			if (fd >= 0 && subscribers_.size() >= MAX_SUBSCRIBERS)
+			{
+				// There might be no slots left for anyone else to get frames in.
+				std::cerr << "WARNING: FramePublisher: too many subscribers, refusing another" << std::endl;
+				close(fd);
+			}
+			else if (fd >= 0)
+			{
+				// Send the hello with the memfd attached.
+				char control[CMSG_SPACE(sizeof(int))] = {};
+				iovec iov = { &hello_, sizeof(hello_) };
+				msghdr msg = {};
+				msg.msg_iov = &iov;
+				msg.msg_iovlen = 1;
+				msg.msg_control = control;
+				msg.msg_controllen = sizeof(control);
+				cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+				cmsg->cmsg_level = SOL_SOCKET;
+				cmsg->cmsg_type = SCM_RIGHTS;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+				memcpy(CMSG_DATA(cmsg), &memfd_, sizeof(int));
+				if (sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(hello_))
+				{
+					subscribers_.push_back({ fd, {} });
+					if (verbose_)
+						std::cerr << "FramePublisher: new subscriber " << fd << std::endl;
+				}
+				else
+					close(fd);
+			}
+		}
+
+		// Subscribers may have come and gone since we polled, so match them up by fd.
+		for (size_t i = 2; i < fds.size(); i++)
+		{
+			if (!fds[i].revents)
+				continue;
+			auto it = std::find_if(subscribers_.begin(), subscribers_.end(),
+								   [&fds, i](Subscriber const &s) { return s.fd == fds[i].fd; });
+			if (it == subscribers_.end())
+				continue;
+
+			ReleaseMsg release_msg;
+			ssize_t ret;
+			while ((ret = recv(it->fd, &release_msg, sizeof(release_msg), 0)) == sizeof(release_msg))
+				release(*it, release_msg.slot);
+			if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) || (fds[i].revents & (POLLHUP | POLLERR)))
+				dropSubscriber(it - subscribers_.begin());
+		}
+	}
+}
+
+void FramePublisher::release(Subscriber &subscriber, unsigned int slot)
+{
+	auto it = std::find(subscriber.held.begin(), subscriber.held.end(), slot);
+	if (it == subscriber.held.end())
+		return;
+	subscriber.held.erase(it);
+	refcounts_[slot]--;
+}
+
+void FramePublisher::dropSubscriber(size_t index)
+{
+	Subscriber &subscriber = subscribers_[index];
+	for (unsigned int slot : subscriber.held)
+		refcounts_[slot]--;
+	if (verbose_)
+		std::cerr << "FramePublisher: subscriber " << subscriber.fd << " gone" << std::endl;
+	close(subscriber.fd);
+	subscribers_.erase(subscribers_.begin() + index);
+}
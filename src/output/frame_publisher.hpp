@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * frame_publisher.hpp - share raw frames with other local processes.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Frames are copied into a ring of slots in a memfd, which is shared with any
+// number of subscribers connecting to a Unix (SOCK_SEQPACKET) socket.
+//
+// On connecting, a subscriber receives a Hello message with the memfd attached
+// (SCM_RIGHTS), and should map it read-only. After that it gets a FrameMsg for
+// each frame it is sent, and must send a ReleaseMsg back for that slot when it
+// has finished with it. A slot isn't reused until every subscriber that was
+// sent it has released it, or has gone away.
+//
+// Capture is never held up: a subscriber that is already holding MAX_HELD
+// slots isn't sent the next frame, and if no slot is free the frame isn't
+// published at all. Sequence numbers come from the camera, so subscribers can
+// see what they have missed. There are enough slots for MAX_SUBSCRIBERS to hold
+// all they may and still leave one free, so a subscriber that stops releasing
+// slots only misses frames itself. Connections beyond that are refused.
+
+class FramePublisher
+{
+public:
+	static constexpr uint32_t MAGIC = 0x4c435046; // "LCPF"
+	struct Hello
+	{
+		uint32_t magic;
+		uint32_t num_slots;
+		uint32_t slot_size; // slot n starts at n * slot_size in the memfd
+		uint32_t width;
+		uint32_t height;
+		uint32_t stride;
+		uint32_t fourcc;
+	};
+	struct FrameMsg
+	{
+		uint32_t slot;
+		uint32_t size;
+		uint64_t sequence;
+		int64_t timestamp_us;
+	};
+	struct ReleaseMsg
+	{
+		uint32_t slot;
+	};
+
+	FramePublisher(std::string const &socket_path, unsigned int width, unsigned int height, unsigned int stride,
+				   uint32_t fourcc, size_t frame_size, bool verbose);
+	~FramePublisher();
+	void Publish(void const *mem, size_t size, uint64_t sequence, int64_t timestamp_us);
+
+private:
+	static constexpr unsigned int MAX_SUBSCRIBERS = 4;
+	static constexpr unsigned int MAX_HELD = 2;
+	static constexpr unsigned int NUM_SLOTS = MAX_SUBSCRIBERS * MAX_HELD + 1;
+
+	struct Subscriber
+	{
+		int fd;
+		std::vector<unsigned int> held;
+	};
+
+	void socketThread();
+	void release(Subscriber &subscriber, unsigned int slot);
+	void dropSubscriber(size_t index);
+
+	std::string socket_path_;
+	bool verbose_;
+	Hello hello_;
+	int memfd_;
+	uint8_t *mem_;
+	size_t mem_size_;
+	int listen_fd_;
+	int wake_fd_;
+	unsigned int next_slot_;
+	std::vector<unsigned int> refcounts_;
+	std::vector<Subscriber> subscribers_;
+	std::mutex mutex_;
+	std::thread socket_thread_;
+};
@@ -6,17 +6,36 @@
  */
 
 #include <arpa/inet.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 
+#include <chrono>
+
+#include "core/trace.hpp"
+
 #include "net_output.hpp"
 
-NetOutput::NetOutput(VideoOptions const *options) : Output(options)
+NetOutput::NetOutput(VideoOptions const *options)
+    : Output(options), queued_bytes_(0),
+      clients_metric_(Metrics::GetGauge("libcamera_net_clients", "Clients receiving the tcp stream",
+                                        "camera=\"" + std::to_string(options->camera) + "\"")),
+      listen_fd(-1),
+      datagram_(false), udp_fd_(-1), abort_pacing_(false)
 {
     char protocol[4];
-    int start, end, a, b, c, d;
-    if (sscanf(options->server.c_str(), "%3s://%n%d.%d.%d.%d%n:%d", protocol, &start, &a, &b, &c, &d, &end, &port) != 6)
+    int start, end, a, b, c, d, p;
+    if (sscanf(options->server.c_str(), "%3s://%n%d.%d.%d.%d%n:%d", protocol, &start, &a, &b, &c, &d, &end, &p) != 6)
         throw std::runtime_error("bad network address " + options->output);
-    if (strcmp(protocol, "tcp") != 0)
+    port = p;
+    if (strcmp(protocol, "udp") == 0)
+    {
+        // Datagrams go out as MPEG-TS, which we only know how to build from H.264.
+        if (options->codec != "h264" && options->codec != "libav")
+            throw std::runtime_error("udp output requires the h264 or libav codec");
+        datagram_ = true;
+    }
+    else if (strcmp(protocol, "tcp") != 0)
     {
         throw std::runtime_error("unrecognised network protocol " + options->output);
     }
@@ -28,13 +47,43 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 NetOutput::~NetOutput()
 {
     stopServer();
-    for (auto connection_fd : connections_) {
-        close(connection_fd);
-    }
 }
 
 
 int NetOutput::startServer() {
+    closed_ = false;
+
+    if (datagram_)
+    {
+        udp_fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+        if (udp_fd_ < 0)
+            throw std::runtime_error("unable to open udp socket");
+
+        group_saddr_ = {};
+        group_saddr_.sin_family = AF_INET;
+        group_saddr_.sin_port = htons(port);
+        if (inet_aton(address.c_str(), &group_saddr_.sin_addr) == 0)
+            throw std::runtime_error("bad udp address " + address);
+
+        // Multicast stays on the local network segment.
+        if (IN_MULTICAST(ntohl(group_saddr_.sin_addr.s_addr)))
+        {
+            unsigned char ttl = 1;
+            if (setsockopt(udp_fd_, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0)
+                throw std::runtime_error("failed to set multicast ttl");
+        }
+        if (connect(udp_fd_, (struct sockaddr *)&group_saddr_, sizeof(group_saddr_)) < 0)
+            throw std::runtime_error("failed to connect udp socket");
+
+        ephemeral_port = port;
+        {
+            std::lock_guard<std::mutex> lock(pacing_mutex_);
+            abort_pacing_ = false;
+        }
+        pacing_thread_ = std::thread(&NetOutput::pacingThread, this);
+        return udp_fd_;
+    }
+
     // We are the server.
     this->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_fd < 0)
@@ -62,29 +111,81 @@ int NetOutput::startServer() {
 
 
 void NetOutput::stopServer() {
-    close(listen_fd);
-    for (std::vector<int>::iterator it = connections_.begin(); it < connections_.end(); it++) {
-        close(*it);
+    if (pacing_thread_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(pacing_mutex_);
+            abort_pacing_ = true;
+            pacing_cond_var_.notify_one();
+        }
+        pacing_thread_.join();
+    }
+    {
+        // Frames still waiting belong to this session, and mustn't go out at the start of the next.
+        std::lock_guard<std::mutex> lock(pacing_mutex_);
+        for (PacedFrame &frame : pacing_queue_)
+            free_frames_.push_back(std::move(frame.data));
+        pacing_queue_.clear();
+    }
+    int udp_fd = udp_fd_.exchange(-1);
+    if (udp_fd >= 0)
+        close(udp_fd);
+
+    if (listen_fd >= 0)
+        close(listen_fd);
+    listen_fd = -1;
+    {
+        // This waits for any frame being sent, so that no fd gets closed under it.
+        std::lock_guard<std::mutex> lock(clients_mutex_);
+        for (std::vector<int>::iterator it = connections_.begin(); it < connections_.end(); it++) {
+            removeClientMetrics(*it);
+            close(*it);
+        }
+        connections_.clear();
+        clients_metric_.Set(0);
+    }
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        for (auto fd : new_connections_)
+            close(fd);
+        new_connections_.clear();
     }
-    connections_.clear();
     closed_ = true;
 }
 
 
-void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t /*flags*/)
+void NetOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, int64_t wallclock_us, uint32_t flags)
 {
     using namespace std;
+    if (datagram_)
+    {
+        outputDatagrams(mem, size, timestamp_us, sensorTimestamp(timestamp_us), flags);
+        return;
+    }
+
+    std::lock_guard<std::mutex> clients_lock(clients_mutex_);
+    if (flags & FLAG_KEYFRAME)
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        for (auto fd : new_connections_)
+            addClientMetrics(fd);
+        connections_.insert(connections_.end(), new_connections_.begin(), new_connections_.end());
+        new_connections_.clear();
+        clients_metric_.Set(connections_.size());
+    }
+
     vector<int> closed_fds;
     try
     {
         // std::cerr << "NetOutput: output buffer " << mem << " size " << size << "\n";
 
         for (auto fd : connections_) {
-            size_t max_size = size;
-            for (uint8_t *ptr = (uint8_t *)mem; size;)
+            // Every client gets the whole frame, however much each send() takes.
+            size_t remaining = size;
+            for (uint8_t *ptr = (uint8_t *)mem; remaining;)
             {
-                size_t bytes_to_send = std::min(size, max_size);
-                if (send(fd, ptr, bytes_to_send, 0) < 0) {
+                ssize_t bytes_sent = send(fd, ptr, remaining, 0);
+                if (bytes_sent < 0) {
                     if (errno == EPIPE) {
                         closed_fds.push_back(fd);
                     } else {
@@ -92,20 +193,35 @@ void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, u
                     }
                     break;
                 }
-                ptr += bytes_to_send;
-                size -= bytes_to_send;
+                ptr += bytes_sent;
+                remaining -= bytes_sent;
+            }
+            if (!remaining) {
+                client_metrics_[fd].bytes->Inc(size);
+                client_metrics_[fd].frames->Inc();
             }
         }
+        // Note how far behind the slowest client is.
+        size_t queued_bytes = 0;
+        for (auto fd : connections_) {
+            int outq;
+            if (ioctl(fd, SIOCOUTQ, &outq) == 0)
+                queued_bytes = std::max<size_t>(queued_bytes, outq);
+        }
+        queued_bytes_ = queued_bytes;
+
         // Clean closed sockets
         for (int ix = 0; ix < closed_fds.size(); ix++) {
             for (vector<int>::iterator it = connections_.begin(); it < connections_.end(); it++) {
                 if (*it == closed_fds[ix]) {
+                    removeClientMetrics(*it);
                     close(*it);
                     connections_.erase(it);
                     break;
                 }
             }
         }
+        clients_metric_.Set(connections_.size());
     }
     catch (...)
     {
@@ -113,6 +229,87 @@ void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, u
     }
 }
 
+void NetOutput::outputDatagrams(void *mem, size_t size, int64_t timestamp_us, int64_t sensor_timestamp_us,
+                                uint32_t flags)
+{
+    if (udp_fd_ < 0)
+        return;
+
+    // Recycle the frame buffers so we don't allocate on every frame.
+    std::vector<uint8_t> frame;
+    {
+        std::lock_guard<std::mutex> lock(pacing_mutex_);
+        if (!free_frames_.empty())
+        {
+            frame = std::move(free_frames_.back());
+            free_frames_.pop_back();
+        }
+    }
+    frame.clear();
+    muxer_.Mux(mem, size, timestamp_us, flags & FLAG_KEYFRAME, frame);
+
+    // The server may have been stopped while we were muxing.
+    std::lock_guard<std::mutex> lock(pacing_mutex_);
+    if (abort_pacing_)
+    {
+        free_frames_.push_back(std::move(frame));
+        return;
+    }
+    pacing_queue_.push_back({ std::move(frame), sensor_timestamp_us });
+    pacing_cond_var_.notify_one();
+}
+
+void NetOutput::pacingThread()
+{
+    using namespace std::chrono;
+    microseconds frame_interval(options_->framerate > 0 ? (int64_t)(1000000 / options_->framerate) : 33333);
+    PacedFrame frame;
+    while (true)
+    {
+        bool backlog;
+        {
+            std::unique_lock<std::mutex> lock(pacing_mutex_);
+            while (true)
+            {
+                using namespace std::chrono_literals;
+                if (abort_pacing_)
+                    return;
+                if (!pacing_queue_.empty())
+                {
+                    frame = std::move(pacing_queue_.front());
+                    pacing_queue_.pop_front();
+                    break;
+                }
+                else
+                    pacing_cond_var_.wait_for(lock, 200ms);
+            }
+            backlog = !pacing_queue_.empty();
+        }
+
+        // Aim to finish in 3/4 of a frame interval so as to leave some slack. If
+        // we're already behind, just send everything we have straight away.
+        size_t num_datagrams = (frame.data.size() + DATAGRAM_SIZE - 1) / DATAGRAM_SIZE;
+        microseconds gap = backlog ? microseconds(0) : frame_interval * 3 / 4 / (int64_t)num_datagrams;
+        steady_clock::time_point next = steady_clock::now();
+        {
+            TraceScope trace("send", frame.timestamp_us);
+            for (size_t i = 0; i < num_datagrams; i++)
+            {
+                size_t offset = i * DATAGRAM_SIZE;
+                size_t len = std::min<size_t>(DATAGRAM_SIZE, frame.data.size() - offset);
+                if (send(udp_fd_, &frame.data[offset], len, 0) < 0 && errno != ECONNREFUSED)
+                    std::cerr << "failed to send datagram " << errno << std::endl;
+                next += gap;
+                if (i + 1 < num_datagrams && gap.count())
+                    std::this_thread::sleep_until(next);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(pacing_mutex_);
+        free_frames_.push_back(std::move(frame.data));
+    }
+}
+
 int NetOutput::acceptConnection()
 {
     sockaddr addr;
@@ -124,7 +321,35 @@ int NetOutput::acceptConnection()
         std::cerr << "ERRNO " << errno << " " << fd << std::endl;
         throw std::runtime_error("accept socket failed");
     }
-    connections_.push_back(fd);
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        new_connections_.push_back(fd);
+    }
 
     // close(listen_fd);
+    return fd;
+}
+
+void NetOutput::addClientMetrics(int fd)
+{
+    sockaddr_in addr = {};
+    socklen_t addr_size = sizeof(addr);
+    std::string client = std::to_string(fd);
+    if (getpeername(fd, (sockaddr *)&addr, &addr_size) == 0)
+        client = std::string(inet_ntoa(addr.sin_addr)) + ":" + std::to_string(ntohs(addr.sin_port));
+    ClientMetrics &metrics = client_metrics_[fd];
+    metrics.labels = "client=\"" + client + "\"";
+    metrics.bytes = &Metrics::GetCounter("libcamera_net_bytes_sent_total", "Bytes sent to each tcp client", metrics.labels);
+    metrics.frames = &Metrics::GetCounter("libcamera_net_frames_sent_total", "Frames sent to each tcp client",
+                                          metrics.labels);
+}
+
+void NetOutput::removeClientMetrics(int fd)
+{
+    auto it = client_metrics_.find(fd);
+    if (it == client_metrics_.end())
+        return;
+    Metrics::Remove("libcamera_net_bytes_sent_total", it->second.labels);
+    Metrics::Remove("libcamera_net_frames_sent_total", it->second.labels);
+    client_metrics_.erase(it);
 }
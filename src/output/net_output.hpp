@@ -7,11 +7,20 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <netinet/in.h>
 
+#include "core/metrics.hpp"
+
 #include "output.hpp"
+#include "ts_muxer.hpp"
 
 
 class NetOutput : public Output
@@ -24,17 +33,67 @@ public:
 	void stopServer();
 	bool closed() { return closed_; }
 	in_port_t get_port() { return ephemeral_port; }
+	// In udp:// mode there are no connections to accept, the stream simply
+	// goes out to the (usually multicast) group address.
+	bool datagram() const { return datagram_; }
+	// Bytes in the slowest client's socket send queue as of the last frame, both
+	// those not yet sent and those sent but not yet acknowledged (SIOCOUTQ).
+	size_t QueuedBytes() const { return queued_bytes_; }
 
 
 protected:
-	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, int64_t wallclock_us, uint32_t flags) override;
 
 private:
+	// MPEG-TS packets are sent in groups of 7 so as to fit a 1500 byte MTU.
+	static constexpr unsigned int PACKETS_PER_DATAGRAM = 7;
+	static constexpr unsigned int DATAGRAM_SIZE = PACKETS_PER_DATAGRAM * TsMuxer::PACKET_SIZE;
+
+	// Rather than sending each frame in a single burst, the pacing thread spreads
+	// its datagrams out over the frame interval.
+	void pacingThread();
+	void outputDatagrams(void *mem, size_t size, int64_t timestamp_us, int64_t sensor_timestamp_us, uint32_t flags);
+	void addClientMetrics(int fd);
+	void removeClientMetrics(int fd);
+
+	// The clients getting the stream, and their metrics, are guarded by clients_mutex_,
+	// which is held while each frame goes out. Newly accepted connections only start
+	// getting the stream at a keyframe, and wait under connections_mutex_ instead, so
+	// that accepting one never waits on a send.
 	std::vector<int> connections_;
+	std::vector<int> new_connections_;
+	std::mutex connections_mutex_;
+	std::mutex clients_mutex_;
+	std::atomic<size_t> queued_bytes_;
+	// Each client's metrics are labelled with its address, and go when it does.
+	struct ClientMetrics
+	{
+		std::string labels;
+		Counter *bytes;
+		Counter *frames;
+	};
+	std::map<int, ClientMetrics> client_metrics_;
+	Gauge &clients_metric_;
 	int listen_fd;
 	std::string address;
 	in_port_t port;
 	in_port_t ephemeral_port;
 	bool closed_;
 	sockaddr_in server_saddr;
+
+	bool datagram_;
+	std::atomic<int> udp_fd_; // closed on the main thread, while frames arrive on another
+	sockaddr_in group_saddr_;
+	TsMuxer muxer_;
+	struct PacedFrame
+	{
+		std::vector<uint8_t> data;
+		int64_t timestamp_us; // the sensor timestamp, which identifies the frame in traces
+	};
+	std::deque<PacedFrame> pacing_queue_;
+	std::vector<std::vector<uint8_t>> free_frames_;
+	std::mutex pacing_mutex_;
+	std::condition_variable pacing_cond_var_;
+	std::thread pacing_thread_;
+	bool abort_pacing_;
 };
@@ -5,32 +5,26 @@
  * output.cpp - video stream output base class
  */
 
-#include <cinttypes>
 #include <stdexcept>
 
+#include "core/trace.hpp"
+
 #include "circular_output.hpp"
 #include "file_output.hpp"
 #include "net_output.hpp"
 #include "output.hpp"
 
 Output::Output(VideoOptions const *options)
-	: options_(options), state_(WAITING_KEYFRAME), fp_timestamps_(nullptr), time_offset_(0), last_timestamp_(0)
+	: options_(options), state_(WAITING_KEYFRAME), bytes_output_(0), time_offset_(0), last_timestamp_(0)
 {
 	if (!options->save_pts.empty())
-	{
-		fp_timestamps_ = fopen(options->save_pts.c_str(), "w");
-		if (!fp_timestamps_)
-			throw std::runtime_error("Failed to open timestamp file " + options->save_pts);
-		fprintf(fp_timestamps_, "# timecode format v2\n");
-	}
+		pts_writer_ = std::make_unique<PtsWriter>(options->save_pts);
 
 	enable_ = !options->pause;
 }
 
 Output::~Output()
 {
-	if (fp_timestamps_)
-		fclose(fp_timestamps_);
 }
 
 void Output::Signal()
@@ -38,7 +32,7 @@ void Output::Signal()
 	enable_ = !enable_;
 }
 
-void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe)
+void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, int64_t wallclock_us, bool keyframe)
 {
 	// When output is enabled, we may have to wait for the next keyframe.
 	uint32_t flags = keyframe ? FLAG_KEYFRAME : FLAG_NONE;
@@ -56,23 +50,26 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 		time_offset_ = timestamp_us - last_timestamp_;
 	last_timestamp_ = timestamp_us - time_offset_;
 
-	outputBuffer(mem, size, last_timestamp_, flags);
+	{
+		// Traced by the original timestamp, which is what identifies the frame elsewhere.
+		TraceScope trace("write", timestamp_us);
+		outputBuffer(mem, size, last_timestamp_, wallclock_us, flags);
+	}
 
-	// Save timestamps to a file, if that was requested.
-	if (fp_timestamps_)
-		fprintf(fp_timestamps_, "%" PRId64 ".%03" PRId64 "\n", last_timestamp_ / 1000, last_timestamp_ % 1000);
+	// Save timestamps to a file, if that was requested. The offset is in the stream
+	// as given to outputBuffer(), whatever became of each frame after that.
+	if (pts_writer_)
+		pts_writer_->Write({ last_timestamp_, wallclock_us, bytes_output_, static_cast<uint32_t>(size), flags });
+	bytes_output_ += size;
 }
 
-void Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+void Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, int64_t wallclock_us, uint32_t flags)
 {
 	// Supply this so that a vanilla Output gives you an object that outputs no buffers.
 }
 
 Output *Output::Create(VideoOptions const *options)
 {
-	if (options->codec == "libav")
-		return new Output(options);
-
 	if (strncmp(options->output.c_str(), "udp://", 6) == 0 || strncmp(options->output.c_str(), "tcp://", 6) == 0)
 		return new NetOutput(options);
 	else if (options->circular)
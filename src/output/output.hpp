@@ -10,9 +10,12 @@
 #include <cstdio>
 
 #include <atomic>
+#include <memory>
 
 #include "core/video_options.hpp"
 
+#include "pts_writer.hpp"
+
 class Output
 {
 public:
@@ -21,7 +24,8 @@ public:
 	Output(VideoOptions const *options);
 	virtual ~Output();
 	virtual void Signal(); // a derived class might redefine what this means
-	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
+	// The wall clock time is 0 when it isn't known.
+	void OutputReady(void *mem, size_t size, int64_t timestamp_us, int64_t wallclock_us, bool keyframe);
 
 protected:
 	enum Flag
@@ -30,7 +34,10 @@ protected:
 		FLAG_KEYFRAME = 1,
 		FLAG_RESTART = 2
 	};
-	virtual void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
+	virtual void outputBuffer(void *mem, size_t size, int64_t timestamp_us, int64_t wallclock_us, uint32_t flags);
+	// The timestamp passed to outputBuffer() is made continuous across pauses. This
+	// gives back the one it came from, the sensor timestamp.
+	int64_t sensorTimestamp(int64_t timestamp_us) const { return timestamp_us + time_offset_; }
 	VideoOptions const *options_;
 
 private:
@@ -42,7 +49,8 @@ private:
 	};
 	State state_;
 	std::atomic<bool> enable_;
-	FILE *fp_timestamps_;
+	std::unique_ptr<PtsWriter> pts_writer_;
+	uint64_t bytes_output_;
 	int64_t time_offset_;
 	int64_t last_timestamp_;
 };
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * pts_writer.cpp - write a binary timestamp file in the background.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "pts_writer.hpp"
+
+static_assert(sizeof(PtsWriter::Record) == 32, "PtsWriter::Record must be 32 bytes");
+
+constexpr char PtsWriter::MAGIC[8];
+
+PtsWriter::PtsWriter(std::string const &filename) : filename_(filename), offset_(0), dropping_(false)
+{
+	fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd_ < 0)
+		throw std::runtime_error("Failed to open timestamp file " + filename);
+	writer_ = std::make_unique<AsyncWriter>(BUFFER_SIZE, NUM_BUFFERS, false);
+
+	Header header;
+	std::copy(MAGIC, MAGIC + sizeof(MAGIC), header.magic);
+	writer_->Write(fd_, offset_, &header, sizeof(header), false);
+	offset_ += sizeof(header);
+}
+
+PtsWriter::~PtsWriter()
+{
+	writer_->Flush();
+	writer_->Wait(fd_);
+	writer_.reset();
+	close(fd_);
+}
+
+void PtsWriter::Write(Record const &record)
+{
+	// There's room for thousands of records, so this should never really happen.
+	bool dropped = !writer_->Write(fd_, offset_, &record, sizeof(record), false);
+	if (dropped && !dropping_)
+		std::cerr << "WARNING: PtsWriter: buffers full, dropping timestamps for " << filename_ << std::endl;
+	dropping_ = dropped;
+	if (!dropped)
+		offset_ += sizeof(record);
+}
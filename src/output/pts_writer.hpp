@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * pts_writer.hpp - write a binary timestamp file in the background.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "async_writer.hpp"
+
+// The --save-pts file is a short header followed by a fixed size record for
+// each frame. Records are copied into an AsyncWriter and written out a buffer
+// at a time, so there is no formatting or stdio on the frame path. Use the
+// libcamera-pts tool to turn the file into mkvmerge's "timecode format v2".
+//
+// A record's offset counts every byte handed to the output before the frame
+// (frames skipped while paused aren't handed over). So it's a position in the
+// encoded stream, not in a file. It only matches the output file when that is a
+// single file, and none of the frames were dropped on the way there (as they
+// are when FileOutput's write ring fills). For real file offsets, use --index.
+
+class PtsWriter
+{
+public:
+	struct Header
+	{
+		char magic[8];
+	};
+	struct Record
+	{
+		int64_t timestamp_us;
+		int64_t wallclock_us; // CLOCK_REALTIME at capture, or 0 if not known
+		uint64_t offset; // of the frame in the encoded stream, see above
+		uint32_t size;
+		uint32_t flags; // as passed to Output::outputBuffer
+	};
+	static constexpr char MAGIC[8] = { 'L', 'C', 'A', 'P', 'T', 'S', '0', '2' };
+
+	PtsWriter(std::string const &filename);
+	~PtsWriter();
+	void Write(Record const &record);
+
+private:
+	static constexpr size_t BUFFER_SIZE = 64 << 10;
+	static constexpr unsigned int NUM_BUFFERS = 4;
+
+	std::string filename_;
+	int fd_;
+	off_t offset_;
+	bool dropping_;
+	std::unique_ptr<AsyncWriter> writer_;
+};
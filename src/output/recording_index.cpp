@@ -0,0 +1,209 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * recording_index.cpp - time index of keyframes across recording segments.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "recording_index.hpp"
+
+// The file is a header padded out to HEADER_SIZE bytes, followed by an array of
+// records. The file is grown ahead of need, so only the first num_records records
+// are valid. num_records is updated after each record is written, so a reader
+// mapping the file at the same time never sees a partial record.
+
+static char const MAGIC[8] = { 'L', 'C', 'A', 'I', 'N', 'D', 'E', 'X' };
+static constexpr uint32_t VERSION = 1;
+
+struct RecordingIndex::Header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t wrap;
+	uint32_t next_segment;
+	uint64_t num_records;
+	char output[256];
+	// Older indexes have zeroes here, which is what we want.
+	int64_t retired_us;
+};
+
+static_assert(sizeof(RecordingIndex::Record) == 32, "RecordingIndex::Record must be 32 bytes");
+
+RecordingIndex::RecordingIndex(std::string const &filename, std::string const &output, unsigned int wrap)
+	: writable_(!output.empty()), mem_(nullptr), mapped_size_(0), capacity_(0)
+{
+	static_assert(sizeof(Header) <= HEADER_SIZE, "RecordingIndex::Header too big");
+	if (output.size() >= sizeof(Header::output))
+		throw std::runtime_error("output filename too long for recording index");
+
+	fd_ = open(filename.c_str(), writable_ ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0666);
+	if (fd_ < 0)
+		throw std::runtime_error("failed to open recording index " + filename);
+
+	// The destructor won't run if we throw, so tidy up here.
+	try
+	{
+		init(filename, output, wrap);
+	}
+	catch (std::exception const &)
+	{
+		if (mem_)
+			munmap(mem_, mapped_size_);
+		close(fd_);
+		throw;
+	}
+}
+
+void RecordingIndex::init(std::string const &filename, std::string const &output, unsigned int wrap)
+{
+	struct stat st;
+	if (fstat(fd_, &st) < 0)
+		throw std::runtime_error("failed to stat recording index " + filename);
+
+	if (st.st_size == 0 && writable_)
+	{
+		st.st_size = HEADER_SIZE + GROW_RECORDS * sizeof(Record);
+		if (ftruncate(fd_, st.st_size) < 0)
+			throw std::runtime_error("failed to size recording index " + filename);
+		map(st.st_size);
+		Header *h = header();
+		memcpy(h->magic, MAGIC, sizeof(MAGIC));
+		h->version = VERSION;
+		h->record_size = sizeof(Record);
+		h->wrap = wrap;
+		h->next_segment = 0;
+		h->num_records = 0;
+		h->retired_us = 0;
+		strcpy(h->output, output.c_str());
+		return;
+	}
+
+	if ((size_t)st.st_size < HEADER_SIZE)
+		throw std::runtime_error("recording index " + filename + " is truncated");
+	map(st.st_size);
+	Header const *h = header();
+	if (memcmp(h->magic, MAGIC, sizeof(MAGIC)) || h->version != VERSION || h->record_size != sizeof(Record))
+		throw std::runtime_error(filename + " is not a recording index");
+	// Carrying on with a different pattern would make the old segment numbers
+	// point at the wrong files.
+	if (writable_ && (output != h->output || wrap != h->wrap))
+		throw std::runtime_error("recording index " + filename + " belongs to output " + h->output);
+}
+
+RecordingIndex::~RecordingIndex()
+{
+	if (mem_)
+		munmap(mem_, mapped_size_);
+	close(fd_);
+}
+
+void RecordingIndex::map(size_t size)
+{
+	if (mem_)
+		munmap(mem_, mapped_size_);
+	int prot = writable_ ? PROT_READ | PROT_WRITE : PROT_READ;
+	void *mem = mmap(nullptr, size, prot, MAP_SHARED, fd_, 0);
+	if (mem == MAP_FAILED)
+	{
+		mem_ = nullptr;
+		throw std::runtime_error("failed to map recording index: " + std::string(strerror(errno)));
+	}
+	mem_ = static_cast<uint8_t *>(mem);
+	mapped_size_ = size;
+	capacity_ = (size - HEADER_SIZE) / sizeof(Record);
+}
+
+RecordingIndex::Header *RecordingIndex::header() const
+{
+	return reinterpret_cast<Header *>(mem_);
+}
+
+RecordingIndex::Record *RecordingIndex::records() const
+{
+	return reinterpret_cast<Record *>(mem_ + HEADER_SIZE);
+}
+
+bool RecordingIndex::Append(Record const &record)
+{
+	uint64_t n = Size();
+	if (n && record.wallclock_us < records()[n - 1].wallclock_us)
+		return false;
+	if (n == capacity_)
+	{
+		size_t size = HEADER_SIZE + std::max(capacity_ * 2, GROW_RECORDS) * sizeof(Record);
+		if (ftruncate(fd_, size) < 0)
+			throw std::runtime_error("failed to grow recording index");
+		map(size);
+	}
+
+	records()[n] = record;
+	Header *h = header();
+	h->next_segment = std::max(h->next_segment, record.segment + 1);
+	__atomic_store_n(&h->num_records, n + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+uint32_t RecordingIndex::NextSegment() const
+{
+	return header()->next_segment;
+}
+
+uint64_t RecordingIndex::Size() const
+{
+	// The file may have been cut short, or still be being written.
+	return std::min<uint64_t>(__atomic_load_n(&header()->num_records, __ATOMIC_ACQUIRE), capacity_);
+}
+
+RecordingIndex::Record const &RecordingIndex::operator[](uint64_t n) const
+{
+	return records()[n];
+}
+
+void RecordingIndex::Retire(int64_t wallclock_us)
+{
+	Header *h = header();
+	if (wallclock_us > h->retired_us)
+		__atomic_store_n(&h->retired_us, wallclock_us, __ATOMIC_RELAXED);
+}
+
+uint32_t RecordingIndex::FirstSegment() const
+{
+	// With --wrap, only the most recent "wrap" segments have files of their own.
+	Header const *h = header();
+	return h->wrap && h->next_segment > h->wrap ? h->next_segment - h->wrap : 0;
+}
+
+bool RecordingIndex::Find(int64_t wallclock_us, Record &record) const
+{
+	Record const *begin = records();
+	Record const *end = begin + Size();
+	Record const *it = std::upper_bound(begin, end, wallclock_us,
+										[](int64_t t, Record const &r) { return t < r.wallclock_us; });
+	if (it == begin)
+		return false;
+	// Records are in segment order too, so anything earlier is gone as well.
+	record = *(it - 1);
+	return record.segment >= FirstSegment() &&
+		   record.wallclock_us >= __atomic_load_n(&header()->retired_us, __ATOMIC_RELAXED);
+}
+
+std::string RecordingIndex::Filename(uint32_t segment) const
+{
+	Header const *h = header();
+	char filename[256];
+	int n = snprintf(filename, sizeof(filename), h->output, h->wrap ? segment % h->wrap : segment);
+	if (n < 0)
+		throw std::runtime_error("failed to generate filename");
+	return filename;
+}
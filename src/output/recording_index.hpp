@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * recording_index.hpp - time index of keyframes across recording segments.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// An append-only file of fixed size records, one per keyframe, giving the wall
+// clock time, the sensor timestamp, and where to find the frame (segment number
+// and byte offset). The file is memory mapped, and as the wall clock times are
+// in ascending order, finding the keyframe for a given time is a binary search
+// that touches only the index.
+//
+// Segments are numbered consecutively across restarts, and the header stores the
+// output filename pattern and --wrap value so that a segment number can be turned
+// back into a filename. Segments that have since been overwritten (with --wrap)
+// or deleted (see Retire()) are no longer found.
+
+class RecordingIndex
+{
+public:
+	struct Record
+	{
+		int64_t wallclock_us;
+		int64_t timestamp_us;
+		uint64_t offset;
+		uint32_t segment;
+		uint32_t flags;
+	};
+	static constexpr uint32_t FLAG_KEYFRAME = 1;
+
+	// Open an index for writing (creating it if necessary) or, with an empty
+	// output pattern, for reading only.
+	RecordingIndex(std::string const &filename, std::string const &output = "", unsigned int wrap = 0);
+	~RecordingIndex();
+
+	// Records must come in wall clock order, or Find() couldn't search them. One
+	// from before the last (the clock was stepped back) isn't added, and we
+	// return false.
+	bool Append(Record const &record);
+	// The first segment number not yet used in this index.
+	uint32_t NextSegment() const;
+
+	uint64_t Size() const;
+	Record const &operator[](uint64_t n) const;
+	// Segments whose keyframes are all from before this wall clock time have been
+	// deleted, so their records should no longer be returned.
+	void Retire(int64_t wallclock_us);
+	// The oldest segment whose file may still exist.
+	uint32_t FirstSegment() const;
+	// Find the last record at or before the given wall clock time. Returns false
+	// if there's no such record, or its segment is gone.
+	bool Find(int64_t wallclock_us, Record &record) const;
+	std::string Filename(uint32_t segment) const;
+
+private:
+	struct Header;
+	static constexpr size_t HEADER_SIZE = 512;
+	// The file starts with room for this many records, and doubles in size
+	// whenever it fills, so growing it (on the output thread) is rare.
+	static constexpr uint64_t GROW_RECORDS = 16384;
+
+	void init(std::string const &filename, std::string const &output, unsigned int wrap);
+	void map(size_t size);
+	Header *header() const;
+	Record *records() const;
+
+	int fd_;
+	bool writable_;
+	uint8_t *mem_;
+	size_t mapped_size_;
+	uint64_t capacity_;
+};
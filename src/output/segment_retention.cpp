@@ -0,0 +1,169 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * segment_retention.cpp - delete old recording segments to stay within a budget.
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "segment_retention.hpp"
+
+// The index is a text file with one record per line, either
+//     + <size> <start_ms> <end_ms> <filename>
+// when a segment is added, or
+//     - <filename>
+// when it is deleted. Replaying it gives the current list of segments.
+
+SegmentRetention::SegmentRetention(std::string const &index_file, uint64_t max_bytes, int64_t max_age_ms,
+								   bool verbose)
+	: index_file_(index_file), max_bytes_(max_bytes), max_age_ms_(max_age_ms), verbose_(verbose), total_bytes_(0),
+	  stale_records_(0), fp_(nullptr)
+{
+	load();
+	compact();
+	if (verbose_)
+		std::cerr << "SegmentRetention: tracking " << segments_.size() << " segments, " << total_bytes_
+				  << " bytes, from " << index_file_ << std::endl;
+}
+
+SegmentRetention::~SegmentRetention()
+{
+	if (fp_)
+		fclose(fp_);
+}
+
+void SegmentRetention::Add(std::string const &filename, uint64_t size, int64_t start_ms, int64_t end_ms)
+{
+	// In case a file of the same name was overwritten without Forget() being called.
+	if (remove(filename))
+		stale_records_++;
+	segments_.push_back({ filename, size, start_ms, end_ms });
+	total_bytes_ += size;
+	char record[80];
+	snprintf(record, sizeof(record), "+ %" PRIu64 " %" PRId64 " %" PRId64 " ", size, start_ms, end_ms);
+	write(record + filename);
+
+	enforce(end_ms);
+}
+
+void SegmentRetention::Forget(std::string const &filename)
+{
+	if (!remove(filename))
+		return;
+	write("- " + filename);
+	// Both the segment's "+" record and this one.
+	stale_records_ += 2;
+}
+
+void SegmentRetention::load()
+{
+	FILE *fp = fopen(index_file_.c_str(), "r");
+	if (!fp)
+		return;
+
+	char line[512];
+	while (fgets(line, sizeof(line), fp))
+	{
+		line[strcspn(line, "\n")] = 0;
+		Segment segment;
+		int n;
+		if (sscanf(line, "+ %" SCNu64 " %" SCNd64 " %" SCNd64 " %n", &segment.size, &segment.start_ms,
+				   &segment.end_ms, &n) == 3)
+		{
+			segment.filename = line + n;
+			if (remove(segment.filename))
+				stale_records_++;
+			segments_.push_back(segment);
+			total_bytes_ += segment.size;
+		}
+		else if (line[0] == '-' && line[1] == ' ')
+		{
+			stale_records_ += remove(line + 2) ? 2 : 1;
+		}
+		else
+			std::cerr << "WARNING: SegmentRetention: ignoring bad index record \"" << line << "\"" << std::endl;
+	}
+	fclose(fp);
+}
+
+bool SegmentRetention::remove(std::string const &filename)
+{
+	auto it = std::find_if(segments_.begin(), segments_.end(),
+						   [&filename](Segment const &s) { return s.filename == filename; });
+	if (it == segments_.end())
+		return false;
+	total_bytes_ -= it->size;
+	segments_.erase(it);
+	return true;
+}
+
+void SegmentRetention::write(std::string const &record)
+{
+	// A compaction that failed part way may have left us without the index open.
+	if (!fp_)
+		fp_ = fopen(index_file_.c_str(), "a");
+	if (!fp_ || fprintf(fp_, "%s\n", record.c_str()) < 0 || fflush(fp_))
+		std::cerr << "WARNING: SegmentRetention: failed to write retention index " << index_file_ << std::endl;
+}
+
+void SegmentRetention::enforce(int64_t now_ms)
+{
+	// We always keep the most recent segment, whatever it costs.
+	while (segments_.size() > 1 && ((max_bytes_ && total_bytes_ > max_bytes_) ||
+									(max_age_ms_ && segments_.front().end_ms < now_ms - max_age_ms_)))
+	{
+		Segment const &oldest = segments_.front();
+		if (unlink(oldest.filename.c_str()) < 0 && errno != ENOENT)
+		{
+			// Keep it, so that we try again when the next segment gets added.
+			std::cerr << "WARNING: SegmentRetention: failed to delete " << oldest.filename << ": "
+					  << strerror(errno) << std::endl;
+			break;
+		}
+		if (verbose_)
+			std::cerr << "SegmentRetention: deleted " << oldest.filename << std::endl;
+		write("- " + oldest.filename);
+		total_bytes_ -= oldest.size;
+		segments_.pop_front();
+		stale_records_ += 2;
+		deleted_until_ms_ = segments_.front().start_ms;
+	}
+
+	if (stale_records_ > COMPACT_THRESHOLD && stale_records_ > segments_.size())
+		compact();
+}
+
+void SegmentRetention::compact()
+{
+	// Write a fresh copy of the index containing only live segments, then swap it in.
+	// Until the rename, the old index (and our handle on it) stays as it was.
+	std::string tmp_file = index_file_ + ".tmp";
+	FILE *fp = fopen(tmp_file.c_str(), "w");
+	if (!fp)
+		throw std::runtime_error("failed to open retention index " + tmp_file);
+	for (Segment const &s : segments_)
+		fprintf(fp, "+ %" PRIu64 " %" PRId64 " %" PRId64 " %s\n", s.size, s.start_ms, s.end_ms, s.filename.c_str());
+	bool ok = !fflush(fp) && fsync(fileno(fp)) == 0;
+	ok = !fclose(fp) && ok;
+	if (!ok || rename(tmp_file.c_str(), index_file_.c_str()) < 0)
+	{
+		unlink(tmp_file.c_str());
+		throw std::runtime_error("failed to replace retention index " + index_file_);
+	}
+	stale_records_ = 0;
+
+	// Our old handle now refers to the file that got replaced.
+	if (fp_)
+		fclose(fp_);
+	fp_ = fopen(index_file_.c_str(), "a");
+	if (!fp_)
+		throw std::runtime_error("failed to open retention index " + index_file_);
+}
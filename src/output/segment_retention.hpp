@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * segment_retention.hpp - delete old recording segments to stay within a budget.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <string>
+
+// Keeps track of every closed segment (name, size and the wall clock time span
+// it covers) and deletes the oldest ones whenever the total size or the age of
+// the oldest goes over budget. The list is kept in a small append-only text
+// index next to the recordings so that it can be rebuilt at startup without
+// scanning the directory. Files that aren't in the index are never touched.
+//
+// This does file I/O, so it should only be called from a background thread.
+
+class SegmentRetention
+{
+public:
+	// A zero max_bytes or max_age_ms means that limit isn't applied.
+	SegmentRetention(std::string const &index_file, uint64_t max_bytes, int64_t max_age_ms, bool verbose);
+	~SegmentRetention();
+	// Record a newly closed segment, and then enforce the budget.
+	void Add(std::string const &filename, uint64_t size, int64_t start_ms, int64_t end_ms);
+	// Stop tracking a segment without deleting it. This must be called before a
+	// tracked file gets reused (for example with --wrap, or when the file numbering
+	// starts again after a restart) so that it isn't deleted while being written.
+	void Forget(std::string const &filename);
+	// Every tracked segment that started before this wall clock time has been
+	// deleted. Zero until one has.
+	int64_t DeletedUntilMs() const { return deleted_until_ms_; }
+
+private:
+	// Rewrite the index once it holds this many more records than segments.
+	static constexpr unsigned int COMPACT_THRESHOLD = 256;
+
+	struct Segment
+	{
+		std::string filename;
+		uint64_t size;
+		int64_t start_ms;
+		int64_t end_ms;
+	};
+
+	void load();
+	// Returns whether the segment was being tracked.
+	bool remove(std::string const &filename);
+	void write(std::string const &record);
+	void enforce(int64_t now_ms);
+	void compact();
+
+	std::string index_file_;
+	uint64_t max_bytes_;
+	int64_t max_age_ms_;
+	bool verbose_;
+	std::deque<Segment> segments_;
+	uint64_t total_bytes_;
+	unsigned int stale_records_;
+	int64_t deleted_until_ms_;
+	FILE *fp_;
+};
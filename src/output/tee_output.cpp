@@ -0,0 +1,119 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * tee_output.cpp - pass the encoded stream on to several outputs at once.
+ */
+
+#include <chrono>
+#include <iostream>
+
+#include "tee_output.hpp"
+
+TeeOutput::TeeOutput(VideoOptions const *options) : Output(options), abort_(false)
+{
+	// Our outputs start paused with --pause, so we mustn't as well.
+	if (options->pause)
+		Output::Signal();
+}
+
+TeeOutput::~TeeOutput()
+{
+	// Let every output finish what it has queued.
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_var_.notify_all();
+	}
+	for (auto &child : children_)
+		child->thread.join();
+}
+
+VideoOptions *TeeOutput::ChildOptions()
+{
+	child_options_.push_back(std::make_unique<VideoOptions>(*options_));
+	child_options_.back()->save_pts.clear();
+	return child_options_.back().get();
+}
+
+void TeeOutput::AddOutput(Output *output)
+{
+	std::unique_ptr<Child> child = std::make_unique<Child>();
+	child->output.reset(output);
+	child->dropping = false;
+	child->failed = false;
+	child->thread = std::thread(&TeeOutput::childThread, this, child.get());
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	children_.push_back(std::move(child));
+}
+
+void TeeOutput::Signal()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto &child : children_)
+		child->output->Signal();
+}
+
+void TeeOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, int64_t wallclock_us, uint32_t flags)
+{
+	uint8_t *src = static_cast<uint8_t *>(mem);
+	std::shared_ptr<Frame> frame =
+		std::make_shared<Frame>(Frame { std::vector<uint8_t>(src, src + size), sensorTimestamp(timestamp_us),
+										wallclock_us, !!(flags & FLAG_KEYFRAME) });
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto &child : children_)
+	{
+		if (child->failed || (child->dropping && !frame->keyframe))
+			continue;
+		child->dropping = child->queue.size() >= QUEUE_LENGTH;
+		if (child->dropping)
+		{
+			if (options_->verbose)
+				std::cerr << "TeeOutput: output " << child->output.get() << " is behind, dropping frames"
+						  << std::endl;
+			continue;
+		}
+		child->queue.push_back(frame);
+	}
+	cond_var_.notify_all();
+}
+
+void TeeOutput::childThread(Child *child)
+{
+	while (true)
+	{
+		std::shared_ptr<Frame> frame;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			while (true)
+			{
+				using namespace std::chrono_literals;
+				if (!child->queue.empty())
+				{
+					frame = std::move(child->queue.front());
+					child->queue.pop_front();
+					break;
+				}
+				if (abort_)
+					return;
+				cond_var_.wait_for(lock, 200ms);
+			}
+		}
+
+		// One output failing mustn't take the others down with it.
+		try
+		{
+			child->output->OutputReady(frame->data.data(), frame->data.size(), frame->timestamp_us,
+									   frame->wallclock_us, frame->keyframe);
+		}
+		catch (std::exception const &e)
+		{
+			std::cerr << "WARNING: TeeOutput: output failed: " << e.what() << std::endl;
+			std::lock_guard<std::mutex> lock(mutex_);
+			child->failed = true;
+			child->queue.clear();
+		}
+	}
+}
@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * tee_output.hpp - pass the encoded stream on to several outputs at once.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+
+// Each output added to the tee gets its own queue and thread, so a slow one
+// (a stalled network client, say) never holds up the others. Every frame is
+// copied once into a reference counted buffer that all the queues share.
+//
+// When an output's queue is full, it misses frames until the next keyframe
+// so that what it does get still decodes.
+//
+// Outputs are given frames through their own OutputReady(), with the original
+// timestamps, so each does its own pausing and sees its own restarts (for
+// --split, say). The tee itself never pauses, but passes Signal() on to all its
+// outputs. They should be created with options from ChildOptions() so that they
+// can be given their own filenames.
+
+class TeeOutput : public Output
+{
+public:
+	TeeOutput(VideoOptions const *options);
+	~TeeOutput();
+	void Signal() override;
+	// A copy of our options, to be modified as needed and given to an output that
+	// will then be added. The copy has no --save-pts, as the tee itself does that.
+	VideoOptions *ChildOptions();
+	// The tee takes ownership of the output.
+	void AddOutput(Output *output);
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, int64_t wallclock_us, uint32_t flags) override;
+
+private:
+	// The most frames that may be waiting for any one output.
+	static constexpr unsigned int QUEUE_LENGTH = 32;
+
+	struct Frame
+	{
+		std::vector<uint8_t> data;
+		int64_t timestamp_us; // the original, so each output can make its own continuous
+		int64_t wallclock_us;
+		bool keyframe;
+	};
+	struct Child
+	{
+		std::unique_ptr<Output> output;
+		std::deque<std::shared_ptr<Frame>> queue;
+		bool dropping;
+		bool failed;
+		std::thread thread;
+	};
+
+	void childThread(Child *child);
+
+	std::vector<std::unique_ptr<VideoOptions>> child_options_;
+	std::vector<std::unique_ptr<Child>> children_;
+	bool abort_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+};
@@ -0,0 +1,135 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ts_muxer.cpp - minimal MPEG-2 transport stream packetiser for H.264.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "ts_muxer.hpp"
+
+static uint32_t crc32_mpeg(uint8_t const *data, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	while (len--)
+	{
+		crc ^= (uint32_t)*data++ << 24;
+		for (int i = 0; i < 8; i++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+	}
+	return crc;
+}
+
+// Finish a PSI section: fill in the section_length and append the CRC.
+static void finish_section(std::vector<uint8_t> &section)
+{
+	size_t length = section.size() - 3 + 4;
+	section[1] = 0xb0 | ((length >> 8) & 0x0f);
+	section[2] = length & 0xff;
+	uint32_t crc = crc32_mpeg(section.data(), section.size());
+	section.push_back(crc >> 24);
+	section.push_back(crc >> 16);
+	section.push_back(crc >> 8);
+	section.push_back(crc);
+}
+
+TsMuxer::TsMuxer() : pat_cc_(0), pmt_cc_(0), video_cc_(0), last_psi_us_(0), psi_sent_(false)
+{
+	// A single program (number 1) whose PMT lives on PMT_PID.
+	pat_ = { 0x00, 0, 0, 0x00, 0x01, 0xc1, 0x00, 0x00, 0x00, 0x01,
+			 (uint8_t)(0xe0 | (PMT_PID >> 8)), (uint8_t)(PMT_PID & 0xff) };
+	finish_section(pat_);
+
+	// The PMT lists one H.264 elementary stream, which also carries the PCR.
+	pmt_ = { 0x02, 0, 0, 0x00, 0x01, 0xc1, 0x00, 0x00,
+			 (uint8_t)(0xe0 | (VIDEO_PID >> 8)), (uint8_t)(VIDEO_PID & 0xff), 0xf0, 0x00,
+			 0x1b, (uint8_t)(0xe0 | (VIDEO_PID >> 8)), (uint8_t)(VIDEO_PID & 0xff), 0xf0, 0x00 };
+	finish_section(pmt_);
+}
+
+void TsMuxer::Mux(void *mem, size_t size, int64_t timestamp_us, bool keyframe, std::vector<uint8_t> &out)
+{
+	if (!psi_sent_ || keyframe || timestamp_us - last_psi_us_ >= PSI_INTERVAL_US)
+	{
+		writePsi(0, pat_cc_, pat_, out);
+		writePsi(PMT_PID, pmt_cc_, pmt_, out);
+		last_psi_us_ = timestamp_us;
+		psi_sent_ = true;
+	}
+	writePes(static_cast<uint8_t const *>(mem), size, timestamp_us, keyframe, out);
+}
+
+void TsMuxer::writePsi(uint16_t pid, uint8_t &cc, std::vector<uint8_t> const &section, std::vector<uint8_t> &out)
+{
+	size_t pos = out.size();
+	out.resize(pos + PACKET_SIZE, 0xff);
+	uint8_t *p = &out[pos];
+	p[0] = 0x47;
+	p[1] = 0x40 | (pid >> 8);
+	p[2] = pid & 0xff;
+	p[3] = 0x10 | cc;
+	p[4] = 0; // pointer_field
+	memcpy(p + 5, section.data(), section.size());
+	cc = (cc + 1) & 0x0f;
+}
+
+void TsMuxer::writePes(uint8_t const *data, size_t size, int64_t timestamp_us, bool keyframe, std::vector<uint8_t> &out)
+{
+	// There are no B-frames, so a PTS alone will do. Video PES packets are
+	// allowed an unbounded (zero) length. We also prepend an access unit
+	// delimiter as some demuxers rely on it to find frame boundaries.
+	uint64_t pts = (uint64_t)(timestamp_us + PTS_DELAY_US) * 9 / 100;
+	uint8_t header[] = { 0x00, 0x00, 0x01, 0xe0, 0x00, 0x00, 0x80, 0x80, 0x05,
+						 (uint8_t)(0x21 | ((pts >> 29) & 0x0e)), (uint8_t)(pts >> 22),
+						 (uint8_t)(0x01 | ((pts >> 14) & 0xfe)), (uint8_t)(pts >> 7),
+						 (uint8_t)(0x01 | ((pts << 1) & 0xfe)),
+						 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+	pes_.resize(sizeof(header) + size);
+	memcpy(pes_.data(), header, sizeof(header));
+	memcpy(pes_.data() + sizeof(header), data, size);
+
+	uint64_t pcr = (uint64_t)timestamp_us * 27;
+	uint64_t pcr_base = pcr / 300, pcr_ext = pcr % 300;
+
+	for (size_t pos = 0; pos < pes_.size();)
+	{
+		bool first = pos == 0;
+		size_t remaining = pes_.size() - pos;
+
+		// The first packet of each frame carries the PCR (and the random access
+		// flag for keyframes) in its adaptation field. The last may need stuffing.
+		size_t af_total = first ? 8 : 0;
+		size_t payload = std::min(remaining, 184 - af_total);
+		if (payload < 184 - af_total)
+			af_total = 184 - payload;
+
+		size_t start = out.size();
+		out.resize(start + PACKET_SIZE, 0xff);
+		uint8_t *p = &out[start];
+		p[0] = 0x47;
+		p[1] = (first ? 0x40 : 0x00) | (VIDEO_PID >> 8);
+		p[2] = VIDEO_PID & 0xff;
+		p[3] = (af_total ? 0x30 : 0x10) | video_cc_;
+		video_cc_ = (video_cc_ + 1) & 0x0f;
+		if (af_total)
+		{
+			p[4] = af_total - 1;
+			if (af_total >= 2)
+				p[5] = 0x00;
+			if (first)
+			{
+				p[5] = (keyframe ? 0x40 : 0x00) | 0x10;
+				p[6] = pcr_base >> 25;
+				p[7] = pcr_base >> 17;
+				p[8] = pcr_base >> 9;
+				p[9] = pcr_base >> 1;
+				p[10] = ((pcr_base & 1) << 7) | 0x7e | (pcr_ext >> 8);
+				p[11] = pcr_ext & 0xff;
+			}
+		}
+		memcpy(p + 4 + af_total, &pes_[pos], payload);
+		pos += payload;
+	}
+}
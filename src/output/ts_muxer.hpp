@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ts_muxer.hpp - minimal MPEG-2 transport stream packetiser for H.264.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Wraps each encoded H.264 frame in a PES packet and chops it into 188-byte
+// transport stream packets. PAT/PMT are emitted before every keyframe (and at
+// least every PSI_INTERVAL_US), and the PCR is carried on the video PID,
+// derived from the encoder timestamps.
+
+class TsMuxer
+{
+public:
+	static constexpr unsigned int PACKET_SIZE = 188;
+
+	TsMuxer();
+	// Append the TS packets for this frame to out (which is not cleared first).
+	void Mux(void *mem, size_t size, int64_t timestamp_us, bool keyframe, std::vector<uint8_t> &out);
+
+private:
+	static constexpr uint16_t PMT_PID = 0x1000;
+	static constexpr uint16_t VIDEO_PID = 0x100;
+	static constexpr int64_t PSI_INTERVAL_US = 100000;
+	// Decoders need the PTS to run a little ahead of the PCR.
+	static constexpr int64_t PTS_DELAY_US = 100000;
+
+	void writePsi(uint16_t pid, uint8_t &cc, std::vector<uint8_t> const &section, std::vector<uint8_t> &out);
+	void writePes(uint8_t const *data, size_t size, int64_t timestamp_us, bool keyframe, std::vector<uint8_t> &out);
+
+	std::vector<uint8_t> pat_;
+	std::vector<uint8_t> pmt_;
+	uint8_t pat_cc_;
+	uint8_t pmt_cc_;
+	uint8_t video_cc_;
+	int64_t last_psi_us_;
+	bool psi_sent_;
+	std::vector<uint8_t> pes_;
+};
@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * bitrate_controller_test.cpp - tests for BitrateController.
+ */
+
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+#include "output/bitrate_controller.hpp"
+
+#include "tests/check.hpp"
+
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+static void test_decrease()
+{
+	BitrateController controller(1000000, 10000000, 0, false, "camera=\"0\"");
+	CHECK(controller.GetStats().bitrate == 10000000);
+
+	// 1MB queued is 800ms at 10Mbps, but it has to stay that way for a second.
+	Clock::time_point t = Clock::time_point() + 100s;
+	CHECK(controller.Update(1000000, t) == 0);
+	CHECK(controller.Update(1000000, t + 500ms) == 0);
+	CHECK(controller.Update(1000000, t + 1s) == 7000000);
+
+	// Then we wait to see what that did.
+	CHECK(controller.Update(1000000, t + 2s) == 0);
+	CHECK(controller.Update(1000000, t + 3s) == 4900000);
+
+	// Down to the minimum and no further.
+	uint32_t bitrate = 0;
+	for (int i = 5; i < 40; i += 2)
+	{
+		uint32_t new_bitrate = controller.Update(1000000, t + i * 1s);
+		if (new_bitrate)
+			bitrate = new_bitrate;
+	}
+	CHECK(bitrate == 1000000);
+	CHECK(controller.GetStats().bitrate == 1000000);
+	CHECK(controller.GetStats().decreases == 7);
+	CHECK(controller.GetStats().increases == 0);
+
+	// The metrics say the same.
+	std::string metrics = Metrics::Expose();
+	CHECK(metrics.find("libcamera_abr_bitrate{camera=\"0\"} 1e+06\n") != std::string::npos);
+	CHECK(metrics.find("libcamera_abr_queued_bytes{camera=\"0\"} 1e+06\n") != std::string::npos);
+	CHECK(metrics.find("libcamera_abr_changes_total{camera=\"0\",direction=\"down\"} 7\n") != std::string::npos);
+	CHECK(metrics.find("libcamera_abr_changes_total{camera=\"0\",direction=\"up\"} 0\n") != std::string::npos);
+}
+
+static void test_increase()
+{
+	BitrateController controller(1000000, 10000000, 2000000, false);
+	CHECK(controller.GetStats().bitrate == 2000000);
+
+	// An empty queue has to stay empty for a good while, then we step up slowly.
+	Clock::time_point t = Clock::time_point() + 100s;
+	CHECK(controller.Update(0, t) == 0);
+	CHECK(controller.Update(0, t + 9s) == 0);
+	CHECK(controller.Update(0, t + 10s) == 2500000);
+	CHECK(controller.Update(0, t + 15s) == 0);
+	CHECK(controller.Update(0, t + 20s) == 3000000);
+
+	// A backlog in between (here 100ms worth) starts the wait again.
+	CHECK(controller.Update(37500, t + 25s) == 0);
+	CHECK(controller.Update(0, t + 26s) == 0);
+	CHECK(controller.Update(0, t + 35s) == 0);
+	CHECK(controller.Update(0, t + 36s) == 3500000);
+	CHECK(controller.GetStats().increases == 3);
+}
+
+static void test_range()
+{
+	// The starting bitrate is kept within range.
+	CHECK(BitrateController(1000000, 10000000, 50000000, false).GetStats().bitrate == 10000000);
+	CHECK(BitrateController(1000000, 10000000, 500000, false).GetStats().bitrate == 1000000);
+
+	bool threw = false;
+	try
+	{
+		BitrateController controller(10000000, 1000000, 0, false);
+	}
+	catch (std::runtime_error const &)
+	{
+		threw = true;
+	}
+	CHECK(threw);
+}
+
+int main()
+{
+	test_decrease();
+	test_increase();
+	test_range();
+	return 0;
+}
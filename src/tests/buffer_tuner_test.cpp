@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * buffer_tuner_test.cpp - tests for BufferTuner.
+ */
+
+#include "core/buffer_tuner.hpp"
+
+#include "tests/check.hpp"
+
+static void update(BufferTuner &tuner, unsigned int frames, unsigned int held, unsigned int total)
+{
+	for (unsigned int i = 0; i < frames; i++)
+		tuner.Update(held, total);
+}
+
+static void test_settle()
+{
+	BufferTuner tuner(false);
+	CHECK(tuner.Count() == 6);
+
+	// Nothing changes until the warm-up is over, then we keep a margin over the most held.
+	update(tuner, 299, 2, 6);
+	CHECK(tuner.Count() == 6);
+	update(tuner, 1, 2, 6);
+	CHECK(tuner.Count() == 4);
+
+	// Holding every buffer means the camera is starving.
+	update(tuner, 1, 4, 4);
+	CHECK(tuner.Count() == 6);
+
+	// Once settled, we never shrink again.
+	update(tuner, 1000, 1, 6);
+	CHECK(tuner.Count() == 6);
+}
+
+static void test_starved_during_warmup()
+{
+	BufferTuner tuner(false);
+	update(tuner, 100, 6, 6);
+	CHECK(tuner.Count() == 8);
+
+	// The warm-up starts again, and only what's held since then counts.
+	update(tuner, 299, 3, 8);
+	CHECK(tuner.Count() == 8);
+	update(tuner, 1, 3, 8);
+	CHECK(tuner.Count() == 5);
+}
+
+static void test_limits()
+{
+	// Never fewer than the minimum...
+	BufferTuner tuner(false);
+	update(tuner, 300, 0, 6);
+	CHECK(tuner.Count() == 3);
+
+	// ...or more than the maximum, however starved.
+	update(tuner, 1, 3, 3);
+	CHECK(tuner.Count() == 5);
+	update(tuner, 1, 5, 5);
+	update(tuner, 1, 7, 7);
+	update(tuner, 1, 9, 9);
+	update(tuner, 1, 11, 11);
+	CHECK(tuner.Count() == 12);
+	update(tuner, 1, 12, 12);
+	CHECK(tuner.Count() == 12);
+}
+
+int main()
+{
+	test_settle();
+	test_starved_during_warmup();
+	test_limits();
+	return 0;
+}
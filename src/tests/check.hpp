@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * check.hpp - minimal checks for the unit tests.
+ */
+
+#pragma once
+
+#include <cstdlib>
+#include <iostream>
+
+// Stop at the first failure, saying where it was.
+#define CHECK(cond)                                                                                                    \
+	do                                                                                                                 \
+	{                                                                                                                  \
+		if (!(cond))                                                                                                   \
+		{                                                                                                              \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl;                     \
+			std::exit(1);                                                                                              \
+		}                                                                                                              \
+	} while (0)
@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * circular_buffer_test.cpp - tests for CircularBuffer.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+
+#include "output/circular_buffer.hpp"
+
+#include "tests/check.hpp"
+
+static size_t put(CircularBuffer &buffer, size_t n, uint8_t value)
+{
+	uint8_t *dest = buffer.Reserve(n);
+	CHECK(dest);
+	memset(dest, value, n);
+	buffer.Commit(n);
+	return buffer.Offset(dest);
+}
+
+static bool holds(CircularBuffer const &buffer, size_t pos, size_t n, uint8_t value)
+{
+	for (size_t i = 0; i < n; i++)
+		if (buffer.Data(pos)[i] != value)
+			return false;
+	return true;
+}
+
+static void test_wrap()
+{
+	CircularBuffer buffer(100);
+	CHECK(buffer.Empty());
+
+	CHECK(put(buffer, 40, 1) == 0);
+	CHECK(put(buffer, 40, 2) == 40);
+	// Doesn't fit at the end, and the start is still in use.
+	CHECK(!buffer.Reserve(30));
+
+	// Once the start is free the record goes there, leaving the end unused.
+	buffer.Release(40);
+	CHECK(put(buffer, 30, 3) == 0);
+	CHECK(buffer.ReadPtr() == 40 && buffer.WritePtr() == 30);
+	CHECK(buffer.Contiguous(40) == 40);
+	CHECK(buffer.Next(40, 40) == 0);
+	CHECK(holds(buffer, 40, 40, 2) && holds(buffer, 0, 30, 3));
+
+	// The write pointer may not catch up with the read pointer.
+	CHECK(!buffer.Reserve(10));
+	CHECK(buffer.Reserve(9));
+
+	// Releasing the record before the unused space takes us back to the start.
+	buffer.Release(40);
+	CHECK(buffer.ReadPtr() == 0);
+	CHECK(buffer.Contiguous(0) == 30);
+
+	// Filling right up to the read pointer would make us look empty.
+	CHECK(!buffer.Reserve(70));
+	CHECK(put(buffer, 69, 4) == 30);
+	CHECK(!buffer.Empty());
+}
+
+static void test_full_end()
+{
+	CircularBuffer buffer(100);
+	put(buffer, 30, 1);
+	put(buffer, 30, 2);
+	CHECK(!buffer.Reserve(40));
+
+	// A record may exactly fill the end, so long as the start is free.
+	buffer.Release(30);
+	CHECK(put(buffer, 40, 3) == 60);
+	CHECK(buffer.WritePtr() == 0 && buffer.ReadPtr() == 30);
+
+	// Once empty, we start again from the beginning.
+	buffer.Release(30);
+	buffer.Release(40);
+	CHECK(buffer.Empty());
+	CHECK(put(buffer, 99, 4) == 0);
+}
+
+static void test_truncate()
+{
+	CircularBuffer buffer(100);
+	size_t first = put(buffer, 20, 1);
+	size_t second = put(buffer, 20, 2);
+	put(buffer, 20, 3);
+	buffer.Truncate(second);
+	CHECK(buffer.WritePtr() == second && buffer.ReadPtr() == first);
+	CHECK(put(buffer, 10, 4) == second);
+	buffer.Clear();
+	CHECK(buffer.Empty());
+}
+
+static void test_file()
+{
+	char tmpl[] = "/tmp/circular_buffer_testXXXXXX";
+	CHECK(mkdtemp(tmpl));
+	std::string filename = std::string(tmpl) + "/buffer";
+
+	{
+		CircularBuffer buffer(8192, filename);
+		CHECK(!buffer.Recovered());
+		put(buffer, 5000, 1);
+		put(buffer, 2000, 2);
+		buffer.Release(5000);
+		put(buffer, 3000, 3);
+	}
+
+	// What was in the buffer is still there, wrap and all, whatever size we ask for.
+	{
+		CircularBuffer buffer(4096, filename);
+		CHECK(buffer.Recovered());
+		CHECK(buffer.Size() == 8192);
+		CHECK(buffer.ReadPtr() == 5000 && buffer.WritePtr() == 3000);
+		CHECK(buffer.Contiguous(5000) == 2000);
+		CHECK(buffer.Next(5000, 2000) == 0);
+		CHECK(holds(buffer, 5000, 2000, 2) && holds(buffer, 0, 3000, 3));
+	}
+
+	unlink(filename.c_str());
+	rmdir(tmpl);
+}
+
+int main()
+{
+	test_wrap();
+	test_full_end();
+	test_truncate();
+	test_file();
+	return 0;
+}
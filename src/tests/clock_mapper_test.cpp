@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * clock_mapper_test.cpp - tests for ClockMapper.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "core/clock_mapper.hpp"
+
+#include "tests/check.hpp"
+
+static constexpr int64_t FRAME_NS = 33333333;
+
+// Delivery latencies between 100us and 5ms, the same every run.
+static int64_t latency_ns()
+{
+	static uint32_t seed = 1;
+	seed = seed * 1103515245 + 12345;
+	return 100000 + (seed >> 8) % 4900000;
+}
+
+static void test_offset()
+{
+	ClockMapper mapper;
+	CHECK(mapper.Map(12345) == 12345);
+
+	// The reference clock is 1s ahead, but we only ever see it late.
+	int64_t max_error = 0;
+	for (int64_t t = 0; t < 40 * 1000000000LL; t += FRAME_NS)
+	{
+		mapper.Update(t, t + 1000000000 + latency_ns());
+		if (t > 5 * 1000000000LL)
+			max_error = std::max<int64_t>(max_error, std::llabs(mapper.Map(t) - (t + 1000000000)));
+	}
+	// Mapped times keep the smallest latency in each window, a few hundred us here.
+	CHECK(max_error < 1000000);
+	CHECK(std::fabs(mapper.DriftPpm()) < 5);
+}
+
+static void test_drift()
+{
+	// The reference clock runs 50ppm fast.
+	ClockMapper mapper;
+	int64_t max_error = 0;
+	for (int64_t t = 0; t < 60 * 1000000000LL; t += FRAME_NS)
+	{
+		int64_t reference = t + t / 20000;
+		mapper.Update(t, reference + latency_ns());
+		if (t > 40 * 1000000000LL)
+			max_error = std::max<int64_t>(max_error, std::llabs(mapper.Map(t) - reference));
+	}
+	CHECK(std::fabs(mapper.DriftPpm() - 50) < 5);
+	CHECK(max_error < 1000000);
+}
+
+static void test_no_steps()
+{
+	// Without a max_step_ns, a reading far off the line is just a late one.
+	ClockMapper mapper;
+	for (int64_t t = 0; t < 5 * 1000000000LL; t += FRAME_NS)
+		CHECK(!mapper.Update(t, t + 100000));
+	CHECK(!mapper.Update(5 * 1000000000LL, 5 * 1000000000LL + 900000000));
+	CHECK(std::llabs(mapper.Map(6 * 1000000000LL) - (6 * 1000000000LL + 100000)) < 1000);
+}
+
+static void test_steps()
+{
+	// CLOCK_REALTIME is read close to CLOCK_MONOTONIC, so is never far off the line...
+	ClockMapper mapper(5000000);
+	int64_t offset_ns = 1700000000LL * 1000000000LL;
+	int64_t t = 0;
+	for (; t < 5 * 1000000000LL; t += FRAME_NS)
+		CHECK(!mapper.Update(t, t + offset_ns + 20000));
+
+	// ...unless we're preempted at the wrong moment, which mustn't count as a step.
+	CHECK(!mapper.Update(t, t + offset_ns + 30000000));
+	t += FRAME_NS;
+	CHECK(!mapper.Update(t, t + offset_ns - 30000000));
+	t += FRAME_NS;
+	CHECK(!mapper.Update(t, t + offset_ns + 20000));
+	CHECK(std::llabs(mapper.Map(t) - (t + offset_ns)) < 100000);
+
+	// A step lasts, and we start again from where the clock is now.
+	offset_ns -= 3600 * 1000000000LL;
+	unsigned int steps = 0;
+	for (int i = 0; i < 10; i++, t += FRAME_NS)
+		steps += mapper.Update(t, t + offset_ns + 20000);
+	CHECK(steps == 1);
+	CHECK(std::llabs(mapper.Map(t) - (t + offset_ns)) < 100000);
+}
+
+int main()
+{
+	test_offset();
+	test_drift();
+	test_no_steps();
+	test_steps();
+	return 0;
+}
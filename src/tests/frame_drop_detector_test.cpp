@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * frame_drop_detector_test.cpp - tests for FrameDropDetector.
+ */
+
+#include <sstream>
+#include <string>
+
+#include "core/frame_drop_detector.hpp"
+
+#include "tests/check.hpp"
+
+static constexpr int64_t FRAME_US = 33333;
+
+// How many drops the metrics show for the stream and cause.
+static uint64_t drops(std::string const &stream, std::string const &cause)
+{
+	std::string key = "libcamera_frame_drops_total{camera=\"0\",stream=\"" + stream + "\",cause=\"" + cause + "\"} ";
+	std::istringstream metrics(Metrics::Expose());
+	for (std::string line; std::getline(metrics, line);)
+		if (line.compare(0, key.size(), key) == 0)
+			return std::stoull(line.substr(key.size()));
+	return 0;
+}
+
+static unsigned int frame(FrameDropDetector &detector, unsigned int sequence, unsigned int frame_number,
+						  bool error = false)
+{
+	std::map<std::string, FrameDropDetector::StreamFrame> streams;
+	streams["video"] = { sequence, error };
+	return detector.FrameCompleted(streams, 1000000000 + frame_number * FRAME_US * 1000, FRAME_US);
+}
+
+int main()
+{
+	FrameDropDetector detector;
+	detector.Start(FRAME_US, 1, "camera=\"0\"");
+
+	// Keep a request queued behind each one that completes.
+	detector.RequestQueued();
+	CHECK(frame(detector, 10, 0) == 0);
+	detector.RequestQueued();
+	CHECK(frame(detector, 11, 1) == 0);
+
+	// The sequence numbers jumped although we had requests queued.
+	detector.RequestQueued();
+	CHECK(frame(detector, 14, 4) == 2);
+	CHECK(drops("video", "pipeline") == 2);
+
+	// The sequence numbers didn't jump but the timestamps did.
+	detector.RequestQueued();
+	CHECK(frame(detector, 15, 7) == 2);
+	CHECK(drops("video", "sensor") == 2);
+
+	// A frame that takes a little longer than usual isn't a drop.
+	detector.RequestQueued();
+	CHECK(frame(detector, 16, 8) == 0);
+
+	// Nothing is queued after this one, so whatever is lost next is starvation.
+	CHECK(frame(detector, 17, 9) == 0);
+	detector.RequestQueued();
+	detector.RequestQueued();
+	CHECK(frame(detector, 20, 12) == 2);
+	CHECK(drops("video", "starvation") == 2);
+	CHECK(drops("video", "pipeline") == 2);
+
+	// Frames that complete with an error count as pipeline drops, but aren't
+	// reported as lost before this frame.
+	detector.RequestQueued();
+	CHECK(frame(detector, 21, 13, true) == 0);
+	CHECK(drops("video", "pipeline") == 3);
+
+	// Without sequence numbers, only the timestamps can tell us anything.
+	std::map<std::string, FrameDropDetector::StreamFrame> streams;
+	streams["raw"] = { std::nullopt, false };
+	detector.RequestQueued();
+	CHECK(detector.FrameCompleted(streams, 1000000000 + 16 * FRAME_US * 1000, 0) == 2);
+	CHECK(drops("raw", "sensor") == 2);
+
+	// Cancellations only count while the camera is running.
+	CHECK(detector.RequestsQueued() == 1);
+	detector.RequestCancelled();
+	detector.Stop();
+	detector.RequestQueued();
+	detector.RequestCancelled();
+	CHECK(Metrics::Expose().find("libcamera_requests_cancelled_total{camera=\"0\"} 1\n") != std::string::npos);
+	CHECK(detector.RequestsQueued() == 0);
+
+	return 0;
+}
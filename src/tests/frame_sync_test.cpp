@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * frame_sync_test.cpp - tests for FrameSync.
+ */
+
+#include <memory>
+
+#include "core/frame_sync.hpp"
+
+#include "tests/check.hpp"
+
+static constexpr int64_t MS = 1000000;
+
+static CompletedRequestPtr frame(int64_t timestamp_ns)
+{
+	CompletedRequestPtr frame =
+		std::make_shared<CompletedRequest>(0, CompletedRequest::BufferMap(), CompletedRequest::ControlList());
+	frame->monotonic_timestamp = timestamp_ns;
+	return frame;
+}
+
+static void test_match()
+{
+	FrameSync sync({ 0, 1 }, 1 * MS, 2);
+
+	// A set needs a frame from every camera.
+	CHECK(sync.Add(0, frame(1000 * MS)).empty());
+	std::vector<FrameSync::FrameSet> sets = sync.Add(1, frame(1000 * MS + MS / 2));
+	CHECK(sets.size() == 1);
+	CHECK(sets[0].timestamp_ns == 1000 * MS && sets[0].skew_ns == MS / 2);
+	CHECK(sets[0].frames.size() == 2);
+	CHECK(sets[0].frames[0]->monotonic_timestamp == 1000 * MS);
+	CHECK(sets[0].frames[1]->monotonic_timestamp == 1000 * MS + MS / 2);
+
+	// Too far apart, so the earlier frame can never be matched.
+	CHECK(sync.Add(1, frame(1033 * MS)).empty());
+	CHECK(sync.Add(0, frame(1040 * MS)).empty());
+	sets = sync.Add(1, frame(1040 * MS + MS / 4));
+	CHECK(sets.size() == 1);
+	CHECK(sets[0].frames[0]->monotonic_timestamp == 1040 * MS);
+
+	FrameSync::Stats stats = sync.GetStats();
+	CHECK(stats.sets == 2);
+	CHECK(stats.unmatched.size() == 2 && stats.unmatched[0] == 0 && stats.unmatched[1] == 1);
+	CHECK(stats.mean_skew_ns == (MS / 2 + MS / 4) / 2);
+	CHECK(stats.max_skew_ns == MS / 2);
+}
+
+static void test_stall()
+{
+	FrameSync sync({ 0, 1, 2 }, 1 * MS, 2);
+
+	// Camera 2 has stopped, so the others only keep their latest frames.
+	for (int i = 0; i < 5; i++)
+	{
+		CHECK(sync.Add(0, frame(i * 33 * MS)).empty());
+		CHECK(sync.Add(1, frame(i * 33 * MS)).empty());
+	}
+	FrameSync::Stats stats = sync.GetStats();
+	CHECK(stats.unmatched[0] == 3 && stats.unmatched[1] == 3 && stats.unmatched[2] == 0);
+
+	// When it comes back, the oldest frames still waiting match up.
+	std::vector<FrameSync::FrameSet> sets = sync.Add(2, frame(3 * 33 * MS));
+	CHECK(sets.size() == 1 && sets[0].timestamp_ns == 3 * 33 * MS && sets[0].skew_ns == 0);
+
+	// Flushing forgets the rest.
+	sync.Flush();
+	stats = sync.GetStats();
+	CHECK(stats.unmatched[0] == 4 && stats.unmatched[1] == 4);
+	CHECK(sync.Add(2, frame(4 * 33 * MS)).empty());
+}
+
+int main()
+{
+	test_match();
+	test_stall();
+	return 0;
+}
@@ -0,0 +1,140 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * recording_index_test.cpp - tests for RecordingIndex.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+#include "output/recording_index.hpp"
+
+#include "tests/check.hpp"
+
+int main()
+{
+	char tmpl[] = "/tmp/recording_index_testXXXXXX";
+	CHECK(mkdtemp(tmpl));
+	std::string dir = tmpl;
+	std::string filename = dir + "/index";
+
+	{
+		RecordingIndex index(filename, dir + "/v%04d.h264", 3);
+		CHECK(index.Size() == 0);
+		CHECK(index.NextSegment() == 0);
+
+		RecordingIndex::Record record;
+		CHECK(!index.Find(1000, record));
+
+		// Enough keyframes to make the file grow a couple of times.
+		for (unsigned int i = 0; i < 40000; i++)
+			index.Append({ 1000 + i * 1000, i * 33333, i * 100ULL, i / 100, RecordingIndex::FLAG_KEYFRAME });
+		CHECK(index.Size() == 40000);
+		CHECK(index.NextSegment() == 400);
+
+		// With --wrap 3, only the last 3 segments (397 to 399) still have files.
+		CHECK(index.FirstSegment() == 397);
+		CHECK(!index.Find(999, record));
+		CHECK(!index.Find(1000, record));
+		CHECK(!index.Find(39700000, record));
+		CHECK(index.Find(39701000, record) && record.offset == 39700 * 100ULL && record.segment == 397);
+		CHECK(index.Find(39701999, record) && record.offset == 39700 * 100ULL);
+		CHECK(index.Find(39702000, record) && record.offset == 39701 * 100ULL);
+		CHECK(index.Find(1000000000, record) && record.offset == 39999 * 100ULL);
+		CHECK(record.segment == 399 && record.timestamp_us == 39999 * 33333);
+		CHECK(index[0].offset == 0);
+
+		CHECK(index.Filename(4) == dir + "/v0001.h264");
+	}
+
+	// Reopening keeps what's there, and segment numbers carry on.
+	{
+		RecordingIndex index(filename, dir + "/v%04d.h264", 3);
+		CHECK(index.Size() == 40000);
+		CHECK(index.NextSegment() == 400);
+		CHECK(index[123].wallclock_us == 124000);
+	}
+
+	// A reader can't open it for a different output, and can open it without one.
+	bool threw = false;
+	try
+	{
+		RecordingIndex index(filename, dir + "/other%04d.h264", 3);
+	}
+	catch (std::runtime_error const &)
+	{
+		threw = true;
+	}
+	CHECK(threw);
+	{
+		RecordingIndex index(filename);
+		CHECK(index.Size() == 40000);
+	}
+
+	// Records from before the last one (the clock was stepped back) aren't added,
+	// so that searches still work.
+	std::string stepped = dir + "/stepped";
+	{
+		RecordingIndex index(stepped, dir + "/v%04d.h264");
+		CHECK(index.Append({ 5000, 0, 0, 0, RecordingIndex::FLAG_KEYFRAME }));
+		CHECK(index.Append({ 6000, 1, 100, 0, RecordingIndex::FLAG_KEYFRAME }));
+		CHECK(!index.Append({ 2000, 2, 200, 0, RecordingIndex::FLAG_KEYFRAME }));
+		CHECK(index.Append({ 6000, 3, 300, 1, RecordingIndex::FLAG_KEYFRAME }));
+		CHECK(index.Size() == 3);
+		CHECK(index.NextSegment() == 2);
+		RecordingIndex::Record record;
+		CHECK(!index.Find(2000, record));
+		CHECK(index.Find(6500, record) && record.offset == 300);
+		CHECK(index.FirstSegment() == 0);
+	}
+
+	// Without --wrap, segments only go when they're deleted.
+	std::string retired = dir + "/retired";
+	{
+		RecordingIndex index(retired, dir + "/v%04d.h264");
+		for (unsigned int i = 0; i < 10; i++)
+			index.Append({ 1000 + i * 1000, i * 33333, i * 100ULL, i / 2, RecordingIndex::FLAG_KEYFRAME });
+		index.Retire(5000);
+		RecordingIndex::Record record;
+		CHECK(!index.Find(4500, record));
+		CHECK(index.Find(5000, record) && record.segment == 2);
+		// The time of deletion never goes backwards.
+		index.Retire(2000);
+		CHECK(!index.Find(4500, record));
+	}
+	{
+		RecordingIndex index(retired);
+		RecordingIndex::Record record;
+		CHECK(!index.Find(4500, record));
+		CHECK(index.Find(5000, record) && record.segment == 2);
+	}
+
+	// Something that isn't an index is rejected.
+	std::string bad = dir + "/bad";
+	FILE *fp = fopen(bad.c_str(), "w");
+	CHECK(fp);
+	fprintf(fp, "%0600d", 0);
+	fclose(fp);
+	threw = false;
+	try
+	{
+		RecordingIndex index(bad);
+	}
+	catch (std::runtime_error const &)
+	{
+		threw = true;
+	}
+	CHECK(threw);
+
+	unlink(bad.c_str());
+	unlink(stepped.c_str());
+	unlink(retired.c_str());
+	unlink(filename.c_str());
+	rmdir(dir.c_str());
+	return 0;
+}
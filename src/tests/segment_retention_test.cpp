@@ -0,0 +1,139 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * segment_retention_test.cpp - tests for SegmentRetention.
+ */
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+#include "output/segment_retention.hpp"
+
+#include "tests/check.hpp"
+
+static std::string dir;
+
+static std::string make_file(char const *name)
+{
+	std::string filename = dir + "/" + name;
+	FILE *fp = fopen(filename.c_str(), "w");
+	CHECK(fp);
+	fclose(fp);
+	return filename;
+}
+
+static bool exists(std::string const &filename)
+{
+	return access(filename.c_str(), F_OK) == 0;
+}
+
+int main()
+{
+	char tmpl[] = "/tmp/segment_retention_testXXXXXX";
+	CHECK(mkdtemp(tmpl));
+	dir = tmpl;
+	std::string index = dir + "/.segments";
+
+	{
+		// Over the size budget, the oldest segments go first.
+		SegmentRetention retention(index, 250, 0, false);
+		std::string a = make_file("a"), b = make_file("b"), c = make_file("c");
+		retention.Add(a, 100, 0, 1000);
+		retention.Add(b, 100, 1000, 2000);
+		CHECK(exists(a) && exists(b));
+		CHECK(retention.DeletedUntilMs() == 0);
+		retention.Add(c, 100, 2000, 3000);
+		CHECK(!exists(a) && exists(b) && exists(c));
+		CHECK(retention.DeletedUntilMs() == 1000);
+
+		// A forgotten segment is never deleted, even when it's the oldest.
+		retention.Forget(b);
+		std::string d = make_file("d"), e = make_file("e");
+		retention.Add(d, 100, 3000, 4000);
+		retention.Add(e, 100, 4000, 5000);
+		CHECK(exists(b) && !exists(c) && exists(d) && exists(e));
+
+		// The most recent segment is kept whatever it costs.
+		std::string f = make_file("f");
+		retention.Add(f, 1000, 5000, 6000);
+		CHECK(!exists(d) && !exists(e) && exists(f));
+	}
+
+	{
+		// The index brings back what was being tracked.
+		SegmentRetention retention(index, 250, 0, false);
+		std::string g = make_file("g");
+		retention.Add(g, 100, 6000, 7000);
+		CHECK(!exists(dir + "/f") && exists(g));
+		CHECK(exists(dir + "/b"));
+	}
+
+	{
+		// Segments that ended too long ago go too.
+		SegmentRetention retention(index, 0, 2000, false);
+		std::string h = make_file("h"), i = make_file("i");
+		retention.Add(h, 100, 7000, 8000);
+		CHECK(exists(dir + "/g") && exists(h));
+		retention.Add(i, 100, 9500, 10000);
+		CHECK(!exists(dir + "/g") && exists(h) && exists(i));
+	}
+
+	{
+		// A segment that can't be deleted is kept, and tried again next time.
+		SegmentRetention retention(index, 150, 0, false);
+		std::string j = dir + "/j", k = make_file("k");
+		CHECK(mkdir(j.c_str(), 0755) == 0 && exists(make_file("j/x")));
+		retention.Add(j, 100, 10000, 11000);
+		retention.Add(k, 100, 11000, 12000);
+		CHECK(!exists(dir + "/h") && !exists(dir + "/i") && exists(j) && exists(k));
+		unlink((j + "/x").c_str());
+		rmdir(j.c_str());
+		make_file("j");
+		std::string l = make_file("l");
+		retention.Add(l, 100, 12000, 13000);
+		CHECK(!exists(j) && !exists(k) && exists(l));
+	}
+
+	{
+		// When the index can't be rewritten, the old one carries on.
+		SegmentRetention retention(index, 0, 0, false);
+		std::string tmp_file = index + ".tmp";
+		CHECK(mkdir(tmp_file.c_str(), 0755) == 0);
+		bool failed = false;
+		for (int n = 0; n < 200; n++)
+		{
+			std::string m = make_file("m");
+			try
+			{
+				retention.Add(m, 1, 13000 + n, 13000 + n);
+			}
+			catch (std::exception const &e)
+			{
+				failed = true;
+			}
+			retention.Forget(m);
+		}
+		CHECK(failed);
+		rmdir(tmp_file.c_str());
+		std::string n = make_file("n");
+		retention.Add(n, 1, 14000, 15000);
+	}
+
+	{
+		SegmentRetention retention(index, 1, 0, false);
+		std::string o = make_file("o");
+		retention.Add(o, 1, 15000, 16000);
+		CHECK(!exists(dir + "/l") && exists(dir + "/m") && !exists(dir + "/n") && exists(o));
+	}
+
+	for (char const *name : { "b", "m", "o", ".segments" })
+		unlink((dir + "/" + name).c_str());
+	rmdir(dir.c_str());
+	return 0;
+}
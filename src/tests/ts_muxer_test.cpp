@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ts_muxer_test.cpp - tests for TsMuxer.
+ */
+
+#include <cstdint>
+#include <vector>
+
+#include "output/ts_muxer.hpp"
+
+#include "tests/check.hpp"
+
+static constexpr size_t PACKET_SIZE = TsMuxer::PACKET_SIZE;
+
+static unsigned int pid(uint8_t const *p)
+{
+	return ((p[1] & 0x1f) << 8) | p[2];
+}
+
+static uint32_t crc32_mpeg(uint8_t const *data, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	while (len--)
+	{
+		crc ^= (uint32_t)*data++ << 24;
+		for (int i = 0; i < 8; i++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+	}
+	return crc;
+}
+
+// A PSI section, CRC included, gives a CRC of zero.
+static void check_psi(uint8_t const *p)
+{
+	CHECK(p[1] & 0x40); // payload_unit_start
+	uint8_t const *section = p + 5;
+	size_t length = (((section[1] & 0x0f) << 8) | section[2]) + 3;
+	CHECK(length <= PACKET_SIZE - 5);
+	CHECK(crc32_mpeg(section, length) == 0);
+}
+
+// The video payload of the packets, with adaptation fields stripped.
+static std::vector<uint8_t> video_payload(std::vector<uint8_t> const &out, unsigned int &packets)
+{
+	std::vector<uint8_t> payload;
+	packets = 0;
+	for (size_t pos = 0; pos < out.size(); pos += PACKET_SIZE)
+	{
+		uint8_t const *p = &out[pos];
+		if (pid(p) != 0x100)
+			continue;
+		size_t start = 4;
+		if (p[3] & 0x20)
+			start += 1 + p[4];
+		payload.insert(payload.end(), p + start, p + PACKET_SIZE);
+		packets++;
+	}
+	return payload;
+}
+
+int main()
+{
+	TsMuxer muxer;
+	std::vector<uint8_t> frame(1000);
+	for (size_t i = 0; i < frame.size(); i++)
+		frame[i] = i * 7;
+
+	// A keyframe gets a PAT and PMT ahead of it, and the PES packet is split into whole TS packets.
+	std::vector<uint8_t> out;
+	int64_t timestamp_us = 1000000;
+	muxer.Mux(frame.data(), frame.size(), timestamp_us, true, out);
+	CHECK(out.size() % PACKET_SIZE == 0);
+	for (size_t pos = 0; pos < out.size(); pos += PACKET_SIZE)
+		CHECK(out[pos] == 0x47);
+	CHECK(pid(&out[0]) == 0);
+	check_psi(&out[0]);
+	CHECK(pid(&out[PACKET_SIZE]) == 0x1000);
+	check_psi(&out[PACKET_SIZE]);
+
+	// The first video packet starts the PES packet and carries the PCR and random access flag.
+	uint8_t const *first = &out[2 * PACKET_SIZE];
+	CHECK(pid(first) == 0x100);
+	CHECK(first[1] & 0x40);
+	CHECK((first[3] & 0x30) == 0x30);
+	CHECK(first[5] & 0x40);
+	CHECK(first[5] & 0x10);
+	uint64_t pcr_base = ((uint64_t)first[6] << 25) | (first[7] << 17) | (first[8] << 9) | (first[9] << 1) |
+						(first[10] >> 7);
+	CHECK(pcr_base == (uint64_t)timestamp_us * 9 / 100);
+
+	// The PES header has the PTS a little ahead, then an access unit delimiter, then the frame itself.
+	unsigned int packets;
+	std::vector<uint8_t> payload = video_payload(out, packets);
+	CHECK(payload[0] == 0 && payload[1] == 0 && payload[2] == 1 && payload[3] == 0xe0);
+	uint64_t pts = ((uint64_t)(payload[9] & 0x0e) << 29) | (payload[10] << 22) | ((payload[11] & 0xfe) << 14) |
+				   (payload[12] << 7) | (payload[13] >> 1);
+	CHECK(pts == (uint64_t)(timestamp_us + 100000) * 9 / 100);
+	size_t header_size = 14 + 6;
+	CHECK(payload.size() == header_size + frame.size());
+	CHECK(std::vector<uint8_t>(payload.begin() + header_size, payload.end()) == frame);
+
+	// Continuity counters carry on from one frame to the next. A P-frame soon after
+	// gets no PSI and no random access flag.
+	unsigned int last_cc = out[out.size() - PACKET_SIZE + 3] & 0x0f;
+	out.clear();
+	muxer.Mux(frame.data(), 100, timestamp_us + 33333, false, out);
+	CHECK(out.size() == PACKET_SIZE);
+	CHECK(pid(&out[0]) == 0x100);
+	CHECK((out[3] & 0x0f) == ((last_cc + 1) & 0x0f));
+	CHECK(!(out[5] & 0x40));
+
+	// But PSI is repeated at least every 100ms.
+	out.clear();
+	muxer.Mux(frame.data(), 100, timestamp_us + 200000, false, out);
+	CHECK(pid(&out[0]) == 0);
+	CHECK(pid(&out[PACKET_SIZE]) == 0x1000);
+
+	return 0;
+}
@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * circular_bench.cpp - compare the circular buffer against the old two-piece ring.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "output/circular_buffer.hpp"
+
+// Usage: circular-bench [buffer MB] [frames]
+//
+// Pushes the same sequence of frames (a large keyframe every 30, smaller ones in
+// between) through each buffer the way CircularOutput does, evicting the oldest
+// frames to make space, and then dumps the whole buffer to /dev/null. Reports
+// the time per frame for each, and the number of write() calls for the dump.
+
+static constexpr size_t ALIGN = 16;
+
+struct Header
+{
+	unsigned int length;
+	bool keyframe;
+	int64_t timestamp;
+};
+
+// The buffer as it was, where records may be split across the end.
+class OldBuffer
+{
+public:
+	OldBuffer(size_t size) : size_(size), buf_(size), rptr_(0), wptr_(0) {}
+	bool Empty() const { return rptr_ == wptr_; }
+	size_t Available() const { return wptr_ == rptr_ ? size_ - 1 : (size_ - wptr_ + rptr_) % size_ - 1; }
+	void Skip(unsigned int n) { rptr_ = (rptr_ + n) % size_; }
+	void Read(std::function<void(void *src, unsigned int n)> dst, unsigned int n)
+	{
+		if (rptr_ + n >= size_)
+		{
+			dst(&buf_[rptr_], size_ - rptr_);
+			n -= size_ - rptr_;
+			rptr_ = 0;
+		}
+		dst(&buf_[rptr_], n);
+		rptr_ += n;
+	}
+	void Pad(unsigned int n) { wptr_ = (wptr_ + n) % size_; }
+	void Write(const void *ptr, unsigned int n)
+	{
+		if (wptr_ + n >= size_)
+		{
+			memcpy(&buf_[wptr_], ptr, size_ - wptr_);
+			n -= size_ - wptr_;
+			ptr = static_cast<const uint8_t *>(ptr) + size_ - wptr_;
+			wptr_ = 0;
+		}
+		memcpy(&buf_[wptr_], ptr, n);
+		wptr_ += n;
+	}
+
+private:
+	const size_t size_;
+	std::vector<uint8_t> buf_;
+	size_t rptr_, wptr_;
+};
+
+static void readHeader(OldBuffer &cb, Header &header)
+{
+	uint8_t *dst = (uint8_t *)&header;
+	cb.Read(
+		[&dst](void *src, int n) {
+			memcpy(dst, src, n);
+			dst += n;
+		},
+		sizeof(header));
+}
+
+static size_t recordSize(size_t length)
+{
+	return sizeof(Header) + ((length + ALIGN - 1) & ~(ALIGN - 1));
+}
+
+template <typename F>
+static double timeIt(F f)
+{
+	auto start = std::chrono::steady_clock::now();
+	f();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+	size_t buffer_size = (argc > 1 ? atoi(argv[1]) : 64) << 20;
+	unsigned int num_frames = argc > 2 ? atoi(argv[2]) : 20000;
+
+	std::mt19937 rng(1);
+	std::vector<unsigned int> sizes(num_frames);
+	for (unsigned int i = 0; i < num_frames; i++)
+		sizes[i] = i % 30 ? 8000 + rng() % 24000 : 150000 + rng() % 50000;
+	std::vector<uint8_t> data(256 << 10, 0x55);
+	int fd = open("/dev/null", O_WRONLY);
+
+	OldBuffer old_cb(buffer_size);
+	double old_write = timeIt([&]() {
+		for (unsigned int i = 0; i < num_frames; i++)
+		{
+			unsigned int pad = (ALIGN - sizes[i]) & (ALIGN - 1);
+			while (sizes[i] + pad + sizeof(Header) > old_cb.Available())
+			{
+				Header header;
+				readHeader(old_cb, header);
+				old_cb.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
+			}
+			Header header = { sizes[i], i % 30 == 0, i * 33333LL };
+			old_cb.Write(&header, sizeof(header));
+			old_cb.Write(data.data(), sizes[i]);
+			old_cb.Pad(pad);
+		}
+	});
+	unsigned int old_calls = 0;
+	double old_dump = timeIt([&]() {
+		while (!old_cb.Empty())
+		{
+			Header header;
+			readHeader(old_cb, header);
+			old_cb.Read(
+				[fd, &old_calls](void *src, int n) {
+					old_calls++;
+					if (write(fd, src, n) != n)
+						throw std::runtime_error("write failed");
+				},
+				header.length);
+			old_cb.Skip((ALIGN - header.length) & (ALIGN - 1));
+		}
+	});
+
+	// The new buffer keeps a side list of frame lengths, as CircularOutput does.
+	CircularBuffer cb(buffer_size);
+	std::vector<size_t> positions(num_frames);
+	unsigned int first = 0;
+	double new_write = timeIt([&]() {
+		for (unsigned int i = 0; i < num_frames; i++)
+		{
+			uint8_t *dst;
+			while (!(dst = cb.Reserve(recordSize(sizes[i]))))
+				cb.Release(recordSize(sizes[first++]));
+			positions[i] = cb.Offset(dst);
+			Header header = { sizes[i], i % 30 == 0, i * 33333LL };
+			memcpy(dst, &header, sizeof(header));
+			memcpy(dst + sizeof(header), data.data(), sizes[i]);
+			cb.Commit(recordSize(sizes[i]));
+		}
+	});
+	unsigned int new_calls = 0;
+	double new_dump = timeIt([&]() {
+		for (unsigned int i = first; i < num_frames; i++, new_calls++)
+		{
+			if (write(fd, cb.Data(positions[i]) + sizeof(Header), sizes[i]) != (ssize_t)sizes[i])
+				throw std::runtime_error("write failed");
+		}
+	});
+	close(fd);
+
+	std::cout << "Buffer " << (buffer_size >> 20) << "MB, " << num_frames << " frames" << std::endl;
+	std::cout << "two-piece ring: " << old_write * 1e9 / num_frames << " ns/frame, dump "
+			  << old_dump * 1e3 << " ms in " << old_calls << " writes" << std::endl;
+	std::cout << "bip buffer:     " << new_write * 1e9 / num_frames << " ns/frame, dump "
+			  << new_dump * 1e3 << " ms in " << new_calls << " writes" << std::endl;
+	return 0;
+}
@@ -0,0 +1,386 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * pipeline_bench.cpp - measure capture, encode and output end to end.
+ */
+
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "core/libcamera_encoder.hpp"
+#include "output/circular_output.hpp"
+#include "output/file_output.hpp"
+#include "output/net_output.hpp"
+
+// Usage: pipeline-bench [--bench-codecs h264,mjpeg,yuv420] [--bench-outputs file,tcp,circular]
+//                       [--bench-clients N] [--bench-frames N] [--bench-json file] [any video options]
+//
+// Runs the camera (or --source pattern/file, for repeatable numbers without
+// hardware) through every codec into every output in turn, and writes one JSON
+// document with the results. For each combination we report:
+//
+// - throughput: frames and bytes per second out of the output,
+// - latency p50/p99, all measured from the sensor timestamp, at the point where
+//   the application gets the frame ("capture"), where the encoder hands back
+//   the encoded frame ("encode") and where the output has finished with it, so
+//   for tcp once the last byte has been sent to every client ("output"),
+// - CPU time (user + system) of this process per frame output; tcp clients are
+//   separate processes, so they are not included,
+// - frames lost before they reached us (gaps in the sensor timestamps) and
+//   frames that went into the encoder but never came out.
+//
+// A combination that fails (for example h264 with a synthetic source, whose
+// buffers the V4L2 codec can't import) gets an "error" instead.
+
+struct BenchOptions : public VideoOptions
+{
+	BenchOptions() : VideoOptions()
+	{
+		using namespace boost::program_options;
+		// clang-format off
+		options_.add_options()
+			("bench-codecs", value<std::string>(&bench_codecs)->default_value("h264,mjpeg,yuv420"),
+			 "Comma separated list of codecs to benchmark")
+			("bench-outputs", value<std::string>(&bench_outputs)->default_value("file,tcp,circular"),
+			 "Comma separated list of outputs to benchmark: file, tcp and/or circular")
+			("bench-clients", value<unsigned int>(&bench_clients)->default_value(2),
+			 "Number of loopback clients reading the tcp output")
+			("bench-port", value<unsigned int>(&bench_port)->default_value(5100),
+			 "Port for the tcp output")
+			("bench-frames", value<unsigned int>(&bench_frames)->default_value(300),
+			 "Number of frames to capture for each combination")
+			("bench-dir", value<std::string>(&bench_dir)->default_value("/tmp"),
+			 "Directory for the file and circular outputs, which are deleted afterwards")
+			("bench-json", value<std::string>(&bench_json),
+			 "Write the results to this file instead of stdout")
+			;
+		// clang-format on
+	}
+
+	std::string bench_codecs;
+	std::string bench_outputs;
+	unsigned int bench_clients;
+	unsigned int bench_port;
+	unsigned int bench_frames;
+	std::string bench_dir;
+	std::string bench_json;
+
+	virtual void Print() const override
+	{
+		VideoOptions::Print();
+		std::cerr << "    bench-codecs: " << bench_codecs << std::endl;
+		std::cerr << "    bench-outputs: " << bench_outputs << std::endl;
+		std::cerr << "    bench-clients: " << bench_clients << std::endl;
+		std::cerr << "    bench-port: " << bench_port << std::endl;
+		std::cerr << "    bench-frames: " << bench_frames << std::endl;
+		std::cerr << "    bench-dir: " << bench_dir << std::endl;
+		std::cerr << "    bench-json: " << bench_json << std::endl;
+	}
+};
+
+struct Result
+{
+	std::string codec;
+	std::string output;
+	std::string error;
+	unsigned int frames_captured = 0;
+	unsigned int frames_encoded = 0; // handed to the encoder
+	unsigned int frames_output = 0;
+	unsigned int dropped_capture = 0;
+	uint64_t bytes_output = 0;
+	int64_t first_output_us = 0, last_output_us = 0;
+	double cpu_us = 0;
+	std::vector<int64_t> capture_us, encode_us, output_us;
+};
+
+static std::vector<std::string> split(std::string const &list)
+{
+	std::vector<std::string> items;
+	std::stringstream ss(list);
+	for (std::string item; std::getline(ss, item, ',');)
+	{
+		if (!item.empty())
+			items.push_back(item);
+	}
+	return items;
+}
+
+static int64_t now_us()
+{
+	// steady_clock is CLOCK_MONOTONIC, the same clock as sensor timestamps.
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+			   std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+static double cpu_us()
+{
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e6 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// A client just reads and discards everything until the server goes away.
+static pid_t start_client(unsigned int port)
+{
+	pid_t pid = fork();
+	if (pid < 0)
+		throw std::runtime_error("failed to fork tcp client");
+	if (pid)
+		return pid;
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+		_exit(1);
+	static char buf[256 << 10];
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	_exit(0);
+}
+
+static void capture_frames(LibcameraEncoder &app, BenchOptions const *options, Result &result)
+{
+	int64_t frame_duration_us = 1e6 / (options->framerate > 0 ? options->framerate : 30);
+	int64_t last_timestamp_us = 0;
+	double start_cpu = cpu_us();
+	app.StartCamera();
+
+	while (result.frames_captured < options->bench_frames)
+	{
+		std::queue<LibcameraEncoder::Msg> *queue = app.Wait();
+		LibcameraEncoder::Msg msg = std::move(queue->front());
+		queue->pop();
+		if (msg.type == LibcameraEncoder::MsgType::Quit)
+			break;
+		else if (msg.type != LibcameraEncoder::MsgType::RequestComplete)
+			throw std::runtime_error("unrecognised message!");
+
+		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		auto ts = completed_request->metadata.get(controls::SensorTimestamp);
+		int64_t timestamp_us = ts ? *ts / 1000 : now_us();
+		result.capture_us.push_back(now_us() - timestamp_us);
+		if (last_timestamp_us && timestamp_us - last_timestamp_us > frame_duration_us * 3 / 2)
+			result.dropped_capture += (timestamp_us - last_timestamp_us + frame_duration_us / 2) / frame_duration_us - 1;
+		last_timestamp_us = timestamp_us;
+		result.frames_captured++;
+
+		app.EncodeBuffer(completed_request, app.VideoStream());
+		result.frames_encoded++;
+	}
+
+	// Stopping the encoder flushes out whatever it still has.
+	app.StopCamera();
+	app.StopEncoder();
+	result.cpu_us = cpu_us() - start_cpu;
+}
+
+static void run_case(LibcameraEncoder &app, BenchOptions const *options, Output *output, Result &result)
+{
+	// The output callback runs on the encoder's output thread.
+	std::mutex output_mutex;
+	app.SetEncodeOutputReadyCallback([&](void *mem, size_t size, int64_t timestamp_us, int64_t wallclock_us,
+										 bool keyframe) {
+		int64_t encoded = now_us();
+		output->OutputReady(mem, size, timestamp_us, wallclock_us, keyframe);
+		int64_t sent = now_us();
+		std::lock_guard<std::mutex> lock(output_mutex);
+		result.encode_us.push_back(encoded - timestamp_us);
+		result.output_us.push_back(sent - timestamp_us);
+		if (!result.frames_output++)
+			result.first_output_us = sent;
+		else
+			result.bytes_output += size; // frames after the first, over the time since it
+		result.last_output_us = sent;
+	});
+	app.StartEncoder();
+	try
+	{
+		capture_frames(app, options, result);
+	}
+	catch (std::exception const &)
+	{
+		// The encoder must be gone before the callback's references are.
+		app.StopCamera();
+		app.StopEncoder();
+		throw;
+	}
+}
+
+static void run(LibcameraEncoder &app, BenchOptions *options, Result &result)
+{
+	std::string filename = options->bench_dir + "/pipeline-bench-" + result.codec + "." + result.output;
+	options->codec = result.codec;
+	options->circular = 0;
+	options->output.clear();
+
+	std::unique_ptr<Output> output;
+	std::vector<pid_t> clients;
+	if (result.output == "file")
+	{
+		options->output = filename;
+		output = std::make_unique<FileOutput>(options);
+	}
+	else if (result.output == "circular")
+	{
+		options->output = filename;
+		options->circular = 4;
+		output = std::make_unique<CircularOutput>(options);
+	}
+	else if (result.output == "tcp")
+	{
+		options->server = "tcp://0.0.0.0:" + std::to_string(options->bench_port);
+		NetOutput *net_output = new NetOutput(options);
+		output.reset(net_output);
+		net_output->startServer();
+		for (unsigned int i = 0; i < options->bench_clients; i++)
+		{
+			clients.push_back(start_client(options->bench_port));
+			net_output->acceptConnection();
+		}
+	}
+	else
+		throw std::runtime_error("unknown output " + result.output);
+
+	auto finish = [&]() {
+		output.reset();
+		for (pid_t pid : clients)
+			waitpid(pid, nullptr, 0);
+		unlink(filename.c_str());
+	};
+	try
+	{
+		run_case(app, options, output.get(), result);
+	}
+	catch (std::exception const &)
+	{
+		finish();
+		throw;
+	}
+	finish();
+}
+
+static void write_stats(std::ostream &os, char const *name, std::vector<int64_t> &values)
+{
+	int64_t p50 = 0, p99 = 0;
+	if (!values.empty())
+	{
+		std::sort(values.begin(), values.end());
+		p50 = values[values.size() / 2];
+		p99 = values[std::min(values.size() - 1, values.size() * 99 / 100)];
+	}
+	os << "\"" << name << "\": { \"p50\": " << p50 << ", \"p99\": " << p99 << " }";
+}
+
+static void write_json(std::ostream &os, LibcameraEncoder &app, BenchOptions const *options,
+					   std::vector<Result> &results)
+{
+	StreamInfo info;
+	app.VideoStream(&info);
+	os << "{" << std::endl;
+	os << "  \"camera\": \"" << app.CameraId() << "\"," << std::endl;
+	os << "  \"width\": " << info.width << ", \"height\": " << info.height << ", \"framerate\": "
+	   << options->framerate << "," << std::endl;
+	os << "  \"frames\": " << options->bench_frames << ", \"tcp_clients\": " << options->bench_clients << ","
+	   << std::endl;
+	os << "  \"results\": [" << std::endl;
+	for (Result &r : results)
+	{
+		os << "    { \"codec\": \"" << r.codec << "\", \"output\": \"" << r.output << "\",";
+		if (!r.error.empty())
+		{
+			std::string error = r.error;
+			std::replace(error.begin(), error.end(), '"', '\'');
+			os << " \"error\": \"" << error << "\" }";
+		}
+		else
+		{
+			os << std::endl << "      \"frames_captured\": " << r.frames_captured
+			   << ", \"frames_output\": " << r.frames_output << ", \"dropped_capture\": " << r.dropped_capture
+			   << ", \"dropped_encode\": " << r.frames_encoded - r.frames_output << "," << std::endl;
+			double seconds = (r.last_output_us - r.first_output_us) / 1e6;
+			os << "      \"fps\": " << (seconds > 0 ? (r.frames_output - 1) / seconds : 0)
+			   << ", \"bytes_per_second\": " << (uint64_t)(seconds > 0 ? r.bytes_output / seconds : 0)
+			   << ", \"cpu_us_per_frame\": " << (r.frames_output ? r.cpu_us / r.frames_output : 0) << ","
+			   << std::endl;
+			os << "      \"latency_us\": { ";
+			write_stats(os, "capture", r.capture_us);
+			os << ", ";
+			write_stats(os, "encode", r.encode_us);
+			os << ", ";
+			write_stats(os, "output", r.output_us);
+			os << " } }";
+		}
+		os << (&r == &results.back() ? "" : ",") << std::endl;
+	}
+	os << "  ]" << std::endl << "}" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		std::unique_ptr<BenchOptions> bench_options = std::make_unique<BenchOptions>();
+		BenchOptions *options = bench_options.get();
+		LibcameraEncoder app(std::move(bench_options));
+		if (!options->Parse(argc, argv))
+			return 0;
+		if (options->verbose)
+			options->Print();
+
+		signal(SIGPIPE, SIG_IGN);
+		app.OpenCamera();
+		app.ConfigureVideo(LibcameraEncoder::FLAG_VIDEO_NONE);
+
+		std::vector<Result> results;
+		for (std::string const &codec : split(options->bench_codecs))
+		{
+			for (std::string const &output : split(options->bench_outputs))
+			{
+				results.emplace_back();
+				results.back().codec = codec;
+				results.back().output = output;
+				try
+				{
+					run(app, options, results.back());
+				}
+				catch (std::exception const &e)
+				{
+					results.back().error = e.what();
+				}
+				if (options->verbose)
+					std::cerr << "Finished " << codec << " -> " << output << std::endl;
+			}
+		}
+
+		if (options->bench_json.empty())
+			write_json(std::cout, app, options, results);
+		else
+		{
+			std::ofstream file(options->bench_json);
+			if (!file)
+				throw std::runtime_error("failed to open " + options->bench_json);
+			write_json(file, app, options, results);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}